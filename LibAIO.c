@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include "LibFS.h"
+
+// the submission and completion queues are circular arrays of
+// 'ring_entries' slots each, both guarded by 'ring_lock'; a request
+// counts as in flight from its submission until its completion is
+// reaped, and no more than 'ring_entries' may be in flight, so the
+// completion queue can never overflow
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sq_cond = PTHREAD_COND_INITIALIZER; // requests to serve
+static pthread_cond_t cq_cond = PTHREAD_COND_INITIALIZER; // completions to reap
+static FS_Request* sq;
+static FS_Completion* cq;
+static int ring_entries, sq_head, sq_count, cq_head, cq_count, inflight;
+static int stopping;
+static int event_fd = -1;
+
+static pthread_t* workers;
+static int nworkers;
+
+// the file system itself isn't thread-safe: the workers take turns
+static pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// carry out a request with the synchronous API and return its result
+static int run_request(FS_Request* req)
+{
+  switch(req->op) {
+  case FS_OP_OPEN: return File_Open(req->path);
+  case FS_OP_CREATE: return File_Create(req->path);
+  case FS_OP_CLOSE: return File_Close(req->fd);
+  case FS_OP_READ:
+    if(req->offset >= 0 && File_Seek(req->fd, req->offset) < 0) return -1;
+    return File_Read(req->fd, req->buffer, req->size);
+  case FS_OP_WRITE:
+    if(req->offset >= 0 && File_Seek(req->fd, req->offset) < 0) return -1;
+    return File_Write(req->fd, req->buffer, req->size);
+  }
+  osErrno = E_GENERAL;
+  return -1;
+}
+
+// serve requests until the ring is shut down and drained
+static void* worker(void* arg)
+{
+  pthread_mutex_lock(&ring_lock);
+  for(;;) {
+    while(!sq_count && !stopping) pthread_cond_wait(&sq_cond, &ring_lock);
+    if(!sq_count) break;
+    FS_Request req = sq[sq_head];
+    sq_head = (sq_head+1)%ring_entries;
+    sq_count--;
+    pthread_mutex_unlock(&ring_lock);
+
+    FS_Completion c;
+    c.user = req.user;
+    pthread_mutex_lock(&fs_lock);
+    c.result = run_request(&req);
+    c.error = c.result < 0 ? osErrno : 0;
+    pthread_mutex_unlock(&fs_lock);
+
+    pthread_mutex_lock(&ring_lock);
+    cq[(cq_head+cq_count)%ring_entries] = c;
+    cq_count++;
+    pthread_cond_broadcast(&cq_cond);
+    uint64_t one = 1;
+    if(write(event_fd, &one, sizeof(one)) < 0) perror("write eventfd");
+  }
+  pthread_mutex_unlock(&ring_lock);
+  return NULL;
+}
+
+int FS_AsyncInit(int entries, int nthreads)
+{
+  if(workers || entries <= 0 || nthreads <= 0) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  sq = malloc(entries*sizeof(FS_Request));
+  cq = malloc(entries*sizeof(FS_Completion));
+  workers = malloc(nthreads*sizeof(pthread_t));
+  event_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+  if(!sq || !cq || !workers || event_fd < 0) {
+    FS_AsyncShutdown();
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  ring_entries = entries;
+  sq_head = sq_count = cq_head = cq_count = inflight = 0;
+  stopping = 0;
+
+  for(nworkers=0; nworkers<nthreads; nworkers++) {
+    if(pthread_create(&workers[nworkers], NULL, worker, NULL)) {
+      FS_AsyncShutdown();
+      osErrno = E_GENERAL;
+      return -1;
+    }
+  }
+  return event_fd;
+}
+
+int FS_AsyncSubmit(FS_Request* reqs, int n)
+{
+  if(!workers || n < 0) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  pthread_mutex_lock(&ring_lock);
+  int queued = 0;
+  while(queued < n && inflight < ring_entries) {
+    sq[(sq_head+sq_count)%ring_entries] = reqs[queued++];
+    sq_count++;
+    inflight++;
+  }
+  if(queued > 0) pthread_cond_broadcast(&sq_cond);
+  pthread_mutex_unlock(&ring_lock);
+  return queued;
+}
+
+int FS_AsyncReap(FS_Completion* cqes, int max, int min)
+{
+  if(!workers || max < 0) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  pthread_mutex_lock(&ring_lock);
+  if(min > max) min = max;
+  while(cq_count < min && cq_count < inflight) pthread_cond_wait(&cq_cond, &ring_lock);
+  int n = 0;
+  while(n < max && cq_count > 0) {
+    cqes[n++] = cq[cq_head];
+    cq_head = (cq_head+1)%ring_entries;
+    cq_count--;
+    inflight--;
+  }
+  // the eventfd stays readable only while there's something left
+  if(!cq_count) {
+    uint64_t count;
+    if(read(event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) perror("read eventfd");
+  }
+  pthread_mutex_unlock(&ring_lock);
+  return n;
+}
+
+int FS_AsyncShutdown()
+{
+  pthread_mutex_lock(&ring_lock);
+  stopping = 1;
+  pthread_cond_broadcast(&sq_cond);
+  pthread_mutex_unlock(&ring_lock);
+  for(int i=0; i<nworkers; i++) pthread_join(workers[i], NULL);
+
+  free(sq);
+  free(cq);
+  free(workers);
+  sq = NULL;
+  cq = NULL;
+  workers = NULL;
+  nworkers = 0;
+  if(event_fd >= 0) close(event_fd);
+  event_fd = -1;
+  return 0;
+}
@@ -1,8 +1,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include "LibDisk.h"
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 
 typedef struct sector {
   char data[SECTOR_SIZE];
@@ -15,8 +24,587 @@ int diskErrno;
 static sector_t* disk;
 
 // used for statistics
-// static int lastSector = 0;
-// static int seekCount = 0;
+static int lastSector = -1;
+static Disk_Stats_t stats;
+static unsigned int heatReads[TOTAL_SECTORS];
+static unsigned int heatWrites[TOTAL_SECTORS];
+
+// the latency model (if 'modelOn')
+static Disk_Model_t model;
+static int modelOn;
+static int modelEnvChecked;
+
+static Disk_Model_t presets[] = {
+  { 20, 4000, 0.5, 120, 0 },  // hdd: rotating disk
+  { 15, 0, 0, 500, 0 },       // ssd: no seeks
+  { 250, 0, 0, 100, 0 },      // net: round trip per sector
+};
+static char* presetNames[] = { "hdd", "ssd", "net" };
+
+/*
+ * account
+ *
+ * Accounts for an access to a sector in the statistics and charges it
+ * with the latency model.
+ */
+static void account(int sector, int write)
+{
+  if(write) {
+    stats.writes++;
+    stats.bytes_written += SECTOR_SIZE;
+    heatWrites[sector]++;
+  } else {
+    stats.reads++;
+    stats.bytes_read += SECTOR_SIZE;
+    heatReads[sector]++;
+  }
+
+  int distance = 0;
+  if(sector != lastSector+1) {
+    distance = abs(sector-lastSector);
+    stats.seeks++;
+    stats.seek_distance += distance;
+  }
+  lastSector = sector;
+  if(!modelOn) return;
+
+  double us = model.per_op_us;
+  if(distance) us += model.seek_base_us + model.seek_per_sector_us*distance;
+  if(model.bandwidth_mb_s > 0) us += SECTOR_SIZE/model.bandwidth_mb_s;
+  stats.modeled_us += us;
+  if(model.sleep) {
+    struct timespec ts = { (time_t)(us/1e6), (long)((us-(long)(us/1e6)*1e6)*1e3) };
+    nanosleep(&ts, NULL);
+  }
+}
+
+/*
+ * modelFromEnv
+ *
+ * Sets the latency model given in LIBDISK_MODEL, if any (only the
+ * first time it's called).
+ */
+static void modelFromEnv()
+{
+  if(modelEnvChecked) return;
+  modelEnvChecked = 1;
+  char* spec = getenv("LIBDISK_MODEL");
+  if(!spec) return;
+  for(int i=0; i<sizeof(presets)/sizeof(presets[0]); i++) {
+    if(!strcmp(spec, presetNames[i])) {
+      Disk_SetModel(&presets[i]);
+      return;
+    }
+  }
+  Disk_Model_t m;
+  memset(&m, 0, sizeof(m));
+  if(sscanf(spec, "%lf:%lf:%lf:%lf:%d", &m.per_op_us, &m.seek_base_us,
+	    &m.seek_per_sector_us, &m.bandwidth_mb_s, &m.sleep) >= 4)
+    Disk_SetModel(&m);
+  else fprintf(stderr, "LIBDISK_MODEL: can't parse '%s'\n", spec);
+}
+
+// the checksums of all sectors (while 'crcMode' isn't DISK_CRC_OFF),
+// and the function computing them
+static unsigned int* crcs;
+static int crcMode;
+static int crcEnvChecked;
+static unsigned int (*crc32c)(const char* buf, int len);
+
+#define CRC_MAGIC 0x43524331 // "CRC1"
+
+// lookup tables for CRC32C (Castagnoli), eight bytes at a time
+static unsigned int crcTable[8][256];
+
+static void crcTableInit()
+{
+  for(int i=0; i<256; i++) {
+    unsigned int c = i;
+    for(int k=0; k<8; k++) c = (c & 1) ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+    crcTable[0][i] = c;
+  }
+  for(int i=0; i<256; i++)
+    for(int t=1; t<8; t++)
+      crcTable[t][i] = (crcTable[t-1][i] >> 8) ^ crcTable[0][crcTable[t-1][i] & 0xff];
+}
+
+static unsigned int crc32cSoft(const char* buf, int len)
+{
+  const unsigned char* p = (const unsigned char*)buf;
+  unsigned int crc = 0xffffffff;
+  for(; len >= 8; len -= 8, p += 8) {
+    crc ^= p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24;
+    crc = crcTable[7][crc & 0xff] ^ crcTable[6][(crc >> 8) & 0xff] ^
+      crcTable[5][(crc >> 16) & 0xff] ^ crcTable[4][crc >> 24] ^
+      crcTable[3][p[4]] ^ crcTable[2][p[5]] ^ crcTable[1][p[6]] ^ crcTable[0][p[7]];
+  }
+  while(len-- > 0) crc = crcTable[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+#if defined(__x86_64__)
+// a whole sector is split into three streams whose CRCs are computed
+// side by side (the instruction takes three cycles, but a new one can
+// start every cycle); since the CRC of zeros is linear, the CRC of the
+// first stream is carried over the bytes of the next one with a lookup
+// per byte in 'crcShift'
+#define CRC_STREAM 168 // bytes in each stream (8 bytes are left)
+static unsigned int crcShift[4][256];
+
+__attribute__((target("sse4.2")))
+static void crcShiftInit()
+{
+  for(int k=0; k<4; k++)
+    for(int b=0; b<256; b++) {
+      unsigned long long crc = (unsigned int)b << (8*k);
+      for(int i=0; i<CRC_STREAM; i+=8) crc = _mm_crc32_u64(crc, 0);
+      crcShift[k][b] = crc;
+    }
+}
+
+static inline unsigned int crcShifted(unsigned int crc)
+{
+  return crcShift[0][crc & 0xff] ^ crcShift[1][(crc >> 8) & 0xff] ^
+    crcShift[2][(crc >> 16) & 0xff] ^ crcShift[3][crc >> 24];
+}
+
+__attribute__((target("sse4.2")))
+static unsigned int crc32cHw(const char* buf, int len)
+{
+  unsigned long long crc = 0xffffffff;
+  if(len == SECTOR_SIZE) {
+    unsigned long long crc1 = 0, crc2 = 0, v0, v1, v2;
+    for(int i=0; i<CRC_STREAM; i+=8) {
+      memcpy(&v0, buf+i, sizeof(v0));
+      memcpy(&v1, buf+CRC_STREAM+i, sizeof(v1));
+      memcpy(&v2, buf+2*CRC_STREAM+i, sizeof(v2));
+      crc = _mm_crc32_u64(crc, v0);
+      crc1 = _mm_crc32_u64(crc1, v1);
+      crc2 = _mm_crc32_u64(crc2, v2);
+    }
+    crc = crcShifted(crcShifted(crc) ^ crc1) ^ crc2;
+    buf += 3*CRC_STREAM;
+    len -= 3*CRC_STREAM;
+  }
+  for(; len >= 8; len -= 8, buf += 8) {
+    unsigned long long v;
+    memcpy(&v, buf, sizeof(v));
+    crc = _mm_crc32_u64(crc, v);
+  }
+  while(len-- > 0) crc = _mm_crc32_u8(crc, *buf++);
+  return ~(unsigned int)crc;
+}
+#endif
+
+/*
+ * crcSetup
+ *
+ * Turns checksums on in the given mode; unless 'compute' is 0, the
+ * checksums are computed from the current content of the disk.
+ */
+static int crcSetup(int mode, int compute)
+{
+  if(crcTable[0][1] == 0) crcTableInit();
+  crc32c = crc32cSoft;
+#if defined(__x86_64__)
+  if(mode == DISK_CRC_ON && __builtin_cpu_supports("sse4.2")) {
+    if(crcShift[0][1] == 0) crcShiftInit();
+    crc32c = crc32cHw;
+  }
+#endif
+  if(crcs == NULL && (crcs = malloc(TOTAL_SECTORS*sizeof(unsigned int))) == NULL) {
+    diskErrno = E_MEM_OP;
+    return -1;
+  }
+  crcMode = mode;
+  for(int i=0; compute && disk && i<TOTAL_SECTORS; i++)
+    crcs[i] = crc32c(disk[i].data, SECTOR_SIZE);
+  return 0;
+}
+
+/*
+ * checksumsFromEnv
+ *
+ * Turns checksums on if LIBDISK_CHECKSUMS says so (only the first time
+ * it's called).
+ */
+static void checksumsFromEnv()
+{
+  if(crcEnvChecked) return;
+  crcEnvChecked = 1;
+  char* spec = getenv("LIBDISK_CHECKSUMS");
+  if(!spec || !strcmp(spec, "0") || !strcmp(spec, "off")) return;
+  crcSetup(strcmp(spec, "soft") ? DISK_CRC_ON : DISK_CRC_SOFTWARE, 1);
+}
+
+/*
+ * crcFile
+ *
+ * Returns the name of the file holding the checksums of an image
+ * (which the caller frees).
+ */
+static char* crcFile(char* file)
+{
+  char* name = malloc(strlen(file)+5);
+  if(name) sprintf(name, "%s.crc", file);
+  return name;
+}
+
+// striped images: an image name listing several files separated by
+// commas is striped over them, 'stripeChunk' sectors at a time (chunk
+// i goes to file i%n), and each of them is saved or loaded by a thread
+// of its own; each file starts with a header saying which member it is
+// of how many and the chunk size, which must all match when it's loaded
+#define MAX_MEMBERS 16
+#define DEFAULT_CHUNK 16
+#define STRIPE_MAGIC 0x53545231 // "STR1"
+static int stripeChunk = DEFAULT_CHUNK;
+static int stripeEnvChecked;
+
+typedef struct {
+  char* file;
+  int member, members;
+  int write;
+  int error; // what went wrong (-1 if nothing did)
+} stripe_job_t;
+
+/*
+ * stripeFromEnv
+ *
+ * Sets the chunk size given in LIBDISK_STRIPE_CHUNK, if any (only the
+ * first time it's called).
+ */
+static void stripeFromEnv()
+{
+  if(stripeEnvChecked) return;
+  stripeEnvChecked = 1;
+  char* spec = getenv("LIBDISK_STRIPE_CHUNK");
+  if(!spec) return;
+  if(Disk_SetStripeChunk(atoi(spec)) < 0)
+    fprintf(stderr, "LIBDISK_STRIPE_CHUNK: can't use '%s'\n", spec);
+}
+
+/*
+ * stripeTransfer
+ *
+ * Saves or loads the chunks of the image held by a member file, after
+ * the header of a striped image; a member being loaded must have
+ * exactly the size it's saved with, and a header that matches the
+ * image and the chunk size in use.
+ */
+static void* stripeTransfer(void* arg)
+{
+  stripe_job_t* job = (stripe_job_t*)arg;
+  int header[5] = { STRIPE_MAGIC, job->member, job->members, stripeChunk, TOTAL_SECTORS };
+  int headed = job->members > 1; // a single file is a plain image
+  job->error = -1;
+  FILE* f = fopen(job->file, job->write ? "w" : "r");
+  if(f == NULL) {
+    job->error = E_OPENING_FILE;
+    return NULL;
+  }
+  if(job->write) {
+    if(headed && fwrite(header, sizeof(header), 1, f) != 1) {
+      fclose(f);
+      job->error = E_WRITING_FILE;
+      return NULL;
+    }
+  } else {
+    long size = headed ? sizeof(header) : 0;
+    for(int c=job->member; c*stripeChunk<TOTAL_SECTORS; c+=job->members) {
+      int count = TOTAL_SECTORS-c*stripeChunk;
+      size += (count < stripeChunk ? count : stripeChunk)*(long)SECTOR_SIZE;
+    }
+    int saved[5];
+    if(fseek(f, 0, SEEK_END) < 0 || ftell(f) != size || fseek(f, 0, SEEK_SET) < 0 ||
+       (headed && (fread(saved, sizeof(saved), 1, f) != 1 ||
+		   memcmp(saved, header, sizeof(header))))) {
+      fclose(f);
+      job->error = E_READING_FILE;
+      return NULL;
+    }
+  }
+  for(int c=job->member; c*stripeChunk<TOTAL_SECTORS; c+=job->members) {
+    int start = c*stripeChunk;
+    int count = TOTAL_SECTORS-start < stripeChunk ? TOTAL_SECTORS-start : stripeChunk;
+    if(job->write) {
+      if(fwrite(disk+start, sizeof(sector_t), count, f) != count) {
+	job->error = E_WRITING_FILE;
+	break;
+      }
+    } else if(fread(disk+start, sizeof(sector_t), count, f) != count) {
+      job->error = E_READING_FILE;
+      break;
+    }
+  }
+  if(fclose(f) != 0 && job->write && job->error < 0) job->error = E_WRITING_FILE;
+  return NULL;
+}
+
+/*
+ * stripeRun
+ *
+ * Saves or loads the image over all the files listed in 'file', in
+ * parallel. A load fails with E_OPENING_FILE only if none of the files
+ * exist; if just some of them do, the image is damaged.
+ */
+static int stripeRun(char* file, int write)
+{
+  stripe_job_t jobs[MAX_MEMBERS];
+  pthread_t threads[MAX_MEMBERS];
+  int started[MAX_MEMBERS];
+  int n = 0;
+
+  stripeFromEnv();
+  char* names = strdup(file);
+  if(names == NULL) {
+    diskErrno = E_MEM_OP;
+    return -1;
+  }
+  for(char* name=names, *next; name; name=next) {
+    next = strchr(name, ',');
+    if(next) *next++ = '\0';
+    if(!*name || n == MAX_MEMBERS) {
+      free(names);
+      diskErrno = E_INVALID_PARAM;
+      return -1;
+    }
+    jobs[n].file = name;
+    jobs[n].member = n;
+    jobs[n].write = write;
+    n++;
+  }
+  for(int i=0; i<n; i++) jobs[i].members = n;
+
+  // the first member is done by the caller, the others by threads (or
+  // by the caller too if there's no thread to be had)
+  for(int i=1; i<n; i++) {
+    started[i] = pthread_create(&threads[i], NULL, stripeTransfer, &jobs[i]) == 0;
+    if(!started[i]) stripeTransfer(&jobs[i]);
+  }
+  stripeTransfer(&jobs[0]);
+  for(int i=1; i<n; i++) if(started[i]) pthread_join(threads[i], NULL);
+  free(names);
+
+  int missing = 0, error = -1;
+  for(int i=0; i<n; i++) {
+    if(jobs[i].error == E_OPENING_FILE) missing++;
+    if(error < 0) error = jobs[i].error;
+  }
+  if(error < 0) return 0;
+  if(!write && missing) error = missing == n ? E_OPENING_FILE : E_READING_FILE;
+  diskErrno = error;
+  return -1;
+}
+
+// the mirror: every sector written is also sent to a replica, either
+// an image file or a receiver listening on a unix socket, by a
+// background thread; the sectors waiting to be sent are kept in
+// 'mirrorLog' (a sector written again before it's sent only has its
+// record updated), and a writer waits while 'mirrorMax' of them are
+#define MIRROR_BATCH 64
+#define MIRROR_LAG 256 // records in the log unless told otherwise
+
+static pthread_mutex_t mirrorLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mirrorWork = PTHREAD_COND_INITIALIZER; // records to send
+static pthread_cond_t mirrorDone = PTHREAD_COND_INITIALIZER; // records sent
+static pthread_t mirrorThread;
+static int mirrorOn, mirrorStop, mirrorFailed, mirrorBusy;
+static int mirrorFd = -1, mirrorSocket;
+static Disk_MirrorRecord_t* mirrorLog; // circular, 'mirrorMax' records
+static int mirrorMax, mirrorHead, mirrorCount;
+static int mirrorSlot[TOTAL_SECTORS]; // 1 + the record of a waiting sector
+static int mirrorSyncWanted, mirrorSyncs;
+static int mirrorStale; // the replica needs all sectors again
+static unsigned long long mirrorRecords, mirrorStalls; // for the statistics
+static int mirrorEnvChecked;
+
+/*
+ * mirrorSend
+ *
+ * Sends records to the replica (a sync record if 'n' is 0); returns 0
+ * on success.
+ */
+static int mirrorSend(Disk_MirrorRecord_t* records, int n)
+{
+  if(!mirrorSocket) {
+    // the replica is an image, and there's nothing to sync
+    for(int i=0; i<n; i++)
+      if(pwrite(mirrorFd, records[i].data, SECTOR_SIZE, records[i].sector*(off_t)SECTOR_SIZE) != SECTOR_SIZE)
+	return -1;
+    return 0;
+  }
+  Disk_MirrorRecord_t sync;
+  if(n == 0) {
+    memset(&sync, 0, sizeof(sync));
+    sync.sector = DISK_MIRROR_SYNC;
+    records = &sync;
+    n = 1;
+  }
+  char* buf = (char*)records;
+  size_t left = n*sizeof(Disk_MirrorRecord_t);
+  while(left > 0) {
+    ssize_t sent = send(mirrorFd, buf, left, MSG_NOSIGNAL);
+    if(sent <= 0) return -1;
+    buf += sent;
+    left -= sent;
+  }
+  // the receiver answers a sync once its image is saved
+  char ack;
+  if(records == &sync && recv(mirrorFd, &ack, 1, 0) != 1) return -1;
+  return 0;
+}
+
+/*
+ * mirrorRun
+ *
+ * The background thread: sends the records in the log, in batches, and
+ * the syncs asked for once the log is empty. After a failure, records
+ * are dropped (so that writers don't wait forever).
+ */
+static void* mirrorRun(void* arg)
+{
+  static Disk_MirrorRecord_t batch[MIRROR_BATCH];
+  pthread_mutex_lock(&mirrorLock);
+  for(;;) {
+    while(!mirrorCount && !mirrorSyncWanted && !mirrorStop)
+      pthread_cond_wait(&mirrorWork, &mirrorLock);
+    if(!mirrorCount && !mirrorSyncWanted) break;
+    int n = 0;
+    while(n < MIRROR_BATCH && mirrorCount > 0) {
+      batch[n] = mirrorLog[mirrorHead];
+      mirrorSlot[batch[n++].sector] = 0;
+      mirrorHead = (mirrorHead+1)%mirrorMax;
+      mirrorCount--;
+    }
+    mirrorBusy = 1;
+    pthread_cond_broadcast(&mirrorDone); // there's room in the log
+    int failed = mirrorFailed;
+    pthread_mutex_unlock(&mirrorLock);
+
+    if(!failed) failed = mirrorSend(batch, n) < 0;
+
+    pthread_mutex_lock(&mirrorLock);
+    mirrorBusy = 0;
+    mirrorFailed = failed;
+    mirrorRecords += n;
+    if(n == 0) {
+      mirrorSyncWanted = 0;
+      mirrorSyncs++;
+    }
+    pthread_cond_broadcast(&mirrorDone);
+  }
+  pthread_mutex_unlock(&mirrorLock);
+  return NULL;
+}
+
+/*
+ * mirrorPut
+ *
+ * Puts a sector in the log, waiting for room if need be.
+ */
+static void mirrorPut(int sector, char* buffer)
+{
+  pthread_mutex_lock(&mirrorLock);
+  int slot = mirrorSlot[sector]-1;
+  if(slot < 0 && !mirrorFailed) {
+    if(mirrorCount == mirrorMax) mirrorStalls++;
+    while((slot = mirrorSlot[sector]-1) < 0 && mirrorCount == mirrorMax)
+      pthread_cond_wait(&mirrorDone, &mirrorLock);
+    if(slot < 0) {
+      slot = (mirrorHead+mirrorCount++)%mirrorMax;
+      mirrorSlot[sector] = slot+1;
+      mirrorLog[slot].sector = sector;
+      pthread_cond_signal(&mirrorWork);
+    }
+  }
+  if(slot >= 0) memcpy(mirrorLog[slot].data, buffer, SECTOR_SIZE);
+  pthread_mutex_unlock(&mirrorLock);
+}
+
+/*
+ * mirrorFull
+ *
+ * Sends the whole disk to the replica, but for the sectors that don't
+ * match their checksum (the replica may still have them right).
+ */
+static int mirrorFull()
+{
+  if(!mirrorOn) return 0;
+  mirrorStale = 0;
+  for(int i=0; i<TOTAL_SECTORS; i++)
+    if(!crcMode || crc32c(disk[i].data, SECTOR_SIZE) == crcs[i]) mirrorPut(i, disk[i].data);
+  return 0;
+}
+
+/*
+ * mirrorRepair
+ *
+ * Fixes a sector that doesn't match its checksum with the copy on the
+ * replica, if it's an image (the record waiting in the log being the
+ * newest copy); returns -1 if there's no good copy.
+ */
+static int mirrorRepair(int sector)
+{
+  char buf[SECTOR_SIZE];
+  int got = 0;
+  if(!mirrorOn || mirrorSocket) return -1;
+  pthread_mutex_lock(&mirrorLock);
+  int slot = mirrorSlot[sector]-1;
+  if(slot >= 0) {
+    memcpy(buf, mirrorLog[slot].data, SECTOR_SIZE);
+    got = 1;
+  } else if(!mirrorFailed) {
+    // the sector may be in the batch being written
+    while(mirrorBusy) pthread_cond_wait(&mirrorDone, &mirrorLock);
+    got = pread(mirrorFd, buf, SECTOR_SIZE, sector*(off_t)SECTOR_SIZE) == SECTOR_SIZE;
+  }
+  pthread_mutex_unlock(&mirrorLock);
+  if(!got || crc32c(buf, SECTOR_SIZE) != crcs[sector]) return -1;
+  memcpy(disk[sector].data, buf, SECTOR_SIZE);
+  stats.replica_reads++;
+  return 0;
+}
+
+/*
+ * mirrorFromEnv
+ *
+ * Sets up the mirror given in LIBDISK_MIRROR (with the log size given
+ * in LIBDISK_MIRROR_LAG), if any (only the first time it's called).
+ */
+static void mirrorFromEnv()
+{
+  if(mirrorEnvChecked) return;
+  mirrorEnvChecked = 1;
+  char* target = getenv("LIBDISK_MIRROR");
+  if(!target) return;
+  char* lag = getenv("LIBDISK_MIRROR_LAG");
+  if(Disk_SetMirror(target, lag ? atoi(lag) : MIRROR_LAG) < 0)
+    fprintf(stderr, "LIBDISK_MIRROR: can't mirror to '%s'\n", target);
+}
+
+// sectors lent out by Disk_Map() (the number of readers) and
+// Disk_MapWrite() (-1, for the only writer)
+static short mapped[TOTAL_SECTORS];
+
+/*
+ * checkSector
+ *
+ * Makes sure a sector about to be read matches its checksum (or is
+ * fixed from the replica); a sector mapped for writing may be changing,
+ * so it isn't checked.
+ */
+static int checkSector(int sector)
+{
+  if(!crcMode || mapped[sector] < 0 || crc32c(disk[sector].data, SECTOR_SIZE) == crcs[sector])
+    return 0;
+  stats.checksum_errors++;
+  if(mirrorRepair(sector) < 0) {
+    diskErrno = E_CHECKSUM;
+    return -1;
+  }
+  return 0;
+}
 
 /*
  * Disk_Init
@@ -28,12 +616,24 @@ static sector_t* disk;
  */
 int Disk_Init()
 {
-  // create the disk image and fill every sector with zeroes
-  disk = (sector_t *) calloc(TOTAL_SECTORS, sizeof(sector_t));
+  // create the disk image (only once) and fill every sector with zeroes
+  if(disk == NULL) disk = (sector_t *) calloc(TOTAL_SECTORS, sizeof(sector_t));
+  else memset(disk, 0, TOTAL_SECTORS*sizeof(sector_t));
   if(disk == NULL) {
     diskErrno = E_MEM_OP;
     return -1;
   }
+  lastSector = -1;
+  modelFromEnv();
+  checksumsFromEnv();
+  if(crcMode) {
+    unsigned int zero = crc32c(disk[0].data, SECTOR_SIZE);
+    for(int i=0; i<TOTAL_SECTORS; i++) crcs[i] = zero;
+  }
+  // the replica follows at the next save or load (which spares it the
+  // zeroes if an image is loaded next)
+  if(mirrorOn) mirrorStale = 1;
+  else mirrorFromEnv();
   return 0;
 }
 
@@ -53,22 +653,38 @@ int Disk_Save(char* file)
     return -1;
   }
     
-  // open the diskFile
-  if ((diskFile = fopen(file, "w")) == NULL) {
+  // actually write the disk image to the file (or files)
+  if (stripeRun(file, 1) < 0) return -1;
+
+  // the checksums go next to the image (and those of an earlier image
+  // mustn't be left there)
+  char* name = crcFile(file);
+  if(name == NULL) {
+    diskErrno = E_MEM_OP;
+    return -1;
+  }
+  if(!crcMode) {
+    remove(name);
+    free(name);
+    return Disk_MirrorFlush();
+  }
+  int header[2] = { CRC_MAGIC, TOTAL_SECTORS };
+  diskFile = fopen(name, "w");
+  free(name);
+  if (diskFile == NULL) {
     diskErrno = E_OPENING_FILE;
     return -1;
   }
-    
-  // actually write the disk image to a file
-  if ((fwrite(disk, sizeof(sector_t), TOTAL_SECTORS, diskFile)) != TOTAL_SECTORS) {
+  if (fwrite(header, sizeof(header), 1, diskFile) != 1 ||
+      fwrite(crcs, sizeof(unsigned int), TOTAL_SECTORS, diskFile) != TOTAL_SECTORS) {
     fclose(diskFile);
     diskErrno = E_WRITING_FILE;
     return -1;
   }
-    
-  // clean up and return
   fclose(diskFile);
-  return 0;
+
+  // and the replica must have caught up
+  return Disk_MirrorFlush();
 }
 
 /*
@@ -87,22 +703,39 @@ int Disk_Load(char* file)
     return -1;
   }
     
-  // open the diskFile
-  if ((diskFile = fopen(file, "r")) == NULL) {
-    diskErrno = E_OPENING_FILE;
+  // actually read the disk image into memory; the file (or files) must
+  // be exactly the size of the disk
+  if (stripeRun(file, 0) < 0) return -1;
+
+  // load the checksums if the image has them; otherwise, those in use
+  // are computed from the image
+  char* name = crcFile(file);
+  if(name == NULL) {
+    diskErrno = E_MEM_OP;
     return -1;
   }
-    
-  // actually read the disk image into memory
-  if ((fread(disk, sizeof(sector_t), TOTAL_SECTORS, diskFile)) != TOTAL_SECTORS) {
+  diskFile = fopen(name, "r");
+  free(name);
+  if (diskFile == NULL) {
+    if (crcMode && crcSetup(crcMode, 1) < 0) return -1;
+    return mirrorFull();
+  }
+  int header[2];
+  if (crcSetup(crcMode ? crcMode : DISK_CRC_ON, 0) < 0) {
+    fclose(diskFile);
+    return -1;
+  }
+  if (fread(header, sizeof(header), 1, diskFile) != 1 || header[0] != CRC_MAGIC ||
+      header[1] != TOTAL_SECTORS ||
+      fread(crcs, sizeof(unsigned int), TOTAL_SECTORS, diskFile) != TOTAL_SECTORS) {
     fclose(diskFile);
     diskErrno = E_READING_FILE;
     return -1;
   }
-    
-  // clean up and return
   fclose(diskFile);
-  return 0;
+
+  // the replica gets the new image
+  return mirrorFull();
 }
 
 /*
@@ -119,11 +752,14 @@ int Disk_Read(int sector, char* buffer)
     return -1;
   }
     
+  if(checkSector(sector) < 0) return -1;
+
   // copy the memory for the user
   if((memcpy((void*)buffer, (void*)(disk + sector), sizeof(sector_t))) == NULL) {
     diskErrno = E_MEM_OP;
     return -1;
   }
+  account(sector, 0);
     
   return 0;
 }
@@ -146,5 +782,346 @@ int Disk_Write(int sector, char* buffer)
     diskErrno = E_MEM_OP;
     return -1;
   }
+  if(crcMode) crcs[sector] = crc32c(buffer, SECTOR_SIZE);
+  if(mirrorOn) mirrorPut(sector, buffer);
+  account(sector, 1);
+  return 0;
+}
+
+/*
+ * Disk_Map
+ *
+ * Lends out a sector for reading, in place: it's checked and accounted
+ * like it's read, and the pointer is good until Disk_Unmap().
+ */
+const char* Disk_Map(int sector)
+{
+  if((sector < 0) || (sector >= TOTAL_SECTORS) || (disk == NULL) ||
+     mapped[sector] < 0 || mapped[sector] == SHRT_MAX) {
+    diskErrno = E_INVALID_PARAM;
+    return NULL;
+  }
+  if(checkSector(sector) < 0) return NULL;
+  mapped[sector]++;
+  account(sector, 0);
+  return disk[sector].data;
+}
+
+/*
+ * Disk_MapWrite
+ *
+ * Lends out a sector for changing in place (to a single borrower at a
+ * time); it's only accounted as written by Disk_Unmap().
+ */
+char* Disk_MapWrite(int sector)
+{
+  if((sector < 0) || (sector >= TOTAL_SECTORS) || (disk == NULL) || mapped[sector]) {
+    diskErrno = E_INVALID_PARAM;
+    return NULL;
+  }
+  if(checkSector(sector) < 0) return NULL;
+  mapped[sector] = -1;
+  return disk[sector].data;
+}
+
+/*
+ * Disk_Unmap
+ *
+ * Gives back a sector lent out by Disk_Map() or Disk_MapWrite(); a
+ * sector changed in place ('dirty') is written like by Disk_Write().
+ */
+int Disk_Unmap(int sector, int dirty)
+{
+  if((sector < 0) || (sector >= TOTAL_SECTORS) || !mapped[sector] ||
+     (dirty && mapped[sector] > 0)) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  if(mapped[sector] > 0) {
+    mapped[sector]--;
+    return 0;
+  }
+  mapped[sector] = 0;
+  if(!dirty) return 0;
+  if(crcMode) crcs[sector] = crc32c(disk[sector].data, SECTOR_SIZE);
+  if(mirrorOn) mirrorPut(sector, disk[sector].data);
+  account(sector, 1);
+  return 0;
+}
+
+/*
+ * Disk_SetChecksums
+ *
+ * Turns checksums on or off; when turned on, the checksums are
+ * computed from the current content.
+ */
+int Disk_SetChecksums(int mode)
+{
+  if(mode < DISK_CRC_OFF || mode > DISK_CRC_SOFTWARE) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  crcEnvChecked = 1; // an explicit setting takes precedence
+  if(mode != DISK_CRC_OFF) return crcSetup(mode, 1);
+  free(crcs);
+  crcs = NULL;
+  crcMode = DISK_CRC_OFF;
+  return 0;
+}
+
+/*
+ * Disk_GetChecksums
+ *
+ * Returns the checksum mode in use.
+ */
+int Disk_GetChecksums()
+{
+  checksumsFromEnv();
+  return crcMode;
+}
+
+/*
+ * Disk_Scrub
+ *
+ * Verifies the checksums of all sectors.
+ */
+int Disk_Scrub(int* bad, int max)
+{
+  if(!crcMode || disk == NULL) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  int n = 0;
+  for(int i=0; i<TOTAL_SECTORS; i++) {
+    if(mapped[i] < 0 || crc32c(disk[i].data, SECTOR_SIZE) == crcs[i]) continue;
+    if(bad && n < max) bad[n] = i;
+    n++;
+  }
+  return n;
+}
+
+/*
+ * Disk_SetStripeChunk
+ *
+ * Sets the number of sectors per chunk of striped images.
+ */
+int Disk_SetStripeChunk(int sectors)
+{
+  if(sectors <= 0 || sectors > TOTAL_SECTORS) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  stripeEnvChecked = 1; // an explicit setting takes precedence
+  stripeChunk = sectors;
+  return 0;
+}
+
+/*
+ * Disk_GetStripeChunk
+ *
+ * Returns the number of sectors per chunk of striped images.
+ */
+int Disk_GetStripeChunk()
+{
+  stripeFromEnv();
+  return stripeChunk;
+}
+
+/*
+ * Disk_SetMirror
+ *
+ * Mirrors the disk to a replica (or stops mirroring if 'target' is
+ * NULL, once the replica has caught up).
+ */
+int Disk_SetMirror(char* target, int maxLag)
+{
+  mirrorEnvChecked = 1; // an explicit setting takes precedence
+  if(mirrorOn) {
+    pthread_mutex_lock(&mirrorLock);
+    mirrorStop = 1;
+    pthread_cond_signal(&mirrorWork);
+    pthread_mutex_unlock(&mirrorLock);
+    pthread_join(mirrorThread, NULL);
+    close(mirrorFd);
+    free(mirrorLog);
+    mirrorFd = -1;
+    mirrorLog = NULL;
+    mirrorOn = 0;
+  }
+  if(target == NULL) return 0;
+  if(maxLag <= 0 || disk == NULL) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+
+  mirrorSocket = !strncmp(target, "unix:", 5);
+  if(mirrorSocket) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(target+5) >= sizeof(addr.sun_path)) {
+      diskErrno = E_INVALID_PARAM;
+      return -1;
+    }
+    strcpy(addr.sun_path, target+5);
+    mirrorFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(mirrorFd >= 0 && connect(mirrorFd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+      close(mirrorFd);
+      mirrorFd = -1;
+    }
+  } else {
+    mirrorFd = open(target, O_RDWR|O_CREAT, 0644);
+    if(mirrorFd >= 0 && ftruncate(mirrorFd, TOTAL_SECTORS*(off_t)SECTOR_SIZE) < 0) {
+      close(mirrorFd);
+      mirrorFd = -1;
+    }
+  }
+  if(mirrorFd < 0) {
+    diskErrno = E_OPENING_FILE;
+    return -1;
+  }
+  mirrorLog = (Disk_MirrorRecord_t*)malloc(maxLag*sizeof(Disk_MirrorRecord_t));
+  if(mirrorLog == NULL) {
+    close(mirrorFd);
+    mirrorFd = -1;
+    diskErrno = E_MEM_OP;
+    return -1;
+  }
+  memset(mirrorSlot, 0, sizeof(mirrorSlot));
+  mirrorMax = maxLag;
+  mirrorHead = mirrorCount = 0;
+  mirrorStop = mirrorFailed = mirrorBusy = mirrorSyncWanted = 0;
+  if(pthread_create(&mirrorThread, NULL, mirrorRun, NULL)) {
+    close(mirrorFd);
+    free(mirrorLog);
+    mirrorFd = -1;
+    mirrorLog = NULL;
+    diskErrno = E_MEM_OP;
+    return -1;
+  }
+  mirrorOn = 1;
+
+  // the replica becomes a copy of the disk at the next save (or load)
+  mirrorStale = 1;
+  return 0;
+}
+
+/*
+ * Disk_MirrorFlush
+ *
+ * Waits until the replica has caught up with all sectors written so
+ * far (and a receiver has saved them).
+ */
+int Disk_MirrorFlush()
+{
+  if(!mirrorOn) return 0;
+  if(mirrorStale) mirrorFull();
+  pthread_mutex_lock(&mirrorLock);
+  int syncs = mirrorSyncs;
+  mirrorSyncWanted = 1;
+  pthread_cond_signal(&mirrorWork);
+  while(mirrorSyncs == syncs) pthread_cond_wait(&mirrorDone, &mirrorLock);
+  int failed = mirrorFailed;
+  pthread_mutex_unlock(&mirrorLock);
+  if(failed) {
+    diskErrno = E_MIRROR;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Disk_SetModel
+ *
+ * Sets the latency model (or turns it off if 'm' is NULL).
+ */
+int Disk_SetModel(Disk_Model_t* m)
+{
+  if(m && (m->per_op_us < 0 || m->seek_base_us < 0 || m->seek_per_sector_us < 0 ||
+	   m->bandwidth_mb_s < 0)) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  modelEnvChecked = 1; // an explicit model takes precedence
+  modelOn = m != NULL;
+  if(m) model = *m;
+  return 0;
+}
+
+/*
+ * Disk_GetModel
+ *
+ * Copies the latency model in use; returns -1 if there's none.
+ */
+int Disk_GetModel(Disk_Model_t* m)
+{
+  modelFromEnv();
+  if(!modelOn) return -1;
+  if(m) *m = model;
+  return 0;
+}
+
+/*
+ * Disk_GetStats
+ *
+ * Copies the statistics gathered since the last reset.
+ */
+int Disk_GetStats(Disk_Stats_t* st)
+{
+  if(st == NULL) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  *st = stats;
+  pthread_mutex_lock(&mirrorLock);
+  st->mirror_records = mirrorRecords;
+  st->mirror_stalls = mirrorStalls;
+  st->mirror_lag = mirrorCount;
+  pthread_mutex_unlock(&mirrorLock);
+  return 0;
+}
+
+/*
+ * Disk_ResetStats
+ *
+ * Clears the statistics and the heat map.
+ */
+int Disk_ResetStats()
+{
+  memset(&stats, 0, sizeof(stats));
+  pthread_mutex_lock(&mirrorLock);
+  mirrorRecords = mirrorStalls = 0;
+  pthread_mutex_unlock(&mirrorLock);
+  memset(heatReads, 0, sizeof(heatReads));
+  memset(heatWrites, 0, sizeof(heatWrites));
+  return 0;
+}
+
+/*
+ * Disk_DumpHeat
+ *
+ * Writes the number of reads and writes of every sector accessed since
+ * the last reset to a text file.
+ */
+int Disk_DumpHeat(char* file)
+{
+  FILE* heatFile;
+  if (file == NULL) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  if ((heatFile = fopen(file, "w")) == NULL) {
+    diskErrno = E_OPENING_FILE;
+    return -1;
+  }
+  for(int i=0; i<TOTAL_SECTORS; i++) {
+    if(!heatReads[i] && !heatWrites[i]) continue;
+    if(fprintf(heatFile, "%d %u %u\n", i, heatReads[i], heatWrites[i]) < 0) {
+      fclose(heatFile);
+      diskErrno = E_WRITING_FILE;
+      return -1;
+    }
+  }
+  fclose(heatFile);
   return 0;
 }
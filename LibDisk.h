@@ -1,8 +1,9 @@
 //
 // Disk.h
 //
-// Emulates a very simple disk (no timing issues). Allows user to
-// read and write to the disk just as if it was dealing with sectors
+// Emulates a very simple disk (with an optional timing model). Allows
+// user to read and write to the disk just as if it was dealing with
+// sectors
 //
 //
 
@@ -24,6 +25,8 @@ typedef enum {
   E_OPENING_FILE,
   E_WRITING_FILE,
   E_READING_FILE,
+  E_CHECKSUM,     // a sector doesn't match its checksum
+  E_MIRROR,       // the replica couldn't be kept up to date
 } Disk_Error_t;
 
 extern int diskErrno; // used to see what happened w/ disk ops
@@ -34,4 +37,104 @@ int Disk_Load(char* file);
 int Disk_Write(int sector, char* buffer);
 int Disk_Read(int sector, char* buffer);
 
+// zero-copy access: Disk_Map() lends out a sector for reading in place
+// (checked and accounted like Disk_Read()), and Disk_MapWrite() lends
+// it out for changing in place, to one borrower at a time; pointers are
+// good until the sector is given back with Disk_Unmap(), which writes
+// it (like Disk_Write()) if it was changed ('dirty'); a sector mapped
+// for changing can't be mapped again until then
+const char* Disk_Map(int sector);
+char* Disk_MapWrite(int sector);
+int Disk_Unmap(int sector, int dirty);
+
+// striping: an image named "file1,file2,..." (up to 16 files) is saved
+// and loaded over all of them at once, chunk by chunk in turn; the
+// chunk size (16 sectors by default) can also be set through
+// LIBDISK_STRIPE_CHUNK in the environment; each file records its place
+// and the chunk size, and loading fails (E_READING_FILE) if they don't
+// match the files given and the chunk size in use
+int Disk_SetStripeChunk(int sectors);
+int Disk_GetStripeChunk();
+
+// the latency model charges every sector access with a fixed cost, a
+// seek unless the sector follows the one accessed last (a base cost
+// plus a cost per sector of distance), and the transfer of the sector
+// at the given bandwidth; with 'sleep' set, accesses really take that
+// long, otherwise the time is only accounted; the model can also be
+// set through LIBDISK_MODEL in the environment, either as one of the
+// presets "hdd", "ssd" and "net", or as
+// "per_op_us:seek_base_us:seek_per_sector_us:bandwidth_mb_s[:sleep]"
+typedef struct {
+  double per_op_us;
+  double seek_base_us;
+  double seek_per_sector_us;
+  double bandwidth_mb_s; // 0 means transfers are free
+  int sleep;
+} Disk_Model_t;
+
+typedef struct {
+  unsigned long long reads;
+  unsigned long long writes;
+  unsigned long long bytes_read;
+  unsigned long long bytes_written;
+  unsigned long long seeks;         // non-sequential accesses
+  unsigned long long seek_distance; // total sectors crossed by seeks
+  double modeled_us;                // time charged by the latency model
+  unsigned long long checksum_errors; // sectors that didn't match their checksum
+  unsigned long long replica_reads;   // ... and were read from the replica
+  unsigned long long mirror_records;  // sectors sent to the replica
+  unsigned long long mirror_stalls;   // writes that waited for the replica
+  unsigned long long mirror_lag;      // sectors waiting to be sent (now)
+} Disk_Stats_t;
+
+int Disk_SetModel(Disk_Model_t* model); // NULL turns the model off
+int Disk_GetModel(Disk_Model_t* model); // -1 if there's no model
+int Disk_GetStats(Disk_Stats_t* stats);
+int Disk_ResetStats();
+// write the reads and writes of every sector accessed since the last
+// reset to 'file', one "sector reads writes" line per sector
+int Disk_DumpHeat(char* file);
+
+// checksums: while they're on, a CRC32C of every sector is kept,
+// updated by Disk_Write() and verified by Disk_Read(), which fails with
+// E_CHECKSUM on a mismatch; Disk_Save() writes them next to the image
+// as "<file>.crc", and Disk_Load() loads them along with it (turning
+// them on); they can also be turned on by setting LIBDISK_CHECKSUMS in
+// the environment ("soft" forces the table-driven CRC even if the CPU
+// has an instruction for it)
+typedef enum {
+  DISK_CRC_OFF,
+  DISK_CRC_ON,        // with the SSE4.2 instruction where there is one
+  DISK_CRC_SOFTWARE,  // table-driven
+} Disk_Checksums_t;
+int Disk_SetChecksums(int mode); // the current content is taken as good
+int Disk_GetChecksums();
+// verify every sector without accounting any access, putting up to
+// 'max' bad ones in 'bad'; return the number of bad sectors
+int Disk_Scrub(int* bad, int max);
+
+// mirroring: every sector written is also sent, by a background
+// thread, to a replica that's kept a full image (so it can be booted
+// with FS_Boot() if the disk is lost); the target is either an image
+// file or "unix:<path>", a receiver listening on a unix socket (like
+// slow-replica.exe); up to 'maxLag' sectors may be waiting to be sent
+// before writes have to wait; the whole disk is sent when the mirror
+// is set up or the disk initialized, at the next Disk_Load() or
+// Disk_Save(), and Disk_Save() waits for the replica to catch up
+// (failing with E_MIRROR if it couldn't); a sector that doesn't match
+// its checksum is read from an image replica instead; a mirror can
+// also be set up through LIBDISK_MIRROR (and LIBDISK_MIRROR_LAG) in
+// the environment
+int Disk_SetMirror(char* target, int maxLag); // NULL stops mirroring
+int Disk_MirrorFlush();
+
+// what a receiver gets: a record per sector written, and a record for
+// DISK_MIRROR_SYNC when the replica has to catch up, which it answers
+// with a byte once the records before it are safe
+#define DISK_MIRROR_SYNC -1
+typedef struct {
+  int sector;
+  char data[SECTOR_SIZE];
+} Disk_MirrorRecord_t;
+
 #endif // __Disk_H__
@@ -1,23 +1,37 @@
 #include <assert.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include "LibDisk.h"
 #include "LibFS.h"
+#include "LibLZ.h"
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
-// set to 1 to have detailed debug print-outs and 0 to have none
-#define FSDEBUG 0
+// detailed debug print-outs go to the trace ring (see FS_Trace());
+// while tracing is off, they cost a single test and their arguments
+// aren't even evaluated
+static int trace_on;
+static void trace_printf(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+#define dprintf(...) do { if(trace_on) trace_printf(__VA_ARGS__); } while(0)
 
-#if FSDEBUG
-#define dprintf printf
-#else
-#define dprintf noprintf
-void noprintf(char* str, ...) {}
-#endif
+// all disk accesses are counted (see FS_GetStats())
+static int counted_disk_read(int sector, char* buffer);
+static int counted_disk_write(int sector, char* buffer);
+static const char* counted_disk_map(int sector);
+#define Disk_Read(sector, buffer) counted_disk_read(sector, buffer)
+#define Disk_Write(sector, buffer) counted_disk_write(sector, buffer)
+#define Disk_Map(sector) counted_disk_map(sector)
 
 
-// the file system partitions the disk into five parts:
+// the file system partitions the disk into five parts (repeated in
+// each block group on a grouped disk, see below):
 
 // 1. the superblock (one sector), which contains a magic number at
 // its first four bytes (integer)
@@ -26,52 +40,158 @@ void noprintf(char* str, ...) {}
 // the magic number chosen for our file system
 #define OS_MAGIC 0xdeadbeef
 
+// the superblock records the version of the on-disk format: the first
+// file systems (version 1, recorded as 0 since they predate the field)
+// store inodes and dirents exactly as they're laid out in memory,
+// whereas version 2 packs them (see packed_inode_t and packed_dirent_t
+// below), so that twice as many inodes and a fifth more dirents fit in
+// a sector, and version 3 packs them too but also spreads the fixed
+// part of the disk over block groups (see below); disks of all three
+// versions can be booted, and new ones are formatted with version 3
+// unless LIBFS_FORMAT=1 or LIBFS_FORMAT=2 is set in the environment
+#define FS_VERSION_PACKED 2
+#define FS_VERSION_GROUPED 3
+static int packed_format; // nonzero if the disk booted is packed
+static int grouped_format; // nonzero if it has block groups
+
+// the superblock also records where the reference counts of shared
+// data sectors are kept: one byte per disk sector, counting the
+// references beyond the first one (so zero means the sector belongs to
+// a single file); the sectors holding the counts are taken from the
+// data blocks the first time a sector gets shared, so that disks
+// without shared sectors (including those formatted by earlier
+// versions) have none
+#define REFCNT_SECTORS ((TOTAL_SECTORS+SECTOR_SIZE-1)/SECTOR_SIZE)
+#define MAX_SECTOR_REFS 255
+
 // 2. the inode bitmap (one or more sectors), which indicates whether
 // the particular entry in the inode table (#4) is currently in use
 #define INODE_BITMAP_START_SECTOR 1
 
 // the total number of bytes and sectors needed for the inode bitmap;
 // we use one bit for each inode (whether it's a file or directory) to
-// indicate whether the particular inode in the inode table is in use
+// indicate whether the particular inode in the inode table is in use;
+// a grouped disk has a sector of it in each block group instead
 #define INODE_BITMAP_SIZE ((MAX_FILES+7)/8) //why 7? doing  ceilling!
-#define INODE_BITMAP_SECTORS ((INODE_BITMAP_SIZE+SECTOR_SIZE-1)/SECTOR_SIZE) //ceilling!
+#define INODE_BITMAP_SECTORS (grouped_format ? GROUPS : \
+			      (INODE_BITMAP_SIZE+SECTOR_SIZE-1)/SECTOR_SIZE) //ceilling!
 
 // 3. the sector bitmap (one or more sectors), which indicates whether
 // the particular sector in the disk is currently in use
-#define SECTOR_BITMAP_START_SECTOR (INODE_BITMAP_START_SECTOR+INODE_BITMAP_SECTORS)
+#define SECTOR_BITMAP_START_SECTOR (INODE_BITMAP_START_SECTOR+(grouped_format ? 1 : INODE_BITMAP_SECTORS))
 
 // the total number of bytes and sectors needed for the data block
 // bitmap (we call it the sector bitmap); we use one bit for each
-// sector of the disk to indicate whether the sector is in use or not
+// sector of the disk to indicate whether the sector is in use or not;
+// again, a grouped disk has a sector of it in each block group
 #define SECTOR_BITMAP_SIZE ((TOTAL_SECTORS+7)/8)
-#define SECTOR_BITMAP_SECTORS ((SECTOR_BITMAP_SIZE+SECTOR_SIZE-1)/SECTOR_SIZE)
-char all_bitmap[INODE_BITMAP_SECTORS+INODE_BITMAP_SECTORS][512];
+#define SECTOR_BITMAP_SECTORS (grouped_format ? GROUPS : \
+			       (SECTOR_BITMAP_SIZE+SECTOR_SIZE-1)/SECTOR_SIZE)
+
+// the number of bits in a sector of either bitmap: on a grouped disk,
+// one for each inode or sector of its block group (the rest of the
+// sector is unused)
+#define INODE_BITMAP_BITS (grouped_format ? GROUP_INODES : SECTOR_SIZE*8)
+#define SECTOR_BITMAP_BITS (grouped_format ? GROUP_SECTORS : SECTOR_SIZE*8)
+#define BITMAP_BITS(start) ((start) == INODE_BITMAP_START_SECTOR ? INODE_BITMAP_BITS : \
+			    SECTOR_BITMAP_BITS)
+
+// the disk sector holding sector 'i' of the bitmap starting at 'start'
+#define BITMAP_SECTOR(start, i) (grouped_format ? (i)*GROUP_SECTORS+(start) : (start)+(i))
+
+// test or set bit 'pos' of a bitmap loaded as an array of its sectors
+// of 'bits' bits each
+#define BITMAP_TEST(bitmap, bits, pos) ((bitmap)[(pos)/(bits)][(pos)%(bits)/8] & (128 >> ((pos)%8)))
+#define BITMAP_SET(bitmap, bits, pos) ((bitmap)[(pos)/(bits)][(pos)%(bits)/8] |= 128 >> ((pos)%8))
+
 // 4. the inode table (one or more sectors), which contains the inodes
 // stored consecutively
-#define INODE_TABLE_START_SECTOR (SECTOR_BITMAP_START_SECTOR+SECTOR_BITMAP_SECTORS)
+#define INODE_TABLE_START_SECTOR (SECTOR_BITMAP_START_SECTOR+(grouped_format ? 1 : SECTOR_BITMAP_SECTORS))
 
 // an inode is used to represent each file or directory; the data
 // structure supposedly contains all necessary information about the
 // corresponding file or directory
 typedef struct _inode {
   int size; // the size of the file or number of directory entries
-  int type; // 0 means regular file; 1 means directory
+  short type; // 0 means regular file; 1 means directory
+  short flags; // INODE_* flags below (always zero on older disks)
   int data[MAX_SECTORS_PER_FILE]; // indices to sectors containing data blocks
 } inode_t;
 
+// an inode as it's stored on packed disks: sizes never exceed
+// MAX_FILE_SIZE nor sector numbers TOTAL_SECTORS, so 16 bits hold
+// either, and the inode takes 64 bytes instead of 128
+typedef struct _packed_inode {
+  unsigned short size;
+  unsigned char type;
+  unsigned char flags;
+  unsigned short data[MAX_SECTORS_PER_FILE];
+} packed_inode_t;
+
+// a small file keeps its content in the space of data[] itself rather
+// than in data blocks, so that it needs no data sector at all and
+// reading it costs a single inode table read; a newly created file
+// starts out this way, and is moved to data blocks once it grows past
+// INLINE_MAX bytes
+#define INODE_INLINE 0x1
+#define INLINE_MAX ((int)(packed_format ? sizeof(((packed_inode_t*)0)->data) : \
+			  sizeof(((inode_t*)0)->data)))
+
+// a compressed file keeps its whole content as one compressed stream
+// in its data blocks: a 4-byte header with the compressed length (0 if
+// the content didn't compress and is stored as is), then the data
+#define INODE_COMPRESSED 0x2
+
 // the inode structures are stored consecutively and yet they don't
 // straddle accross the sector boundaries; that is, there may be
 // fragmentation towards the end of each sector used by the inode
 // table; each entry of the inode table is an inode structure; there
 // are as many entries in the table as the number of files allowed in
 // the system; the inode bitmap (#2) indicates whether the entries are
-// current in use or not
-#define INODES_PER_SECTOR (SECTOR_SIZE/sizeof(inode_t))
+// current in use or not; the table is half as long on packed disks
+#define INODES_PER_SECTOR ((int)(packed_format ? SECTOR_SIZE/sizeof(packed_inode_t) : \
+				 SECTOR_SIZE/sizeof(inode_t)))
 #define INODE_TABLE_SECTORS ((MAX_FILES+INODES_PER_SECTOR-1)/INODES_PER_SECTOR)
+#define MAX_INODE_TABLE_SECTORS ((int)((MAX_FILES+SECTOR_SIZE/sizeof(inode_t)-1)/ \
+				       (SECTOR_SIZE/sizeof(inode_t))))
+
+// the disk sector holding sector 't' of the inode table, and the other
+// way round
+#define INODE_TABLE_SECTOR(t) (grouped_format ? (t)/GROUP_TABLE_SECTORS*GROUP_SECTORS+ \
+			       INODE_TABLE_START_SECTOR+(t)%GROUP_TABLE_SECTORS : \
+			       INODE_TABLE_START_SECTOR+(t))
+#define INODE_TABLE_INDEX(sector) (grouped_format ? (sector)/GROUP_SECTORS*GROUP_TABLE_SECTORS+ \
+				   (sector)%GROUP_SECTORS-INODE_TABLE_START_SECTOR : \
+				   (sector)-INODE_TABLE_START_SECTOR)
+
+// a sector of the inode table is always handled unpacked, as an array
+// of inode_t (see inodes_read()), in a buffer of this size
+#define INODE_BUFFER_SIZE (SECTOR_SIZE/sizeof(packed_inode_t)*sizeof(inode_t))
 
 // 5. the data blocks; all the rest sectors are reserved for data
 // blocks for the content of files and directories
-#define DATABLOCK_START_SECTOR (INODE_TABLE_START_SECTOR+INODE_TABLE_SECTORS)
+#define DATABLOCK_START_SECTOR (INODE_TABLE_START_SECTOR+ \
+				(grouped_format ? GROUP_TABLE_SECTORS : INODE_TABLE_SECTORS))
+
+// on a grouped disk, the disk is cut into block groups of GROUP_SECTORS
+// sectors (the last one may be shorter), and each of them starts with
+// a fixed part laid out like that of the first group: a sector that
+// holds the superblock in the first group and is unused in the others,
+// the group's sectors of both bitmaps, and its part of the inode table
+// (GROUP_INODES inodes); the rest of the group holds data blocks; new
+// inodes are taken from the group of their parent directory, and data
+// blocks from the group of their inode, as long as there's room (see
+// alloc_near()), so that going from an inode to its data or its
+// children doesn't seek across the disk
+#define GROUP_SECTORS 2048
+#define GROUPS ((TOTAL_SECTORS+GROUP_SECTORS-1)/GROUP_SECTORS)
+#define GROUP_INODES (((MAX_FILES+GROUPS-1)/GROUPS+7)/8*8) // whole packed sectors
+#define GROUP_TABLE_SECTORS (GROUP_INODES/INODES_PER_SECTOR)
+
+// return 1 if 'sector' belongs to the fixed part of the disk (or of its
+// block group)
+#define FIXED_SECTOR(sector) (grouped_format ? (sector)%GROUP_SECTORS < DATABLOCK_START_SECTOR : \
+			      (sector) < DATABLOCK_START_SECTOR)
 
 // other file related definitions
 
@@ -92,8 +212,43 @@ typedef struct _dirent {
   int inode; // inode of the file
 } dirent_t;
 
+// a directory entry as it's stored on packed disks: the inode number
+// in 16 bits (little-endian, byte by byte, since the entries aren't
+// aligned) and the name without its ending null when it's MAX_NAME-1
+// bytes long
+typedef struct _packed_dirent {
+  unsigned char inode[2];
+  char fname[MAX_NAME-1];
+} packed_dirent_t;
+
 // the number of directory entries that can be contained in a sector
-#define DIRENTS_PER_SECTOR (SECTOR_SIZE/sizeof(dirent_t))
+#define DIRENT_SIZE ((int)(packed_format ? sizeof(packed_dirent_t) : sizeof(dirent_t)))
+#define DIRENTS_PER_SECTOR (SECTOR_SIZE/DIRENT_SIZE)
+
+// like those of the inode table, a sector of dirents is always handled
+// unpacked (see dirents_read()), in a buffer of this size
+#define DIRENT_BUFFER_SIZE (SECTOR_SIZE/sizeof(packed_dirent_t)*sizeof(dirent_t))
+
+// a snapshot is a frozen copy of the inode table sectors in use when
+// it was taken; the data sectors (including those holding dirents) are
+// shared with the live file system through their reference counts and
+// copied on write; the locations of the inode table copies are listed
+// in the snapshot's map sectors, where 0 means none of the inodes in
+// that part of the table was in use
+#define MAX_SNAPSHOTS 8
+#define SNAPSHOT_MAP_SECTORS ((MAX_INODE_TABLE_SECTORS*sizeof(int)+SECTOR_SIZE-1)/SECTOR_SIZE)
+typedef struct _snapshot {
+  char name[MAX_NAME]; // name of the snapshot (empty if slot not used)
+  int map[SNAPSHOT_MAP_SECTORS]; // sectors listing the inode table copies
+} snapshot_t;
+
+typedef struct _superblock {
+  int magic; // must be OS_MAGIC
+  int refcnt[REFCNT_SECTORS]; // sectors holding the counts (0 if not allocated)
+  snapshot_t snapshots[MAX_SNAPSHOTS];
+  int dedup; // nonzero if identical full blocks are shared (dedup mode)
+  int version; // format version (0 for version 1, FS_VERSION_PACKED or FS_VERSION_GROUPED)
+} superblock_t;
 
 // global errno value here
 int osErrno;
@@ -101,17 +256,385 @@ int osErrno;
 // the name of the disk backstore file (with which the file system is booted)
 static char bs_filename[1024];
 
+// the snapshot mounted read-only by FS_BootSnapshot() (-1 if the live
+// file system is mounted), and where its inode table copies are
+static int mounted_snapshot = -1;
+static int snapshot_table[MAX_INODE_TABLE_SECTORS];
+
+// in dedup mode, the full data blocks of regular files are indexed by
+// the hash of their content, so that a block written again can share
+// the sector already holding it; the index lives in memory only (it's
+// rebuilt at boot) and chains sectors with the same hash bucket; 0 is
+// the superblock and never a data sector, so it ends a chain; since a
+// match is always compared with the sector's content, an entry that
+// has gone stale can't cause wrong sharing, but freed sectors must be
+// dropped since their content may be reused for anything
+#define DEDUP_BUCKETS 4096
+static int dedup_enabled;
+static int dedup_head[DEDUP_BUCKETS];
+static int dedup_next[TOTAL_SECTORS];
+static unsigned int dedup_hashes[TOTAL_SECTORS];
+static char dedup_indexed[TOTAL_SECTORS];
+
+
+// statistics are gathered for the outermost public call under way
+// (calls it makes to other public functions are part of it)
+static FS_Stats_t stats;
+static int current_api = -1;
+static int api_depth;
+
+#define COUNT(field) do { if(current_api >= 0) stats.api[current_api].field++; } while(0)
+
+static const char* api_names[FS_API_COUNT] = {
+  "FS_Boot", "FS_Sync", "FS_SetDedup", "FS_Snapshot", "FS_SnapshotDelete",
+  "FS_BootSnapshot", "File_Create", "File_Open", "File_Read", "File_Write",
+  "File_Seek", "File_Close", "File_Unlink", "File_CreateMany", "File_UnlinkMany",
+  "File_Rename", "File_Copy", "File_SetCompression", "File_Stat", "Dir_Create",
+  "Dir_Unlink", "Dir_Size", "Dir_Read", "FS_Check", "FS_Fragmentation", "FS_Defrag",
+  "File_Mmap", "File_Munmap", "File_Truncate", "File_Allocate", "File_Append",
+  "Dir_OpenHandle", "Dir_CloseHandle", "File_OpenAt", "File_CreateAt", "File_UnlinkAt",
+};
+
+// the trace ring keeps the last TRACE_ENTRIES messages; 'trace_next'
+// counts all messages ever traced and 'trace_seen' those handed out
+// by FS_TraceRead() (or dropped since the ring wrapped around)
+#define TRACE_ENTRIES 1024
+#define TRACE_MSG 100
+typedef struct _trace_entry {
+  unsigned long long ns; // when it was traced
+  int api; // the public call under way (-1 if none)
+  char msg[TRACE_MSG];
+} trace_entry_t;
+static trace_entry_t trace_ring[TRACE_ENTRIES];
+static unsigned long long trace_next, trace_seen;
+
+static unsigned long long now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+static void trace_printf(const char* fmt, ...)
+{
+  trace_entry_t* e = &trace_ring[trace_next++%TRACE_ENTRIES];
+  e->ns = now_ns();
+  e->api = current_api;
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(e->msg, TRACE_MSG, fmt, ap);
+  va_end(ap);
+  // one line per message
+  for(char* c=e->msg; *c; c++) if(*c == '\n') *c = ' ';
+}
+
+static int counted_disk_read(int sector, char* buffer)
+{
+  COUNT(disk_reads);
+  return (Disk_Read)(sector, buffer);
+}
+
+static int counted_disk_write(int sector, char* buffer)
+{
+  COUNT(disk_writes);
+  return (Disk_Write)(sector, buffer);
+}
+
+static const char* counted_disk_map(int sector)
+{
+  COUNT(disk_reads);
+  return (Disk_Map)(sector);
+}
+
+// the number of open files File_Append() keeps the end of; the bytes
+// it holds back are written out before any other public call
+static int appending;
+static int append_settle();
+
+// start accounting a public call; return when it started (0 if it's
+// part of an outer public call)
+static unsigned long long api_enter(int api)
+{
+  if(api_depth++ > 0) return 0;
+  current_api = api;
+  stats.api[api].calls++;
+  unsigned long long start = now_ns();
+  if(appending && api != FS_API_FILE_APPEND && append_settle() < 0)
+    dprintf("... failed to write out the bytes held back by File_Append()\n");
+  return start;
+}
+
+// finish accounting a public call that returned 'ret' after moving
+// 'bytes' bytes of data; return 'ret'
+static int api_leave(int api, unsigned long long start, int ret, int bytes)
+{
+  if(--api_depth > 0) return ret;
+  FS_ApiStats_t* s = &stats.api[api];
+  s->nanoseconds += now_ns()-start;
+  if(ret < 0) s->errors++;
+  else s->bytes += bytes;
+  current_api = -1;
+  return ret;
+}
+
 
 /* the following functions are internal helper functions */
 
-// check magic number in the superblock; return 1 if OK, and 0 if not
+// widen the block pointers of a packed inode into those of an inode;
+// with SSE2, eight at a time (the last eight overlapping the ones
+// before if need be)
+static void widen_pointers(const unsigned short* from, int* to)
+{
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  for(int j=0; j<MAX_SECTORS_PER_FILE; j+=8) {
+    if(j > MAX_SECTORS_PER_FILE-8) j = MAX_SECTORS_PER_FILE-8;
+    __m128i v = _mm_loadu_si128((const __m128i*)(from+j));
+    _mm_storeu_si128((__m128i*)(to+j), _mm_unpacklo_epi16(v, zero));
+    _mm_storeu_si128((__m128i*)(to+j+4), _mm_unpackhi_epi16(v, zero));
+  }
+#else
+  for(int j=0; j<MAX_SECTORS_PER_FILE; j++) to[j] = from[j];
+#endif
+}
+
+// narrow the block pointers of an inode into those of a packed inode,
+// keeping the low 16 bits of each (as a cast would)
+static void narrow_pointers(const int* from, unsigned short* to)
+{
+#if defined(__SSE2__)
+  for(int j=0; j<MAX_SECTORS_PER_FILE; j+=8) {
+    if(j > MAX_SECTORS_PER_FILE-8) j = MAX_SECTORS_PER_FILE-8;
+    // sign-extending the low halves keeps the signed pack from saturating
+    __m128i lo = _mm_loadu_si128((const __m128i*)(from+j));
+    __m128i hi = _mm_loadu_si128((const __m128i*)(from+j+4));
+    lo = _mm_srai_epi32(_mm_slli_epi32(lo, 16), 16);
+    hi = _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16);
+    _mm_storeu_si128((__m128i*)(to+j), _mm_packs_epi32(lo, hi));
+  }
+#else
+  for(int j=0; j<MAX_SECTORS_PER_FILE; j++) to[j] = from[j];
+#endif
+}
+
+// unpack a sector of inodes 'sector' as stored on the disk into 'buf'
+// (INODE_BUFFER_SIZE bytes); the content of an inline file is the
+// first bytes of data[], the rest of which is left zero
+static void unpack_inodes(const char* sector, char* buf)
+{
+  if(!packed_format) {
+    memcpy(buf, sector, SECTOR_SIZE);
+    return;
+  }
+  const packed_inode_t* p = (const packed_inode_t*)sector;
+  inode_t* inode = (inode_t*)buf;
+  for(int i=0; i<INODES_PER_SECTOR; i++, p++, inode++) {
+    inode->size = p->size;
+    inode->type = p->type;
+    inode->flags = p->flags;
+    if(p->flags & INODE_INLINE) {
+      memcpy(inode->data, p->data, sizeof(p->data));
+      memset((char*)inode->data+sizeof(p->data), 0, sizeof(inode->data)-sizeof(p->data));
+    } else widen_pointers(p->data, inode->data);
+  }
+}
+
+// pack the inodes in 'buf' into a sector 'sector' to be stored
+static void pack_inodes(const char* buf, char* sector)
+{
+  if(!packed_format) {
+    memcpy(sector, buf, SECTOR_SIZE);
+    return;
+  }
+  packed_inode_t* p = (packed_inode_t*)sector;
+  const inode_t* inode = (const inode_t*)buf;
+  for(int i=0; i<INODES_PER_SECTOR; i++, p++, inode++) {
+    p->size = inode->size;
+    p->type = inode->type;
+    p->flags = inode->flags;
+    if(inode->flags & INODE_INLINE) memcpy(p->data, inode->data, sizeof(p->data));
+    else narrow_pointers(inode->data, p->data);
+  }
+}
+
+// read a sector of inodes into 'buf' (INODE_BUFFER_SIZE bytes); a
+// packed one is unpacked straight from the disk (see Disk_Map())
+static int inodes_read(int sector, char* buf)
+{
+  if(!packed_format) return Disk_Read(sector, buf);
+  const char* stored = Disk_Map(sector);
+  if(!stored) return -1;
+  unpack_inodes(stored, buf);
+  Disk_Unmap(sector, 0);
+  return 0;
+}
+
+// write the inodes in 'buf' to a sector
+static int inodes_write(int sector, char* buf)
+{
+  if(!packed_format) return Disk_Write(sector, buf);
+  char stored[SECTOR_SIZE];
+  pack_inodes(buf, stored);
+  return Disk_Write(sector, stored);
+}
+
+// unpack the first 'n' dirents of a sector 'sector' as stored on the
+// disk into 'buf' (n*sizeof(dirent_t) bytes)
+static void unpack_dirents(const char* sector, char* buf, int n)
+{
+  if(!packed_format) {
+    memcpy(buf, sector, n*sizeof(dirent_t));
+    return;
+  }
+  const packed_dirent_t* p = (const packed_dirent_t*)sector;
+  dirent_t* d = (dirent_t*)buf;
+#if defined(__SSE2__)
+  // a name is loaded with the byte after it (which is still in the
+  // sector, even for the last entry) and that byte is masked off
+  const __m128i keep = _mm_srli_si128(_mm_set1_epi8(-1), 1);
+#endif
+  for(int i=0; i<n; i++, p++, d++) {
+#if defined(__SSE2__)
+    __m128i name = _mm_loadu_si128((const __m128i*)p->fname);
+    _mm_storeu_si128((__m128i*)d->fname, _mm_and_si128(name, keep));
+#else
+    memcpy(d->fname, p->fname, sizeof(p->fname));
+    d->fname[MAX_NAME-1] = '\0';
+#endif
+    d->inode = p->inode[0] | p->inode[1] << 8;
+  }
+}
+
+// pack the dirents in 'buf' into a sector 'sector' to be stored
+static void pack_dirents(const char* buf, char* sector)
+{
+  if(!packed_format) {
+    memcpy(sector, buf, SECTOR_SIZE);
+    return;
+  }
+  memset(sector, 0, SECTOR_SIZE);
+  packed_dirent_t* p = (packed_dirent_t*)sector;
+  const dirent_t* d = (const dirent_t*)buf;
+  for(int i=0; i<DIRENTS_PER_SECTOR; i++, p++, d++) {
+    memcpy(p->fname, d->fname, sizeof(p->fname));
+    p->inode[0] = d->inode & 0xff;
+    p->inode[1] = d->inode >> 8 & 0xff;
+  }
+}
+
+// return the inode number of entry 'i' of a sector of dirents as
+// stored on the disk
+static int stored_dirent_inode(const char* sector, int i)
+{
+  if(!packed_format) return ((const dirent_t*)sector)[i].inode;
+  const packed_dirent_t* p = (const packed_dirent_t*)sector+i;
+  return p->inode[0] | p->inode[1] << 8;
+}
+
+// read a sector of dirents into 'buf' (DIRENT_BUFFER_SIZE bytes)
+static int dirents_read(int sector, char* buf)
+{
+  if(!packed_format) return Disk_Read(sector, buf);
+  const char* stored = Disk_Map(sector);
+  if(!stored) return -1;
+  unpack_dirents(stored, buf, DIRENTS_PER_SECTOR);
+  Disk_Unmap(sector, 0);
+  return 0;
+}
+
+// write the dirents in 'buf' to a sector
+static int dirents_write(int sector, char* buf)
+{
+  if(!packed_format) return Disk_Write(sector, buf);
+  char stored[SECTOR_SIZE];
+  pack_dirents(buf, stored);
+  return Disk_Write(sector, stored);
+}
+
+// read a sector of the inode table into 'buf' (INODE_BUFFER_SIZE
+// bytes); when a snapshot is mounted, the sector comes from the
+// snapshot's copy of the table
+static int inode_table_read(int sector, char* buf)
+{
+  if(mounted_snapshot < 0) return inodes_read(sector, buf);
+  int copy = snapshot_table[INODE_TABLE_INDEX(sector)];
+  if(!copy) {
+    // none of these inodes was in use when the snapshot was taken
+    memset(buf, 0, INODE_BUFFER_SIZE);
+    return 0;
+  }
+  return inodes_read(copy, buf);
+}
+
+// return 1 (and set osErrno) if the file system can't be modified
+// since a snapshot is mounted; otherwise, return 0
+static int is_read_only()
+{
+  if(mounted_snapshot < 0) return 0;
+  dprintf("... file system is mounted read-only\n");
+  osErrno = E_READ_ONLY;
+  return 1;
+}
+
+// hash the content of a data block (FNV-1a)
+static unsigned int block_hash(char* block)
+{
+  unsigned int h = 2166136261u;
+  for(int i=0; i<SECTOR_SIZE; i++)
+    h = (h ^ (unsigned char)block[i])*16777619u;
+  return h;
+}
+
+// drop a sector from the dedup index (if it's there)
+static void dedup_forget(int sector)
+{
+  if(sector <= 0 || sector >= TOTAL_SECTORS || !dedup_indexed[sector]) return;
+  int* link = &dedup_head[dedup_hashes[sector]%DEDUP_BUCKETS];
+  while(*link != sector) link = &dedup_next[*link];
+  *link = dedup_next[sector];
+  dedup_indexed[sector] = 0;
+}
+
+// add a sector holding a block with the given hash to the dedup index
+static void dedup_insert(int sector, unsigned int hash)
+{
+  dedup_forget(sector);
+  int bucket = hash%DEDUP_BUCKETS;
+  dedup_hashes[sector] = hash;
+  dedup_next[sector] = dedup_head[bucket];
+  dedup_head[bucket] = sector;
+  dedup_indexed[sector] = 1;
+}
+
+// return an indexed sector holding exactly the given block, or 0 if
+// there's none
+static int dedup_lookup(char* block, unsigned int hash)
+{
+  char buf[SECTOR_SIZE];
+  for(int s=dedup_head[hash%DEDUP_BUCKETS]; s; s=dedup_next[s]) {
+    if(dedup_hashes[s] != hash || Disk_Read(s, buf) < 0) continue;
+    if(!memcmp(buf, block, SECTOR_SIZE)) return s;
+  }
+  return 0;
+}
+
+// check magic number in the superblock, and take the format version
+// it records; return 1 if OK, and 0 if not
 static int check_magic()
 {
   char buf[SECTOR_SIZE];
   if(Disk_Read(SUPERBLOCK_START_SECTOR, buf) < 0)
     return 0;
-  if(*(int*)buf == OS_MAGIC) return 1;
-  else return 0;
+  superblock_t* super = (superblock_t*)buf;
+  if(super->magic != OS_MAGIC) return 0;
+  if(super->version != 0 && super->version != FS_VERSION_PACKED &&
+     super->version != FS_VERSION_GROUPED) {
+    dprintf("... unknown format version %d\n", super->version);
+    return 0;
+  }
+  packed_format = super->version >= FS_VERSION_PACKED;
+  grouped_format = super->version == FS_VERSION_GROUPED;
+  return 1;
 }
 
 // initialize a bitmap with 'num' sectors starting from 'start'
@@ -155,43 +678,103 @@ static void bitmap_init(int start, int num, int nbits)
   
 }
 
+// the block group allocations start from (see alloc_near()); bitmaps
+// are searched from the sector of that group on, wrapping around, and
+// from their first sector on a flat disk
+static int alloc_goal;
+
+// make the following allocations prefer the block group of inode 'ino'
+// (its parent directory's for a new inode, or its own for its data)
+static void alloc_near(int ino)
+{
+  alloc_goal = ino/GROUP_INODES;
+}
+
+// the sector of a bitmap of 'num' sectors to start searching from
+static int bitmap_first(int num)
+{
+  return grouped_format ? alloc_goal%num : 0;
+}
+
+// the bitmap sectors (of either bitmap) found with no zero left, which
+// the searches skip without reading them until a bit of theirs is
+// reset; nothing is assumed full after booting
+#define MAX_BITMAP_SECTORS (GROUPS > (SECTOR_BITMAP_SIZE+SECTOR_SIZE-1)/SECTOR_SIZE ? GROUPS : \
+			    (SECTOR_BITMAP_SIZE+SECTOR_SIZE-1)/SECTOR_SIZE)
+static char bitmap_full[2][MAX_BITMAP_SECTORS];
+#define BITMAP_FULL(start, i) bitmap_full[(start) != INODE_BITMAP_START_SECTOR][i]
+
+// the free sectors left in the sector bitmap, counted from it the
+// first time they're needed after booting (-1 until then); taking
+// some of them leaves enough for the delayed blocks, see sectors_room()
+static int free_sectors = -1;
+static int sectors_room(int count);
+
+// return the number of free sectors, or -1 on error
+static int sectors_free()
+{
+  if(free_sectors >= 0) return free_sectors;
+  char bitmap[MAX_BITMAP_SECTORS][SECTOR_SIZE];
+  for(int i=0; i<SECTOR_BITMAP_SECTORS; i++)
+    if(Disk_Read(BITMAP_SECTOR(SECTOR_BITMAP_START_SECTOR, i), bitmap[i]) < 0) return -1;
+  int n = 0;
+  for(int s=0; s<TOTAL_SECTORS; s++)
+    if(!BITMAP_TEST(bitmap, SECTOR_BITMAP_BITS, s)) n++;
+  dprintf("... %d free sectors\n", n);
+  return free_sectors = n;
+}
+
+// account for 'count' sectors taken from (or given back to, if
+// negative) the bitmap starting at 'start'
+static void sectors_taken(int start, int count)
+{
+  if(start == SECTOR_BITMAP_START_SECTOR && free_sectors >= 0) free_sectors -= count;
+}
+
+// return the position of the first zero among bits 'from' to 'to'-1
+// of a bitmap sector, skipping 64 bits at a time while they're all
+// set; return -1 if there's none
+static int bitmap_sector_scan(const char* sector, int from, int to)
+{
+  int pos = from;
+  while(pos < to) {
+    if(pos%64 == 0 && pos+64 <= to) {
+      unsigned long long word;
+      memcpy(&word, sector+pos/8, sizeof(word));
+      if(word == ~0ull) { pos += 64; continue; }
+    }
+    if(!(sector[pos/8] & (128 >> (pos%8)))) return pos;
+    pos++;
+  }
+  return -1;
+}
+
 // set the first unused bit from a bitmap of 'nbits' bits (flip the
 // first zero appeared in the bitmap to one) and return its location;
-// return -1 if the bitmap is already full (no more zeros)
+// return -1 if the bitmap is already full (no more zeros); on a
+// grouped disk, the first zero of the goal group's sector is taken,
+// or of the next group with one
 static int bitmap_first_unused(int start, int num, int nbits)
 {
-  /* YOUR CODE */
-  
-  int pos = 0;
-  int j=0;
-  unsigned int set_bit;
-  char t;
-  int k=0;
-  int i;
+  COUNT(bitmap_scans);
+  if(start == SECTOR_BITMAP_START_SECTOR && !sectors_room(1)) return -1;
+  int bits = BITMAP_BITS(start);
   char _bitmap[SECTOR_SIZE];
-  for(i=start;i<start+num;i++)
-  {
-	  Disk_Read(i, _bitmap);
-	  for(j=0;j<SECTOR_SIZE;j++)
-	  {
-		for(k=0;k<8;k++)
-		{
-			set_bit = 128 >> k;
-			t = _bitmap[j] & set_bit;
-			if(t==0)
-			{
-				_bitmap[j] = _bitmap[j] | set_bit;
-				Disk_Write(i, _bitmap);        
-				return pos;
-			}
-			
-			pos++;
-			
-		}
-	  }
-	  
+  for(int k=0; k<num; k++) {
+    int i = (bitmap_first(num)+k)%num;
+    int n = nbits-i*bits < bits ? nbits-i*bits : bits;
+    if(n <= 0 || BITMAP_FULL(start, i)) continue;
+    if(Disk_Read(BITMAP_SECTOR(start, i), _bitmap) < 0) return -1;
+    int pos = bitmap_sector_scan(_bitmap, 0, n);
+    if(pos < 0) {
+      BITMAP_FULL(start, i) = 1;
+      continue;
+    }
+    _bitmap[pos/8] |= 128 >> (pos%8);
+    if(Disk_Write(BITMAP_SECTOR(start, i), _bitmap) < 0) return -1;
+    sectors_taken(start, 1);
+    return i*bits+pos;
   }
-  
   return -1;
 }
 
@@ -200,152 +783,695 @@ static int bitmap_first_unused(int start, int num, int nbits)
 // 'start' sector; return 0 if successful, -1 otherwise
 static int bitmap_reset(int start, int num, int ibit)
 {
-  /* YOUR CODE */
-  
-  int pos = 0;
-  int j=0;
-  unsigned int set_bit;
-  int k=0;
-  int i;
+  COUNT(bitmap_scans);
+  if(start == SECTOR_BITMAP_START_SECTOR) dedup_forget(ibit);
+  int bits = BITMAP_BITS(start);
+  if(ibit < 0 || ibit/bits >= num) return -1;
+
   char _bitmap[SECTOR_SIZE];
-  for(i=start;i<num+start;i++)
-  {
-	  Disk_Read(i, _bitmap);
-	  for(j=0;j<SECTOR_SIZE;j++)
-	  {
-		for(k=0;k<8;k++)
-		{
-			set_bit = 128 >> k;
-			//t = _bitmap[j] & set_bit;
-			if(pos==ibit)
-			{
-				_bitmap[j] = _bitmap[j] & (~set_bit);
-				Disk_Write(i, _bitmap);
-				return 0;
-			}
-			
-			pos++;
-			
-		}
-	  }
-	  
+  int i = BITMAP_SECTOR(start, ibit/bits);
+  BITMAP_FULL(start, ibit/bits) = 0;
+  if(Disk_Read(i, _bitmap) < 0) return -1;
+  int was = _bitmap[ibit%bits/8] & (128 >> (ibit%8));
+  _bitmap[ibit%bits/8] &= ~(128 >> (ibit%8));
+  if(Disk_Write(i, _bitmap) < 0) return -1;
+  if(was) sectors_taken(start, -1);
+  return 0;
+}
+
+// set the first 'count' unused bits from a bitmap of 'nbits' bits in
+// a single pass over the bitmap sectors and return their locations
+// through 'bits' (in increasing order within each block group, and
+// from the goal group on); either all 'count' bits are allocated or
+// none is, in which case the function returns -1
+static int bitmap_alloc_many(int start, int num, int nbits, int count, int* bits)
+{
+  COUNT(bitmap_scans);
+  if(start == SECTOR_BITMAP_START_SECTOR && !sectors_room(count)) return -1;
+  int sbits = BITMAP_BITS(start);
+  char _bitmap[num][SECTOR_SIZE];
+  int dirty[num];
+  int i, k, found = 0;
+
+  for(k=0; k<num && found<count; k++) {
+    i = (bitmap_first(num)+k)%num;
+    dirty[i] = 0;
+    int n = nbits-i*sbits < sbits ? nbits-i*sbits : sbits;
+    if(n <= 0 || BITMAP_FULL(start, i)) continue;
+    if(Disk_Read(BITMAP_SECTOR(start, i), _bitmap[i]) < 0) return -1;
+    if(bitmap_sector_scan(_bitmap[i], 0, n) < 0) BITMAP_FULL(start, i) = 1;
+    for(int pos=bitmap_sector_scan(_bitmap[i], 0, n); pos >= 0 && found < count;
+	pos=bitmap_sector_scan(_bitmap[i], pos+1, n)) {
+      _bitmap[i][pos/8] |= 128 >> (pos%8);
+      dirty[i] = 1;
+      bits[found++] = i*sbits+pos;
+    }
   }
-  
-  return -1;
+  if(found < count) {
+    dprintf("... bitmap has only %d of %d bits available\n", found, count);
+    return -1;
+  }
+
+  // only the sectors visited are written, up to the last one
+  for(int j=0; j<k; j++) {
+    i = (bitmap_first(num)+j)%num;
+    if(dirty[i] && Disk_Write(BITMAP_SECTOR(start, i), _bitmap[i]) < 0) return -1;
+  }
+  sectors_taken(start, count);
+  return 0;
 }
 
-// return 1 if the file name is illegal; otherwise, return 0; legal
-// characters for a file name include letters (case sensitive),
-// numbers, dots, dashes, and underscores; and a legal file name
-// should not be more than MAX_NAME-1 in length
-static int illegal_filename(char* name)
+// set 'count' consecutive unused bits (the first such run, from the
+// goal group on) from a bitmap of 'nbits' bits and return the location
+// of the first one; return -1 if there's no run that long; a run may
+// span flat bitmap sectors but not block groups
+static int bitmap_alloc_run(int start, int num, int nbits, int count)
 {
-  /* YOUR CODE */
-int i,count=0;
-    //printf("%d",strlen(name));
-    if(strlen(name)<=MAX_NAME-1)
-    {
-    for(i=0;i<strlen(name);i++)
-    {
-        if((name[i]>=65 && name[i]<=90) ||(name[i]>=97 && name[i]<=122)||(name[i]>=48 && name[i]<=57) || name[i] == 45 || name[i] == 46 || name[i] == 95)
-            count=count;
-           // printf("%c\n",name[i]);
-        else
-            count++;
-    }
-    if(count == 0)
-        return 0;
-    else
-        return 1;
-    }
-    else
-        return 1;
-        //printf("Illegal Filename. More than Maximum Name Size.");
-  //return 0; 
+  COUNT(bitmap_scans);
+  if(start == SECTOR_BITMAP_START_SECTOR && !sectors_room(count)) return -1;
+  int sbits = BITMAP_BITS(start);
+  char _bitmap[num][SECTOR_SIZE];
+  int k, pos = 0, run = 0;
+
+  for(k=0; k<num && run<count; k++) {
+    int i = (bitmap_first(num)+k)%num;
+    int n = nbits-i*sbits < sbits ? nbits-i*sbits : sbits;
+    if(i == 0 || grouped_format || n <= 0 || BITMAP_FULL(start, i)) run = 0;
+    if(n <= 0 || BITMAP_FULL(start, i)) continue;
+    if(Disk_Read(BITMAP_SECTOR(start, i), _bitmap[i]) < 0) return -1;
+    if(bitmap_sector_scan(_bitmap[i], 0, n) < 0) BITMAP_FULL(start, i) = 1;
+    for(int p=0; p<n && run<count; p++) {
+      if(run == 0) {
+	// look for the next zero a word at a time
+	p = bitmap_sector_scan(_bitmap[i], p, n);
+	if(p < 0) break;
+      }
+      if(_bitmap[i][p/8] & (128 >> (p%8))) run = 0;
+      else run++;
+      pos = i*sbits+p+1;
+    }
+  }
+  if(run < count) {
+    dprintf("... bitmap has no run of %d bits available\n", count);
+    return -1;
+  }
+
+  int first = pos-count;
+  for(pos=first; pos<first+count; pos++)
+    BITMAP_SET(_bitmap, sbits, pos);
+  for(int i=first/sbits; i<=(first+count-1)/sbits; i++) {
+    if(Disk_Write(BITMAP_SECTOR(start, i), _bitmap[i]) < 0) return -1;
+  }
+  sectors_taken(start, count);
+  return first;
 }
 
-// return the child inode of the given file name 'fname' from the
-// parent inode; the parent inode is currently stored in the segment
-// of inode table in the cache (we cache only one disk sector for
-// this); once found, both cached_inode_sector and cached_inode_buffer
-// may be updated to point to the segment of inode table containing
-// the child inode; the function returns -1 if no such file is found;
-// it returns -2 is something else is wrong (such as parent is not
-// directory, or there's read error, etc.)
-static int find_child_inode(int parent_inode, char* fname,
-			    int *cached_inode_sector, char* cached_inode_buffer)
+// reset 'count' bits (given in 'bits') of a bitmap with 'num' sectors
+// starting from 'start' sector, writing each modified sector only
+// once; return 0 if successful, -1 otherwise
+static int bitmap_reset_many(int start, int num, int count, int* bits)
 {
-  int cached_start_entry = ((*cached_inode_sector)-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
-  int offset = parent_inode-cached_start_entry;
-  assert(0 <= offset && offset < INODES_PER_SECTOR);
-  inode_t* parent = (inode_t*)(cached_inode_buffer+offset*sizeof(inode_t));
-  dprintf("... load parent inode: %d (size=%d, type=%d)\n",
-	 parent_inode, parent->size, parent->type);
-  if(parent->type != 1) {
-    dprintf("... parent not a directory\n");
-    return -2;
+  COUNT(bitmap_scans);
+  int sbits = BITMAP_BITS(start);
+  char _bitmap[num][SECTOR_SIZE];
+  int dirty[num];
+  int i, freed = 0;
+
+  memset(dirty, 0, sizeof(dirty));
+  for(i=0; i<count; i++) {
+    int sec = bits[i]/sbits;
+    if(bits[i] < 0 || sec >= num) return -1;
+    if(!dirty[sec] && Disk_Read(BITMAP_SECTOR(start, sec), _bitmap[sec]) < 0) return -1;
+    BITMAP_FULL(start, sec) = 0;
+    if(_bitmap[sec][bits[i]%sbits/8] & (128 >> (bits[i]%8))) freed++;
+    _bitmap[sec][bits[i]%sbits/8] &= ~(128 >> (bits[i]%8));
+    dirty[sec] = 1;
+    if(start == SECTOR_BITMAP_START_SECTOR) dedup_forget(bits[i]);
   }
 
-  int nentries = parent->size; // remaining number of directory entries 
-  int idx = 0;
-  while(nentries > 0) {
-    char buf[SECTOR_SIZE]; // cached content of directory entries
-    if(Disk_Read(parent->data[idx], buf) < 0) return -2;
-    for(int i=0; i<DIRENTS_PER_SECTOR; i++) {
-      if(i>nentries) break;
-      if(!strcmp(((dirent_t*)buf)[i].fname, fname)) {
-	// found the file/directory; update inode cache
-	int child_inode = ((dirent_t*)buf)[i].inode;
-	dprintf("... found child_inode=%d\n", child_inode);
-	int sector = INODE_TABLE_START_SECTOR+child_inode/INODES_PER_SECTOR;
-	if(sector != (*cached_inode_sector)) {
-	  *cached_inode_sector = sector;
-	  if(Disk_Read(sector, cached_inode_buffer) < 0) return -2;
-	  dprintf("... load inode table for child\n");
-	}
-	return child_inode;
+  for(i=0; i<num; i++) {
+    if(dirty[i] && Disk_Write(BITMAP_SECTOR(start, i), _bitmap[i]) < 0) return -1;
+  }
+  sectors_taken(start, -freed);
+  return 0;
+}
+
+// return the number of extra references to the given data sector (0
+// if the sector is not shared), or -1 if there's a read error
+static int sector_refs(int sector)
+{
+  char buf[SECTOR_SIZE];
+  if(Disk_Read(SUPERBLOCK_START_SECTOR, buf) < 0) return -1;
+  int table = ((superblock_t*)buf)->refcnt[sector/SECTOR_SIZE];
+  if(!table) return 0;
+  if(Disk_Read(table, buf) < 0) return -1;
+  return (unsigned char)buf[sector%SECTOR_SIZE];
+}
+
+// add 'delta' to the extra references of 'n' data sectors (a sector
+// listed twice is adjusted twice), loading each sector of reference
+// counts only once; the sectors holding the counts are allocated when
+// they're first needed; either all counts are adjusted or, if one
+// would go out of range, none is; return 0 if successful, -1 otherwise
+static int sector_adjust_refs_many(int n, int* sectors, int delta)
+{
+  char sb[SECTOR_SIZE];
+  char tables[REFCNT_SECTORS][SECTOR_SIZE];
+  int loaded[REFCNT_SECTORS], dirty[REFCNT_SECTORS];
+  if(Disk_Read(SUPERBLOCK_START_SECTOR, sb) < 0) return -1;
+  superblock_t* super = (superblock_t*)sb;
+  memset(loaded, 0, sizeof(loaded));
+  memset(dirty, 0, sizeof(dirty));
+
+  int missing = 0;
+  for(int i=0; i<n; i++) {
+    if(sectors[i] <= 0 || sectors[i] >= TOTAL_SECTORS) return -1;
+    int t = sectors[i]/SECTOR_SIZE;
+    if(!loaded[t]) {
+      if(super->refcnt[t]) {
+	if(Disk_Read(super->refcnt[t], tables[t]) < 0) return -1;
+      } else {
+	memset(tables[t], 0, SECTOR_SIZE);
+	missing++;
       }
+      loaded[t] = 1;
     }
-    idx++; nentries -= DIRENTS_PER_SECTOR;
+    int refs = (unsigned char)tables[t][sectors[i]%SECTOR_SIZE]+delta;
+    if(refs < 0 || refs > MAX_SECTOR_REFS) {
+      dprintf("... reference count of sector %d out of range\n", sectors[i]);
+      return -1;
+    }
+    tables[t][sectors[i]%SECTOR_SIZE] = refs;
+    dirty[t] = 1;
   }
-  dprintf("... could not find child inode\n");
-  return -1; // not found
+
+  if(missing > 0) {
+    int newsecs[REFCNT_SECTORS];
+    if(bitmap_alloc_many(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS,
+			 TOTAL_SECTORS, missing, newsecs) < 0) return -1;
+    for(int t=0, k=0; t<REFCNT_SECTORS; t++) {
+      if(!loaded[t] || super->refcnt[t]) continue;
+      super->refcnt[t] = newsecs[k++];
+      dprintf("... new disk sector %d for reference counts of sectors %d-%d\n",
+	      super->refcnt[t], t*SECTOR_SIZE, t*SECTOR_SIZE+SECTOR_SIZE-1);
+    }
+    if(Disk_Write(SUPERBLOCK_START_SECTOR, sb) < 0) return -1;
+  }
+  for(int t=0; t<REFCNT_SECTORS; t++) {
+    if(dirty[t] && Disk_Write(super->refcnt[t], tables[t]) < 0) return -1;
+  }
+  return 0;
 }
 
-// follow the absolute path; if successful, return the inode of the
-// parent directory immediately before the last file/directory in the
-// path; for example, for '/a/b/c/d.txt', the parent is '/a/b/c' and
-// the child is 'd.txt'; the child's inode is returned through the
-// parameter 'last_inode' and its file name is returned through the
-// parameter 'last_fname' (both are references); it's possible that
-// the last file/directory is not in its parent directory, in which
-// case, 'last_inode' points to -1; if the function returns -1, it
-// means that we cannot follow the path
-static int follow_path(char* path, int* last_inode, char* last_fname)
+// add 'delta' to the extra references of the given data sector; return
+// 0 if successful, -1 if the count would go out of range or there's a
+// disk error
+static int sector_adjust_refs(int sector, int delta)
 {
-  if(!path) {
-    dprintf("... invalid path\n");
-    return -1;
+  return sector_adjust_refs_many(1, &sector, delta);
+}
+
+static int mmap_hold(int sector);
+
+// give 'n' data sectors back to the disk; a shared sector only loses a
+// reference, while the others are reset in the sector bitmap in one
+// pass, except those a view of a mapped file still lends out, which
+// are held until it's unmapped (see mmap_hold()); return 0 if
+// successful, -1 otherwise
+static int release_sectors(int n, int* sectors)
+{
+  if(n <= 0) return 0;
+  int unshared[n], nunshared = 0;
+  for(int i=0; i<n; i++) {
+    int refs = sector_refs(sectors[i]);
+    if(refs < 0) return -1;
+    if(refs == 0 && mmap_hold(sectors[i])) {
+      dedup_forget(sectors[i]);
+      dprintf("... sector %d is still mapped, released when it's unmapped\n", sectors[i]);
+    } else if(refs == 0) unshared[nunshared++] = sectors[i];
+    else if(sector_adjust_refs(sectors[i], -1) < 0) return -1;
   }
-  if(path[0] != '/') {
-    dprintf("... '%s' not absolute path\n", path);
+  return bitmap_reset_many(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS,
+			   nunshared, unshared);
+}
+
+// make sure the data sector '*sector' belongs to a single file before
+// it's modified in place (copy-on-write): a shared sector is copied to
+// a newly allocated sector, which replaces '*sector', and the shared
+// one loses a reference; return 0 if successful, -1 otherwise
+static int sector_own(int* sector)
+{
+  int refs = sector_refs(*sector);
+  if(refs <= 0) return refs;
+
+  char buf[SECTOR_SIZE];
+  int newsec = bitmap_first_unused(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, TOTAL_SECTORS);
+  if(newsec < 0) return -1;
+  if(Disk_Read(*sector, buf) < 0 || Disk_Write(newsec, buf) < 0 ||
+     sector_adjust_refs(*sector, -1) < 0) {
+    bitmap_reset(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, newsec);
     return -1;
   }
+  dprintf("... copy shared sector %d to sector %d before writing\n", *sector, newsec);
+  *sector = newsec;
+  return 0;
+}
+
+// write a full block of file data to sector '*sector' (0 if there's
+// none yet) in dedup mode: if the same block is already on disk, the
+// file shares that sector instead; otherwise, the block is written to
+// a sector of the file's own and indexed; the caller writes the inode
+// back; return 0 if successful, -1 otherwise
+static int dedup_write_block(int* sector, char* block)
+{
+  unsigned int hash = block_hash(block);
+  int match = dedup_lookup(block, hash);
+  if(match && match == *sector) return 0;
+  if(match && sector_adjust_refs(match, 1) == 0) {
+    if(*sector && release_sectors(1, sector) < 0) return -1;
+    dprintf("... block shares sector %d\n", match);
+    *sector = match;
+    return 0;
+  }
+
+  // no match, or the match has as many references as it can take
+  if(*sector) {
+    int refs = sector_refs(*sector);
+    if(refs < 0 || (refs > 0 && sector_adjust_refs(*sector, -1) < 0)) return -1;
+    if(refs > 0) *sector = 0;
+  }
+  if(!*sector && bitmap_alloc_many(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS,
+				   TOTAL_SECTORS, 1, sector) < 0) return -1;
+  if(Disk_Write(*sector, block) < 0) return -1;
+  dedup_insert(*sector, hash);
+  return 0;
+}
+
+// rebuild the dedup index from the full blocks of all regular files if
+// dedup mode is on, or clear it otherwise; return 0 if successful, -1
+// otherwise
+static int dedup_rebuild()
+{
+  char buf[SECTOR_SIZE], bitmap[INODE_BITMAP_SECTORS][SECTOR_SIZE];
+  memset(dedup_head, 0, sizeof(dedup_head));
+  memset(dedup_indexed, 0, sizeof(dedup_indexed));
+  if(Disk_Read(SUPERBLOCK_START_SECTOR, buf) < 0) return -1;
+  dedup_enabled = ((superblock_t*)buf)->dedup;
+  if(!dedup_enabled) return 0;
+
+  for(int i=0; i<INODE_BITMAP_SECTORS; i++)
+    if(Disk_Read(BITMAP_SECTOR(INODE_BITMAP_START_SECTOR, i), bitmap[i]) < 0) return -1;
+  int blocks = 0;
+  for(int ino=0; ino<MAX_FILES; ino++) {
+    if(!BITMAP_TEST(bitmap, INODE_BITMAP_BITS, ino)) continue;
+    char table[INODE_BUFFER_SIZE];
+    if(inodes_read(INODE_TABLE_SECTOR(ino/INODES_PER_SECTOR), table) < 0) return -1;
+    inode_t* inode = (inode_t*)(table+(ino%INODES_PER_SECTOR)*sizeof(inode_t));
+    if(inode->type != 0 || (inode->flags & (INODE_INLINE|INODE_COMPRESSED))) continue;
+    for(int j=0; j<inode->size/SECTOR_SIZE; j++) {
+      int s = inode->data[j];
+      if(s <= 0 || s >= TOTAL_SECTORS || dedup_indexed[s]) continue;
+      if(Disk_Read(s, buf) < 0) return -1;
+      dedup_insert(s, block_hash(buf));
+      blocks++;
+    }
+  }
+  dprintf("... dedup index rebuilt with %d blocks\n", blocks);
+  return 0;
+}
+
+// a set of blocks of a file is a mask with bit i set for block i
+#define FIRST_BLOCKS(n) ((1u << (n))-1)
+
+// allocate sectors to the blocks of a file in the set 'want' that have
+// none (holes) in one pass over the sector bitmap, in a single run if
+// there's one; the blocks given a sector are flagged in '*fresh', and
+// the caller writes the inode back; return 0 if successful, -1
+// otherwise
+static int alloc_blocks(inode_t* file, unsigned int want, unsigned int* fresh)
+{
+  int missing[MAX_SECTORS_PER_FILE], nmissing = 0;
+  *fresh = 0;
+  for(int i=0; i<MAX_SECTORS_PER_FILE; i++)
+    if((want & (1u << i)) && !file->data[i]) missing[nmissing++] = i;
+  if(nmissing == 0) return 0;
+
+  int sectors[MAX_SECTORS_PER_FILE], first = -1;
+  if(nmissing > 1)
+    first = bitmap_alloc_run(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS,
+			     TOTAL_SECTORS, nmissing);
+  if(first >= 0) for(int k=0; k<nmissing; k++) sectors[k] = first+k;
+  else if(bitmap_alloc_many(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS,
+			    TOTAL_SECTORS, nmissing, sectors) < 0) return -1;
+  for(int k=0; k<nmissing; k++) {
+    file->data[missing[k]] = sectors[k];
+    *fresh |= 1u << missing[k];
+  }
+  return 0;
+}
+
+// write 'total' bytes from 'bytes' to the first data blocks of a file
+// (padding the last one with zeros), reusing the sectors the file
+// already has unless they are shared, allocating the missing ones in
+// one pass (in a single run if there's one) and releasing those left
+// over; the caller writes the inode back; return 0 if successful, -1
+// otherwise
+static int store_blocks(inode_t* file, char* bytes, int total)
+{
+  int nsec = (total+SECTOR_SIZE-1)/SECTOR_SIZE;
+  int surplus[MAX_SECTORS_PER_FILE], nsurplus = 0;
+  unsigned int fresh;
+  if(nsec > MAX_SECTORS_PER_FILE) return -1;
+
+  for(int i=0; i<MAX_SECTORS_PER_FILE; i++) {
+    if(i >= nsec) {
+      if(file->data[i]) surplus[nsurplus++] = file->data[i];
+      file->data[i] = 0;
+      continue;
+    }
+    if(file->data[i] && sector_refs(file->data[i]) > 0) {
+      // a shared sector about to be overwritten needn't be copied
+      if(sector_adjust_refs(file->data[i], -1) < 0) return -1;
+      file->data[i] = 0;
+    }
+  }
+  if(alloc_blocks(file, FIRST_BLOCKS(nsec), &fresh) < 0) return -1;
+
+  for(int i=0; i<nsec; i++) {
+    char buf[SECTOR_SIZE];
+    int n = total-i*SECTOR_SIZE;
+    if(n > SECTOR_SIZE) n = SECTOR_SIZE;
+    memset(buf, 0, SECTOR_SIZE);
+    memcpy(buf, bytes+i*SECTOR_SIZE, n);
+    dedup_forget(file->data[i]);
+    if(Disk_Write(file->data[i], buf) < 0) return -1;
+  }
+  return release_sectors(nsurplus, surplus);
+}
+
+// read the whole content of a regular file, however it's stored, into
+// 'content' (which must hold MAX_FILE_SIZE bytes); return 0 if
+// successful, -1 otherwise
+static int load_content(inode_t* file, char* content)
+{
+  memset(content, 0, MAX_FILE_SIZE);
+  if(file->flags & INODE_INLINE) {
+    memcpy(content, file->data, file->size);
+    return 0;
+  }
+
+  if(file->flags & INODE_COMPRESSED) {
+    char stream[MAX_FILE_SIZE];
+    if(file->size == 0) return 0;
+    if(Disk_Read(file->data[0], stream) < 0) return -1;
+    int clen = *(int*)stream;
+    int total = (clen > 0 ? clen : file->size)+sizeof(int);
+    if(clen < 0 || total > MAX_FILE_SIZE) return -1;
+    for(int i=1; i*SECTOR_SIZE<total; i++)
+      if(Disk_Read(file->data[i], stream+i*SECTOR_SIZE) < 0) return -1;
+    if(clen == 0) memcpy(content, stream+sizeof(int), file->size);
+    else if(LZ_Decompress(stream+sizeof(int), clen, content, MAX_FILE_SIZE) != file->size)
+      return -1;
+    return 0;
+  }
+
+  for(int i=0; i*SECTOR_SIZE<file->size; i++)
+    if(file->data[i] && Disk_Read(file->data[i], content+i*SECTOR_SIZE) < 0) return -1;
+  return 0;
+}
+
+// store 'size' bytes of 'content' as the content of a compressed file;
+// if the content can't be kept as a stream within the size limit, the
+// file turns into a regular one; the caller writes the inode back;
+// return 0 if successful, -1 otherwise
+static int compressed_store(inode_t* file, char* content, int size)
+{
+  char stream[MAX_FILE_SIZE];
+  if(size == 0) return store_blocks(file, stream, 0);
+
+  int clen = LZ_Compress(content, size, stream+sizeof(int), MAX_FILE_SIZE-sizeof(int));
+  if(clen > 0 && clen < size) {
+    *(int*)stream = clen;
+    dprintf("... compressed %d bytes to %d bytes\n", size, clen);
+    return store_blocks(file, stream, clen+sizeof(int));
+  }
+  if(size+sizeof(int) <= MAX_FILE_SIZE) {
+    *(int*)stream = 0;
+    memcpy(stream+sizeof(int), content, size);
+    dprintf("... %d bytes don't compress, stored as is\n", size);
+    return store_blocks(file, stream, size+sizeof(int));
+  }
+  dprintf("... %d bytes don't compress, file becomes uncompressed\n", size);
+  file->flags &= ~INODE_COMPRESSED;
+  return store_blocks(file, content, size);
+}
+
+#if defined(__SSE2__)
+// the bounds of the ranges of legal characters in a file name (letters
+// folded to lower case first), each repeated to fill a register; they
+// are loaded from memory, since building them with _mm_set1_epi8()
+// takes hundreds of instructions unless the compiler optimizes
+#define SPLAT(c) { c, c, c, c, c, c, c, c, c, c, c, c, c, c, c, c }
+static const char legal_ranges[4][2][16] __attribute__((aligned(16))) = {
+  { SPLAT('a'-1), SPLAT('z'+1) }, { SPLAT('0'-1), SPLAT('9'+1) },
+  { SPLAT('-'-1), SPLAT('.'+1) }, { SPLAT('_'-1), SPLAT('_'+1) },
+};
+static const char case_bit[16] __attribute__((aligned(16))) = SPLAT(0x20);
+#undef SPLAT
+
+// keep_bytes+16-n masks all but the first n bytes of a register off
+static const char keep_bytes[32] __attribute__((aligned(16))) = {
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+// load a file name into a register, zero-padded to the size of the
+// name of a directory entry; its length is returned through 'len',
+// MAX_NAME if it's longer than any name can be; unless the 16 bytes at
+// the name run into another page, they're loaded at once (reading past
+// the end of the name can't fault then) and whatever follows its zero
+// is masked off, otherwise the name is copied byte by byte
+__attribute__((no_sanitize_address))
+static __m128i padded_name(char* name, int* len)
+{
+  if(((unsigned long)name & 4095) <= 4096-MAX_NAME) {
+    __m128i c = _mm_loadu_si128((const __m128i*)name);
+    unsigned zeros = _mm_movemask_epi8(_mm_cmpeq_epi8(c, _mm_setzero_si128()));
+    int n = zeros ? __builtin_ctz(zeros) : MAX_NAME;
+    *len = n;
+    return _mm_and_si128(c, _mm_loadu_si128((const __m128i*)(keep_bytes+16-n)));
+  }
+  char padded[MAX_NAME] = {0};
+  int n = 0;
+  for(; n<MAX_NAME && name[n]; n++) padded[n] = name[n];
+  *len = n;
+  return _mm_loadu_si128((const __m128i*)padded);
+}
+#endif
+
+// return 1 if the file name is illegal; otherwise, return 0; legal
+// characters for a file name include letters (case sensitive),
+// numbers, dots, dashes, and underscores; and a legal file name
+// should not be more than MAX_NAME-1 in length
+static int illegal_filename(char* name)
+{
+#if defined(__SSE2__)
+  // the whole name fits in a register and all its characters are
+  // checked at once; letters are folded to lower case by setting bit
+  // 0x20, which turns no other byte into a letter (but does turn some
+  // into digits, so only letters are checked folded)
+  int len;
+  __m128i c = padded_name(name, &len);
+  if(len > MAX_NAME-1) return 1;
+  __m128i ok = _mm_setzero_si128();
+  for(int r=0; r<4; r++) {
+    __m128i x = r ? c : _mm_or_si128(c, _mm_load_si128((const __m128i*)case_bit));
+    ok = _mm_or_si128(ok, _mm_and_si128(_mm_cmpgt_epi8(x, _mm_load_si128((const __m128i*)legal_ranges[r][0])),
+					_mm_cmplt_epi8(x, _mm_load_si128((const __m128i*)legal_ranges[r][1]))));
+  }
+  int want = (1<<len)-1; // only the characters of the name count
+  return (_mm_movemask_epi8(ok) & want) != want;
+#else
+  int len = strnlen(name, MAX_NAME);
+  if(len > MAX_NAME-1) return 1;
+  for(int i=0; i<len; i++) {
+    char ch = name[i];
+    if(!((ch >= 'A' && ch <= 'Z') || (ch >= 'a' && ch <= 'z') || (ch >= '0' && ch <= '9') ||
+	 ch == '-' || ch == '.' || ch == '_'))
+      return 1;
+  }
+  return 0;
+#endif
+}
+
+// a file name ready to be compared with directory entries (see
+// scan_dirents())
+typedef struct {
+  char* name;
+#if defined(__SSE2__)
+  __m128i padded;
+  unsigned want; // the bytes that must match (the name and its zero), 0 if the name is too long
+#endif
+} name_probe_t;
+
+static void name_probe(char* name, name_probe_t* probe)
+{
+  probe->name = name;
+#if defined(__SSE2__)
+  int len;
+  probe->padded = padded_name(name, &len);
+  probe->want = len < MAX_NAME ? (2u<<len)-1 : 0;
+  // a packed entry has no zero after a name of MAX_NAME-1 bytes (the
+  // next entry starts there)
+  if(packed_format) probe->want &= (1u<<(MAX_NAME-1))-1;
+#endif
+}
+
+#if defined(__x86_64__)
+// compare two entries per instruction: both names are loaded into one
+// 256-bit register and matched against the name twice over; the upper
+// halves of the registers are cleared on the way out (the compiler
+// doesn't do it without optimization), or every SSE instruction after
+// it would pay for switching states
+__attribute__((target("avx2")))
+static int scan_dirents_avx2(const char* names, int stride, int n, __m128i probe, unsigned want)
+{
+  __m256i probe2 = _mm256_broadcastsi128_si256(probe);
+  int found = -1;
+  for(int i=0; i+1<n && found<0; i+=2) {
+    __m256i pair = _mm256_inserti128_si256(
+      _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(names+i*stride))),
+      _mm_loadu_si128((const __m128i*)(names+(i+1)*stride)), 1);
+    unsigned eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(pair, probe2));
+    if((eq & want) == want) found = i;
+    else if((eq >> 16 & want) == want) found = i+1;
+  }
+  _mm256_zeroupper();
+  return found;
+}
+#endif
+
+// return the index of the entry with the probed name among the first
+// 'n' directory entries of a sector as stored on the disk (packed or
+// not), or -1 if there's none; with SSE2, the name is compared with
+// each entry in a single instruction, up to and including its
+// terminating zero (whatever follows the zero in an entry is ignored,
+// as strcmp() does); the 16 bytes loaded for the last packed entry
+// end just short of the end of the sector
+static int scan_dirents(const char* sector, int n, name_probe_t* probe)
+{
+  const char* names = sector+(packed_format ? offsetof(packed_dirent_t, fname) : 0);
+  int stride = DIRENT_SIZE;
+#if defined(__SSE2__)
+  unsigned want = probe->want;
+  if(!want) return -1; // too long to be anyone's name
+  int i = 0;
+#if defined(__x86_64__)
+  if(n > 1 && __builtin_cpu_supports("avx2")) {
+    int found = scan_dirents_avx2(names, stride, n, probe->padded, want);
+    if(found >= 0) return found;
+    i = n & ~1; // an odd one out is left
+  }
+#endif
+  for(; i<n; i++) {
+    unsigned eq = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(names+i*stride)), probe->padded));
+    if((eq & want) == want) return i;
+  }
+  return -1;
+#else
+  if(strnlen(probe->name, MAX_NAME) > MAX_NAME-1) return -1;
+  int width = packed_format ? MAX_NAME-1 : MAX_NAME;
+  for(int i=0; i<n; i++)
+    if(!strncmp(names+i*stride, probe->name, width)) return i;
+  return -1;
+#endif
+}
+
+// return the child inode of the given file name 'fname' from the
+// parent inode; the parent inode is currently stored in the segment
+// of inode table in the cache (we cache only one disk sector for
+// this); once found, both cached_inode_sector and cached_inode_buffer
+// may be updated to point to the segment of inode table containing
+// the child inode; the function returns -1 if no such file is found;
+// it returns -2 is something else is wrong (such as parent is not
+// directory, or there's read error, etc.)
+static int find_child_inode(int parent_inode, char* fname,
+			    int *cached_inode_sector, char* cached_inode_buffer)
+{
+  int cached_start_entry = INODE_TABLE_INDEX(*cached_inode_sector)*INODES_PER_SECTOR;
+  int offset = parent_inode-cached_start_entry;
+  assert(0 <= offset && offset < INODES_PER_SECTOR);
+  inode_t* parent = (inode_t*)(cached_inode_buffer+offset*sizeof(inode_t));
+  dprintf("... load parent inode: %d (size=%d, type=%d)\n",
+	 parent_inode, parent->size, parent->type);
+  if(parent->type != 1) {
+    dprintf("... parent not a directory\n");
+    return -2;
+  }
+
+  int nentries = parent->size; // remaining number of directory entries 
+  int idx = 0;
+  name_probe_t probe;
+  name_probe(fname, &probe);
+  while(nentries > 0) {
+    // the directory entries are looked at in place
+    int dir_sector = parent->data[idx];
+    const char* dirents = Disk_Map(dir_sector);
+    if(!dirents) return -2;
+    int i = scan_dirents(dirents, nentries < DIRENTS_PER_SECTOR ? nentries : DIRENTS_PER_SECTOR, &probe);
+    if(i >= 0) {
+      // found the file/directory; update inode cache
+      int child_inode = stored_dirent_inode(dirents, i);
+      Disk_Unmap(dir_sector, 0);
+      dprintf("... found child_inode=%d\n", child_inode);
+      int sector = INODE_TABLE_SECTOR(child_inode/INODES_PER_SECTOR);
+      if(sector != (*cached_inode_sector)) {
+	*cached_inode_sector = sector;
+	if(inode_table_read(sector, cached_inode_buffer) < 0) return -2;
+	dprintf("... load inode table for child\n");
+      }
+      return child_inode;
+    }
+    Disk_Unmap(dir_sector, 0);
+    idx++; nentries -= DIRENTS_PER_SECTOR;
+  }
+  dprintf("... could not find child inode\n");
+  return -1; // not found
+}
+
+// follow the absolute path; if successful, return the inode of the
+// parent directory immediately before the last file/directory in the
+// path; for example, for '/a/b/c/d.txt', the parent is '/a/b/c' and
+// the child is 'd.txt'; the child's inode is returned through the
+// parameter 'last_inode' and its file name is returned through the
+// parameter 'last_fname' (both are references); it's possible that
+// the last file/directory is not in its parent directory, in which
+// case, 'last_inode' points to -1; if the function returns -1, it
+// means that we cannot follow the path
+static int follow_path(char* path, int* last_inode, char* last_fname)
+{
+  if(!path) {
+    dprintf("... invalid path\n");
+    return -1;
+  }
+  if(path[0] != '/') {
+    dprintf("... '%s' not absolute path\n", path);
+    return -1;
+  }
+  
+  // make a copy of the path (skip leading '/'); this is necessary
+  // since the path is going to be modified by strsep()
+  char pathstore[MAX_PATH]; 
+  strncpy(pathstore, path+1, MAX_PATH-1);
+  pathstore[MAX_PATH-1] = '\0'; // for safety
+  char* lpath = pathstore;
+  
+  int parent_inode = -1, child_inode = 0; // start from root
+  // cache the disk sector containing the root inode
+  int cached_sector = INODE_TABLE_SECTOR(0);
+  char cached_buffer[INODE_BUFFER_SIZE];
+  if(inode_table_read(cached_sector, cached_buffer) < 0) return -1;
+  dprintf("... load inode table for root from disk sector %d\n", cached_sector);
   
-  // make a copy of the path (skip leading '/'); this is necessary
-  // since the path is going to be modified by strsep()
-  char pathstore[MAX_PATH]; 
-  strncpy(pathstore, path+1, MAX_PATH-1);
-  pathstore[MAX_PATH-1] = '\0'; // for safety
-  char* lpath = pathstore;
-  
-  int parent_inode = -1, child_inode = 0; // start from root
-  // cache the disk sector containing the root inode
-  int cached_sector = INODE_TABLE_START_SECTOR;
-  char cached_buffer[SECTOR_SIZE];
-  if(Disk_Read(cached_sector, cached_buffer) < 0) return -1;
-  dprintf("... load inode table for root from disk sector %d\n", cached_sector);
-  
   // for each file/directory name separated by '/'
   char* token;
   while((token = strsep(&lpath, "/")) != NULL) {
@@ -363,6 +1489,7 @@ static int follow_path(char* path, int* last_inode, char* last_fname)
       return -1;
     }
     parent_inode = child_inode;
+    COUNT(path_components);
     child_inode = find_child_inode(parent_inode, token,
 				   &cached_sector, cached_buffer);
     if(last_fname) strcpy(last_fname, token);
@@ -391,11 +1518,11 @@ int get_inode_from_path(char* path, inode_t** inode)
   {
     assert(child_inode >= 0);
 
-    int inode_sector = INODE_TABLE_START_SECTOR+child_inode/INODES_PER_SECTOR;
-    char cached_buffer[SECTOR_SIZE];
-    if(Disk_Read(inode_sector, cached_buffer) < 0) return -1;
+    int inode_sector = INODE_TABLE_SECTOR(child_inode/INODES_PER_SECTOR);
+    char cached_buffer[INODE_BUFFER_SIZE];
+    if(inode_table_read(inode_sector, cached_buffer) < 0) return -1;
 
-    int cached_start_entry = ((inode_sector)-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
+    int cached_start_entry = INODE_TABLE_INDEX(inode_sector)*INODES_PER_SECTOR;
     int offset = child_inode-cached_start_entry;
     
     assert(0 <= offset && offset < INODES_PER_SECTOR);
@@ -406,46 +1533,23 @@ int get_inode_from_path(char* path, inode_t** inode)
   return -1;
 }
 
-// add a new file or directory (determined by 'type') of given name
-// 'file' under parent directory represented by 'parent_inode'
-int add_inode(int type, int parent_inode, char* file)
+// append a dirent of given name 'file' for 'child_inode' to the
+// parent directory represented by 'parent_inode'; return 0 if
+// successful, -1 on error, and -2 if parent is not a directory
+static int add_dirent(int parent_inode, char* file, int child_inode)
 {
-  // get a new inode for child
-  int child_inode = bitmap_first_unused(INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, INODE_BITMAP_SIZE);
-  if(child_inode < 0) {
-    dprintf("... error: inode table is full\n");
-    return -1; 
-  }
-  dprintf("... new child inode %d\n", child_inode);
-
-  // load the disk sector containing the child inode
-  int inode_sector = INODE_TABLE_START_SECTOR+child_inode/INODES_PER_SECTOR;
-  char inode_buffer[SECTOR_SIZE];
-  if(Disk_Read(inode_sector, inode_buffer) < 0) return -1;
-  dprintf("... load inode table for child inode from disk sector %d\n", inode_sector);
-
-  // get the child inode
-  int inode_start_entry = (inode_sector-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
-  int offset = child_inode-inode_start_entry;
-  assert(0 <= offset && offset < INODES_PER_SECTOR);
-  inode_t* child = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
-
-  // update the new child inode and write to disk
-  memset(child, 0, sizeof(inode_t));
-  child->type = type;
-  if(Disk_Write(inode_sector, inode_buffer) < 0) return -1;
-  dprintf("... update child inode %d (size=%d, type=%d), update disk sector %d\n",
-	 child_inode, child->size, child->type, inode_sector);
+  alloc_near(parent_inode);
 
   // get the disk sector containing the parent inode
-  inode_sector = INODE_TABLE_START_SECTOR+parent_inode/INODES_PER_SECTOR;
-  if(Disk_Read(inode_sector, inode_buffer) < 0) return -1;
+  int inode_sector = INODE_TABLE_SECTOR(parent_inode/INODES_PER_SECTOR);
+  char inode_buffer[INODE_BUFFER_SIZE];
+  if(inodes_read(inode_sector, inode_buffer) < 0) return -1;
   dprintf("... load inode table for parent inode %d from disk sector %d\n",
 	 parent_inode, inode_sector);
 
   // get the parent inode
-  inode_start_entry = (inode_sector-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
-  offset = parent_inode-inode_start_entry;
+  int inode_start_entry = INODE_TABLE_INDEX(inode_sector)*INODES_PER_SECTOR;
+  int offset = parent_inode-inode_start_entry;
   assert(0 <= offset && offset < INODES_PER_SECTOR);
   inode_t* parent = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
   dprintf("... get parent inode %d (size=%d, type=%d)\n",
@@ -457,21 +1561,27 @@ int add_inode(int type, int parent_inode, char* file)
     return -2; // parent not directory
   }
   int group = parent->size/DIRENTS_PER_SECTOR;
-  char dirent_buffer[SECTOR_SIZE];
+  if(group >= MAX_SECTORS_PER_FILE) {
+    dprintf("... error: parent directory is full\n");
+    return -1;
+  }
+  char dirent_buffer[DIRENT_BUFFER_SIZE];
   if(group*DIRENTS_PER_SECTOR == parent->size) {
     // new disk sector is needed
-    int newsec = bitmap_first_unused(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, SECTOR_BITMAP_SIZE);
+    int newsec = bitmap_first_unused(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, TOTAL_SECTORS);
     if(newsec < 0) {
       dprintf("... error: disk is full\n");
       return -1;
     }
     parent->data[group] = newsec;
-    memset(dirent_buffer, 0, SECTOR_SIZE);
+    memset(dirent_buffer, 0, DIRENT_BUFFER_SIZE);
     dprintf("... new disk sector %d for dirent group %d\n", newsec, group);
   } else {
-    if(Disk_Read(parent->data[group], dirent_buffer) < 0)
+    if(dirents_read(parent->data[group], dirent_buffer) < 0)
       return -1;
     dprintf("... load disk sector %d for dirent group %d\n", parent->data[group], group);
+    // the sector may be shared with a snapshot
+    if(sector_own(&parent->data[group]) < 0) return -1;
   }
 
   // add the dirent and write to disk
@@ -480,32 +1590,74 @@ int add_inode(int type, int parent_inode, char* file)
   dirent_t* dirent = (dirent_t*)(dirent_buffer+offset*sizeof(dirent_t));
   strncpy(dirent->fname, file, MAX_NAME);
   dirent->inode = child_inode;
-  if(Disk_Write(parent->data[group], dirent_buffer) < 0) return -1;
+  if(dirents_write(parent->data[group], dirent_buffer) < 0) return -1;
   dprintf("... append dirent %d (name='%s', inode=%d) to group %d, update disk sector %d\n",
 	  parent->size, dirent->fname, dirent->inode, group, parent->data[group]);
 
   // update parent inode and write to disk
   parent->size++;
-  if(Disk_Write(inode_sector, inode_buffer) < 0) return -1;
+  if(inodes_write(inode_sector, inode_buffer) < 0) return -1;
   dprintf("... update parent inode on disk sector %d\n", inode_sector);
   
   return 0;
 }
 
-// used by both File_Create() and Dir_Create(); type=0 is file, type=1
-// is directory
-int create_file_or_directory(int type, char* pathname)
+// add a new file or directory (determined by 'type') of given name
+// 'file' under parent directory represented by 'parent_inode'; return
+// the inode of the new file or directory, or a negative value on
+// error (-2 means parent is not a directory)
+int add_inode(int type, int parent_inode, char* file)
+{
+  // get a new inode for child, in the parent's block group if there's
+  // room
+  alloc_near(parent_inode);
+  int child_inode = bitmap_first_unused(INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, MAX_FILES);
+  if(child_inode < 0) {
+    dprintf("... error: inode table is full\n");
+    return -1; 
+  }
+  dprintf("... new child inode %d\n", child_inode);
+
+  // load the disk sector containing the child inode
+  int inode_sector = INODE_TABLE_SECTOR(child_inode/INODES_PER_SECTOR);
+  char inode_buffer[INODE_BUFFER_SIZE];
+  if(inodes_read(inode_sector, inode_buffer) < 0) return -1;
+  dprintf("... load inode table for child inode from disk sector %d\n", inode_sector);
+
+  // get the child inode
+  int inode_start_entry = INODE_TABLE_INDEX(inode_sector)*INODES_PER_SECTOR;
+  int offset = child_inode-inode_start_entry;
+  assert(0 <= offset && offset < INODES_PER_SECTOR);
+  inode_t* child = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
+
+  // update the new child inode and write to disk
+  memset(child, 0, sizeof(inode_t));
+  child->type = type;
+  if(type == 0) child->flags = INODE_INLINE;
+  if(inodes_write(inode_sector, inode_buffer) < 0) return -1;
+  dprintf("... update child inode %d (size=%d, type=%d), update disk sector %d\n",
+	 child_inode, child->size, child->type, inode_sector);
+
+  // link the child into the parent directory
+  int ret = add_dirent(parent_inode, file, child_inode);
+  if(ret < 0) {
+    bitmap_reset(INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, child_inode);
+    return ret;
+  }
+  return child_inode;
+}
+
+// create the file or directory (determined by 'type') 'fname' in the
+// directory 'parent_inode', where 'child_inode' is the inode the name
+// already refers to (-1 if none); 'pathname' is only for messages
+static int create_child(int type, int parent_inode, int child_inode, char* fname, char* pathname)
 {
-  int child_inode;
-  char last_fname[MAX_NAME];
-  int parent_inode = follow_path(pathname, &child_inode, last_fname);
-  if(parent_inode >= 0) {
     if(child_inode >= 0) {
       dprintf("... file/directory '%s' already exists, failed to create\n", pathname);
       osErrno = E_CREATE;
       return -1;
     } else {
-      if(add_inode(type, parent_inode, last_fname) >= 0) {
+      if(add_inode(type, parent_inode, fname) >= 0) {
 	dprintf("... successfully created file/directory: '%s'\n", pathname);
 	return 0;
       } else {
@@ -514,6 +1666,17 @@ int create_file_or_directory(int type, char* pathname)
 	return -1;
       }
     }
+}
+
+// used by both File_Create() and Dir_Create(); type=0 is file, type=1
+// is directory
+int create_file_or_directory(int type, char* pathname)
+{
+  int child_inode;
+  char last_fname[MAX_NAME];
+  int parent_inode = follow_path(pathname, &child_inode, last_fname);
+  if(parent_inode >= 0) {
+    return create_child(type, parent_inode, child_inode, last_fname, pathname);
   } else {
     dprintf("... error: something wrong with the file/path: '%s'\n", pathname);
     osErrno = E_CREATE;
@@ -521,6 +1684,60 @@ int create_file_or_directory(int type, char* pathname)
   }
 }
 
+// remove the dirent of 'child_inode' from the parent directory
+// represented by 'parent_inode' by moving the last dirent of the
+// parent into its place; a dirent sector left empty at the end of the
+// directory is given back to the disk; return 0 if successful, -1
+// otherwise
+static int remove_dirent(int parent_inode, int child_inode)
+{
+  alloc_near(parent_inode);
+  int inode_sector = INODE_TABLE_SECTOR(parent_inode/INODES_PER_SECTOR);
+  char inode_buffer[INODE_BUFFER_SIZE];
+  if(inodes_read(inode_sector, inode_buffer) < 0) return -1;
+  int offset = parent_inode-INODE_TABLE_INDEX(inode_sector)*INODES_PER_SECTOR;
+  assert(0 <= offset && offset < INODES_PER_SECTOR);
+  inode_t* parent = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
+  if(parent->type != 1 || parent->size <= 0) return -1;
+
+  // the last dirent of the parent fills the hole
+  int last = parent->size-1;
+  int last_group = last/DIRENTS_PER_SECTOR;
+  char last_buffer[DIRENT_BUFFER_SIZE];
+  if(dirents_read(parent->data[last_group], last_buffer) < 0) return -1;
+  dirent_t* final = (dirent_t*)last_buffer+last%DIRENTS_PER_SECTOR;
+
+  for(int group=0; group<=last_group; group++) {
+    char buf[DIRENT_BUFFER_SIZE];
+    char* dirents = (group == last_group) ? last_buffer : buf;
+    if(dirents == buf && dirents_read(parent->data[group], buf) < 0) return -1;
+    int n = (group == last_group) ? last%DIRENTS_PER_SECTOR+1 : DIRENTS_PER_SECTOR;
+    for(int i=0; i<n; i++) {
+      dirent_t* dirent = (dirent_t*)dirents+i;
+      if(dirent->inode != child_inode) continue;
+
+      dprintf("... replace dirent %d (group %d) with last dirent %d\n",
+	      (int)(group*DIRENTS_PER_SECTOR+i), group, last);
+      memcpy(dirent, final, sizeof(dirent_t));
+      memset(final, 0, sizeof(dirent_t));
+      if(dirents == buf && (sector_own(&parent->data[group]) < 0 ||
+			    dirents_write(parent->data[group], buf) < 0)) return -1;
+      if(last%DIRENTS_PER_SECTOR == 0) {
+	// the last dirent sector is now empty
+	if(release_sectors(1, &parent->data[last_group]) < 0) return -1;
+	parent->data[last_group] = 0;
+      } else if(sector_own(&parent->data[last_group]) < 0 ||
+		dirents_write(parent->data[last_group], last_buffer) < 0) return -1;
+
+      parent->size--;
+      if(inodes_write(inode_sector, inode_buffer) < 0) return -1;
+      return 0;
+    }
+  }
+  dprintf("... error: could not find child dirent in parent\n");
+  return -1;
+}
+
 // remove the child from parent; the function is called by both
 // File_Unlink() and Dir_Unlink(); the function returns 0 if success,
 // -1 if general error, -2 if directory not empty, -3 if wrong type
@@ -532,13 +1749,13 @@ int remove_inode(int type, int parent_inode, int child_inode)
 
   dprintf("... removing inode %d from parent %d\n", child_inode, parent_inode);
 
-  int inode_sector = INODE_TABLE_START_SECTOR + child_inode / INODES_PER_SECTOR;
-  char inode_buffer[SECTOR_SIZE];
-  if(Disk_Read(inode_sector, inode_buffer) < 0) { osErrno = E_GENERAL; return -1; }
+  int inode_sector = INODE_TABLE_SECTOR(child_inode/INODES_PER_SECTOR);
+  char inode_buffer[INODE_BUFFER_SIZE];
+  if(inodes_read(inode_sector, inode_buffer) < 0) { osErrno = E_GENERAL; return -1; }
   dprintf("... load inode table for inode from disk sector %d\n", inode_sector);
 
   // reusing code from the sample code here
-  int cached_start_entry = ((inode_sector) - INODE_TABLE_START_SECTOR) *
+  int cached_start_entry = INODE_TABLE_INDEX(inode_sector) *
     INODES_PER_SECTOR;
   int offset = child_inode - cached_start_entry;
 
@@ -561,11 +1778,29 @@ int remove_inode(int type, int parent_inode, int child_inode)
     return -2;
   }
 
+  // remember the data sectors so they can be released once the child
+  // is unlinked (an empty directory may still hold an unused dirent
+  // sector left behind by earlier versions)
+  int sectors[MAX_SECTORS_PER_FILE], nsectors = 0;
+  for (int i = 0; !(child_inode_t->flags & INODE_INLINE) && i < MAX_SECTORS_PER_FILE; i++)
+    if (child_inode_t->data[i] > 0) sectors[nsectors++] = child_inode_t->data[i];
+
+  // the child is unlinked from the parent first, so that a failure
+  // later on leaves an orphan inode (which FS_Check() reclaims) rather
+  // than a dirent referring to a freed inode
+  if (remove_dirent(parent_inode, child_inode) < 0)
+  {
+    dprintf("... error: could not remove child dirent from parent %d\n", parent_inode);
+    return -1;
+  }
+
   // if we got here, neither of the above error conditions are true, so delete
-  // the inode and update the disk sector
+  // the inode and update the disk sector (which may have been updated
+  // along with the parent)
   dprintf("... deleting inode %d and writing back to disk\n", child_inode);
+  if (inodes_read(inode_sector, inode_buffer) < 0) return -1;
   memset(child_inode_t, 0, sizeof(inode_t));
-  if (Disk_Write(inode_sector, inode_buffer) < 0) return -1;
+  if (inodes_write(inode_sector, inode_buffer) < 0) return -1;
 
   // reset bit of child inode in bitmap
   if (bitmap_reset(INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, child_inode) < 0) {
@@ -573,131 +1808,14 @@ int remove_inode(int type, int parent_inode, int child_inode)
     return -1;
   }
 
-  // next, we need to update the parent inode to reflect the child has been deleted
-
-  // calculate the parent's sector
-  inode_sector = INODE_TABLE_START_SECTOR + parent_inode/ INODES_PER_SECTOR;
-  if(Disk_Read(inode_sector, inode_buffer) < 0) { osErrno = E_GENERAL; return -1; }
-  dprintf("... load inode table for inode from disk sector %d\n", inode_sector);
-
-  // reusing code from the sample code, again, to get parent inode
-  cached_start_entry = (inode_sector - INODE_TABLE_START_SECTOR) * INODES_PER_SECTOR;
-  offset = parent_inode - cached_start_entry;
-
-  assert(0 <= offset && offset < INODES_PER_SECTOR);
-
-  inode_t* parent = (inode_t*)(inode_buffer + offset * sizeof(inode_t));
-  dprintf("... get parent inode %d (size=%d, type=%d)\n",
-	  parent_inode, parent->size, parent->type);
-
-  // reusing more sample code here, modified to fit this method
-  int deleted = 0;
-  int total_sectors = (parent->size + DIRENTS_PER_SECTOR - 1) / DIRENTS_PER_SECTOR;
-  // remainder here: if value is > 0 then there is a partial dirent sector
-  int remain_dirents = (parent->size % DIRENTS_PER_SECTOR);
-  int num_dirents = 0;
-    
-  char buf[SECTOR_SIZE]; // cached content of directory entries
-  dirent_t *dirent, *final;
-  int idx_sector, idx_dirent;
-
-  for (idx_sector = 0; idx_sector < total_sectors; idx_sector++)
-  { 
-    if (Disk_Read(parent->data[idx_sector], buf) < 0)
-      return -2;
-
-    for (idx_dirent = 0; idx_dirent < DIRENTS_PER_SECTOR; idx_dirent++)
-    {
-      num_dirents++;
-
-      if (deleted == 0 && num_dirents <= parent->size)
-      {
-        dirent = (dirent_t*)(buf + idx_dirent * sizeof(dirent_t));
-        // the following cases are necessary to handle edge cases when a file is deleted in a filesystem
-        // also containing a directory. in such a case, naively deleting the child dirent and returning
-        // can result in an inconsistent state where inodes are repeated and files cannot be read.
-        if (dirent->inode == child_inode)
-        {
-          // if this is true, it means the child dirent and final dirent are in the same sector
-          if (idx_sector == total_sectors - 1)
-          {
-            final = (dirent_t*)(buf + ((remain_dirents - 1) * sizeof(dirent_t)));
-            memcpy(dirent, final, sizeof(dirent_t));
-            memset(final, 0, sizeof(dirent_t));
-
-            // write to disk the updated sector
-            if (Disk_Write(parent->data[idx_sector], buf) < 0)
-            {
-              dprintf("... error writing to parent data\n");
-              return -1;
-            }
-            dprintf("... successfully deleted dirent for child inode %d\n", child_inode);
-            deleted = 1;
-          }
-          else
-          {
-            // otherwise, the child inode exists but is not in the final sector
-            char final_buf[SECTOR_SIZE];
-
-            if (Disk_Read(parent->data[total_sectors - 1], final_buf) < 0)
-            {
-              dprintf("... error reading final sector of parent %d\n", parent_inode);
-              return -1;
-            }
-
-            final = (dirent_t*)(final_buf + ((remain_dirents - 1) * sizeof(dirent_t)));
-            memcpy(dirent, final, sizeof(dirent_t));
-            memset(final, 0, sizeof(dirent_t));
-
-            if (Disk_Write(parent->data[idx_sector], buf) < 0)
-            {
-              dprintf("... error writing to parent data\n");
-              return -1;
-            }
-            if (Disk_Write(parent->data[total_sectors - 1], final_buf) < 0)
-            {
-              dprintf("... error writing final sector to parent data\n");
-              return -1;
-            }
-            dprintf("... successfully deleted dirent for child inode %d\n", child_inode);
-            deleted = 1;
-          }
-        }
-      }
-      else if (deleted == 0 && dirent)
-      {
-        // if we get here, it means the child is the last dirent in the parent
-        if (dirent->inode ==  child_inode)
-        {
-            memset(dirent, 0, sizeof(dirent_t));
-            if (Disk_Write(parent->data[idx_sector], buf) < 0)
-            {
-              dprintf("... error writing to final dirent of parent\n");
-              return -1;
-            }
-            deleted = 1;
-        }
-        else
-        {
-          dprintf("... error: could not find child dirent in parent\n");
-          return -1;
-        }
-      }
-    }
-  }
-
-  parent->size--;
-
-  if (Disk_Write(inode_sector, inode_buffer) < 0)
+  // finally, give the data sectors of a file back to the disk
+  if (nsectors > 0 && release_sectors(nsectors, sectors) < 0)
   {
-    dprintf("... error writing updated inode table to disk\n");
-    return 1;
-  }
-  else
-  {
-    dprintf("... inode %d successfully unlinked\n", child_inode);
-    return 0;
+    dprintf("... error: could not release data sectors of inode %d\n", child_inode);
+    return -1;
   }
+  dprintf("... inode %d successfully unlinked\n", child_inode);
+  return 0;
 }
 
 // representing an open file
@@ -705,21 +1823,248 @@ typedef struct _open_file {
   int inode; // pointing to the inode of the file (0 means entry not used)
   int size;  // file size cached here for convenience
   int pos;   // read/write position
+  char* delayed; // the content of the delayed blocks (NULL if none)
+  unsigned int delayed_blocks; // the set of delayed blocks
+  char* pending;   // bytes held back by File_Append() (NULL if none yet)
+  int pending_off; // where they go (-1 if the end of the file isn't kept)
+  int pending_len; // how many there are
+  int pending_new; // whether their block has no sector yet, and none delayed
 } open_file_t;
 static open_file_t open_files[MAX_OPEN_FILES];
 
-// return true if the file pointed to by inode has already been open
-int is_file_open(int inode)
+// directory handles from Dir_OpenHandle()
+#define MAX_DIR_HANDLES 64
+typedef struct _dir_handle {
+  int used;
+  int inode; // the directory
+} dir_handle_t;
+static dir_handle_t dir_handles[MAX_DIR_HANDLES];
+
+// return true if there's a handle for the directory pointed to by inode
+static int is_dir_handle_open(int inode)
 {
-  for(int i=0; i<MAX_OPEN_FILES; i++) {
-    if(open_files[i].inode == inode)
+  for(int i=0; i<MAX_DIR_HANDLES; i++) {
+    if(dir_handles[i].used && dir_handles[i].inode == inode)
       return 1;
   }
   return 0;
 }
 
-// return a new file descriptor not used; -1 if full
-int new_file_fd()
+// delayed allocation: a block written for the first time (outside
+// dedup mode) is kept in memory, while the inode shows a hole there,
+// until the file is flushed, which happens when it's closed, at
+// FS_Sync() or before anything else needs its content on disk; the
+// delayed blocks of a file then get their sectors all at once, in a
+// single run if there's one, and those of a file unlinked before
+// that never get any; all the open file entries of a file share its
+// delayed blocks, which the first one to write them holds
+
+// every delayed block counts as a sector taken: the free sectors left
+// for anything else leave one for each (see sectors_room()), so that
+// flushing them can't run out of space; those of the file being
+// flushed are the ones it may take; the same goes for a block that
+// bytes held back by File_Append() are the first to go to
+static int delayed_flushing;
+
+// return the number of delayed blocks of all open files, and of new
+// blocks held back
+static int delayed_count()
+{
+  int n = 0;
+  for(int fd=0; fd<MAX_OPEN_FILES; fd++) {
+    if(open_files[fd].delayed) n += __builtin_popcount(open_files[fd].delayed_blocks);
+    n += open_files[fd].pending_new;
+  }
+  return n;
+}
+
+// return true if 'count' sectors can be taken from the free ones
+// while leaving one for each delayed block
+static int sectors_room(int count)
+{
+  int free = sectors_free();
+  int kept = delayed_count()-delayed_flushing;
+  if(free >= 0 && free-kept >= count) return 1;
+  dprintf("... no room for %d sectors: %d free, %d kept for delayed blocks\n", count, free, kept);
+  return 0;
+}
+
+// return the open file entry holding the delayed blocks of inode 'ino',
+// or -1 if it has none
+static int delayed_holder(int ino)
+{
+  for(int fd=0; fd<MAX_OPEN_FILES; fd++)
+    if(open_files[fd].inode == ino && open_files[fd].delayed) return fd;
+  return -1;
+}
+
+// return the delayed block 'i' of the file open as 'fd'; with 'create',
+// the block is added (zeroed) if it isn't there yet; return NULL if
+// there's no such block, or if it can't be added (there's no sector
+// left for it)
+static char* delayed_block(int fd, int i, int create)
+{
+  int h = delayed_holder(open_files[fd].inode);
+  if(create && (h < 0 || !(open_files[h].delayed_blocks & (1u << i))) && !sectors_room(1))
+    return NULL;
+  if(h < 0) {
+    if(!create || !(open_files[fd].delayed = malloc(MAX_FILE_SIZE))) return NULL;
+    open_files[fd].delayed_blocks = 0;
+    h = fd;
+  }
+  char* block = open_files[h].delayed+i*SECTOR_SIZE;
+  if(!(open_files[h].delayed_blocks & (1u << i))) {
+    if(!create) return NULL;
+    memset(block, 0, SECTOR_SIZE);
+    open_files[h].delayed_blocks |= 1u << i;
+  }
+  return block;
+}
+
+// drop the delayed blocks of inode 'ino' from block 'from' on
+static void delayed_drop(int ino, int from)
+{
+  int h = delayed_holder(ino);
+  if(h < 0) return;
+  open_files[h].delayed_blocks &= FIRST_BLOCKS(from);
+  if(!open_files[h].delayed_blocks) {
+    free(open_files[h].delayed);
+    open_files[h].delayed = NULL;
+  }
+}
+
+// flush the delayed blocks of inode 'ino': allocate their sectors in
+// one pass and write them out; return 0 if successful, -1 otherwise
+// (the blocks are kept then)
+static int delayed_flush(int ino)
+{
+  int h = delayed_holder(ino);
+  if(h < 0) return 0;
+  alloc_near(ino);
+  int inode_sector = INODE_TABLE_SECTOR(ino/INODES_PER_SECTOR);
+  char inode_buffer[INODE_BUFFER_SIZE];
+  if(inodes_read(inode_sector, inode_buffer) < 0) return -1;
+  inode_t* file = (inode_t*)(inode_buffer+(ino%INODES_PER_SECTOR)*sizeof(inode_t));
+  unsigned int fresh;
+  delayed_flushing = __builtin_popcount(open_files[h].delayed_blocks);
+  int ret = alloc_blocks(file, open_files[h].delayed_blocks, &fresh);
+  delayed_flushing = 0;
+  if(ret < 0) {
+    dprintf("... no space for the delayed blocks of inode %d\n", ino);
+    return -1;
+  }
+  int n = 0;
+  for(int i=0; i<MAX_SECTORS_PER_FILE; i++) {
+    if(!(fresh & (1u << i))) continue;
+    if(Disk_Write(file->data[i], open_files[h].delayed+i*SECTOR_SIZE) < 0) return -1;
+    n++;
+  }
+  if(inodes_write(inode_sector, inode_buffer) < 0) return -1;
+  dprintf("... flushed %d delayed blocks of inode %d\n", n, ino);
+  delayed_drop(ino, 0);
+  return 0;
+}
+
+// flush the delayed blocks of all open files; return 0 if successful,
+// -1 otherwise
+static int delayed_flush_all()
+{
+  int ret = 0;
+  for(int fd=0; fd<MAX_OPEN_FILES; fd++)
+    if(open_files[fd].delayed && delayed_flush(open_files[fd].inode) < 0) ret = -1;
+  return ret;
+}
+
+// move the content of an inline file to a data block (if there's any
+// content), turning it into a regular file: the block is delayed if
+// the file is open as 'fd' (outside dedup mode), or else it gets a
+// sector right away; the caller writes the inode back; return 0 if
+// successful, -1 otherwise
+static int inline_to_block(int fd, inode_t* file)
+{
+  char block[SECTOR_SIZE];
+  memset(block, 0, SECTOR_SIZE);
+  memcpy(block, file->data, file->size);
+  memset(file->data, 0, sizeof(file->data));
+  file->flags &= ~INODE_INLINE;
+  if(file->size == 0) return 0;
+  if(fd >= 0 && !dedup_enabled) {
+    char* delayed = delayed_block(fd, 0, 1);
+    if(!delayed) return -1;
+    memcpy(delayed, block, SECTOR_SIZE);
+    dprintf("... moved %d inline bytes to delayed block 0\n", file->size);
+    return 0;
+  }
+  int newsector = bitmap_first_unused(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, TOTAL_SECTORS);
+  if(newsector < 0 || Disk_Write(newsector, block) < 0) return -1;
+  file->data[0] = newsector;
+  dprintf("... moved %d inline bytes to sector %d\n", file->size, newsector);
+  return 0;
+}
+
+// forget all open files, along with their delayed blocks and the
+// bytes held back by File_Append(), and all directory handles
+static void drop_open_files()
+{
+  for(int fd=0; fd<MAX_OPEN_FILES; fd++) {
+    free(open_files[fd].delayed);
+    free(open_files[fd].pending);
+  }
+  memset(open_files, 0, MAX_OPEN_FILES*sizeof(open_file_t));
+  memset(dir_handles, 0, sizeof(dir_handles));
+  appending = 0;
+}
+
+// return true if the file pointed to by inode has already been open
+int is_file_open(int inode)
+{
+  for(int i=0; i<MAX_OPEN_FILES; i++) {
+    if(open_files[i].inode == inode)
+      return 1;
+  }
+  return 0;
+}
+
+// files mapped into memory by File_Mmap(): either a view of the
+// file's sectors, lent out by the disk, or a copy of its content
+#define MAX_MMAPS 64
+typedef struct _mmap {
+  const char* addr; // where the file is mapped (NULL if not used)
+  int inode;
+  int sector;   // the first sector lent out, if it's a view
+  int nsectors; // the number of sectors lent out (0 for a copy)
+  unsigned int held; // sectors of the view no file refers to any more
+		     // (bit i for sector+i), released when it's unmapped
+} mmap_t;
+static mmap_t mmaps[MAX_MMAPS];
+
+// keep a data sector no file refers to any more from being reused
+// while a view still lends it out; return 1 if it's held, or 0 if no
+// view has it
+static int mmap_hold(int sector)
+{
+  for(int m=0; m<MAX_MMAPS; m++) {
+    if(mmaps[m].addr && sector >= mmaps[m].sector &&
+       sector < mmaps[m].sector+mmaps[m].nsectors) {
+      mmaps[m].held |= 1u << (sector-mmaps[m].sector);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// return true if the file pointed to by inode is mapped into memory
+static int is_file_mapped(int inode)
+{
+  for(int i=0; i<MAX_MMAPS; i++) {
+    if(mmaps[i].addr && mmaps[i].inode == inode)
+      return 1;
+  }
+  return 0;
+}
+
+// return a new file descriptor not used; -1 if full
+int new_file_fd()
 {
   for(int i=0; i<MAX_OPEN_FILES; i++) {
     if(open_files[i].inode <= 0)
@@ -728,11 +2073,21 @@ int new_file_fd()
   return -1;
 }
 
+// comparison function for sorting integers with qsort()
+static int compare_int(const void* a, const void* b)
+{
+  return *(const int*)a - *(const int*)b;
+}
+
 /* end of internal helper functions, start of API functions */
 
-int FS_Boot(char* backstore_fname)
+static int fs_boot(char* backstore_fname)
 {
+  if(getenv("LIBFS_TRACE")) trace_on = 1;
   dprintf("FS_Boot('%s'):\n", backstore_fname);
+  mounted_snapshot = -1;
+  memset(bitmap_full, 0, sizeof(bitmap_full));
+  free_sectors = -1;
   // initialize a new disk (this is a simulated disk)
   if(Disk_Init() < 0) {
     dprintf("... disk init failed\n");
@@ -755,38 +2110,61 @@ int FS_Boot(char* backstore_fname)
     if(diskErrno == E_OPENING_FILE) {
       dprintf("... couldn't open file, create new file system\n");
 
-      // format superblock
-      char buf[SECTOR_SIZE];
+      // format superblock, recording the format version asked for
+      char* format = getenv("LIBFS_FORMAT");
+      int version = FS_VERSION_GROUPED;
+      if(format && !strcmp(format, "1")) version = 0;
+      else if(format && !strcmp(format, "2")) version = FS_VERSION_PACKED;
+      else if(format && strcmp(format, "3"))
+	fprintf(stderr, "LIBFS_FORMAT: can't use '%s'\n", format);
+      packed_format = version != 0;
+      grouped_format = version == FS_VERSION_GROUPED;
+      char buf[INODE_BUFFER_SIZE];
       memset(buf, 0, SECTOR_SIZE);
-      *(int*)buf = OS_MAGIC;
+      ((superblock_t*)buf)->magic = OS_MAGIC;
+      ((superblock_t*)buf)->version = version;
       if(Disk_Write(SUPERBLOCK_START_SECTOR, buf) < 0) {
 	dprintf("... failed to format superblock\n");
 	osErrno = E_GENERAL;
 	return -1;
       }
-      dprintf("... formatted superblock (sector %d)\n", SUPERBLOCK_START_SECTOR);
-
-      // format inode bitmap (reserve the first inode to root)
-      bitmap_init(INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, 1);
-      dprintf("... formatted inode bitmap (start=%d, num=%d)\n",
-	     (int)INODE_BITMAP_START_SECTOR, (int)INODE_BITMAP_SECTORS);
-      
-      // format sector bitmap (reserve the first few sectors to
-      // superblock, inode bitmap, sector bitmap, and inode table)
-      bitmap_init(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS,
-		  DATABLOCK_START_SECTOR);
-      dprintf("... formatted sector bitmap (start=%d, num=%d)\n",
-	     (int)SECTOR_BITMAP_START_SECTOR, (int)SECTOR_BITMAP_SECTORS);
+      dprintf("... formatted superblock (sector %d, version %d)\n", SUPERBLOCK_START_SECTOR,
+	      version ? version : 1);
+
+      if(grouped_format) {
+	// each group's bitmaps reserve its fixed part, and the first one
+	// the root inode too; bitmap_init() marks one bit more than it's
+	// asked to, hence the -1s
+	for(int g=0; g<GROUPS; g++) {
+	  bitmap_init(BITMAP_SECTOR(INODE_BITMAP_START_SECTOR, g), 1, g == 0 ? 0 : -1);
+	  bitmap_init(BITMAP_SECTOR(SECTOR_BITMAP_START_SECTOR, g), 1,
+		      DATABLOCK_START_SECTOR-1);
+	}
+	dprintf("... formatted bitmaps of %d block groups (%d sectors, %d inodes each)\n",
+		(int)GROUPS, (int)GROUP_SECTORS, (int)GROUP_INODES);
+      } else {
+	// format inode bitmap (reserve the first inode to root)
+	bitmap_init(INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, 1);
+	dprintf("... formatted inode bitmap (start=%d, num=%d)\n",
+		(int)INODE_BITMAP_START_SECTOR, (int)INODE_BITMAP_SECTORS);
+
+	// format sector bitmap (reserve the first few sectors to
+	// superblock, inode bitmap, sector bitmap, and inode table)
+	bitmap_init(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS,
+		    DATABLOCK_START_SECTOR);
+	dprintf("... formatted sector bitmap (start=%d, num=%d)\n",
+		(int)SECTOR_BITMAP_START_SECTOR, (int)SECTOR_BITMAP_SECTORS);
+      }
       
       // format inode tables
       for(int i=0; i<INODE_TABLE_SECTORS; i++) {
-	memset(buf, 0, SECTOR_SIZE);
+	memset(buf, 0, INODE_BUFFER_SIZE);
 	if(i==0) {
 	  // the first inode table entry is the root directory
 	  ((inode_t*)buf)->size = 0;
 	  ((inode_t*)buf)->type = 1;
 	}
-	if(Disk_Write(INODE_TABLE_START_SECTOR+i, buf) < 0) {
+	if(inodes_write(INODE_TABLE_SECTOR(i), buf) < 0) {
 	  dprintf("... failed to format inode table\n");
 	  osErrno = E_GENERAL;
 	  return -1;
@@ -805,7 +2183,8 @@ int FS_Boot(char* backstore_fname)
       } else {
 	// everything's good now, boot is successful
 	dprintf("... successfully formatted disk, boot successful\n");
-	memset(open_files, 0, MAX_OPEN_FILES*sizeof(open_file_t));
+	drop_open_files();
+	dedup_rebuild();
 	return 0;
       }
     } else {
@@ -816,29 +2195,18 @@ int FS_Boot(char* backstore_fname)
     }
   } else {
     dprintf("... load disk from file '%s' successful\n", bs_filename);
-    
-    // we successfully loaded the disk, we need to do two more checks,
-    // first the file size must be exactly the size as expected (thiis
-    // supposedly should be folded in Disk_Load(); and it's not)
-    int sz = 0;
-    FILE* f = fopen(bs_filename, "r");
-    if(f) {
-      fseek(f, 0, SEEK_END);
-      sz = ftell(f);
-      fclose(f);
-    }
-    if(sz != SECTOR_SIZE*TOTAL_SECTORS) {
-      dprintf("... check size of file '%s' failed\n", bs_filename);
-      osErrno = E_GENERAL;
-      return -1;
-    }
-    dprintf("... check size of file '%s' successful\n", bs_filename);
-    
-    // check magic
+
+    // we successfully loaded the disk (Disk_Load() checks the size of
+    // the file), now check magic
     if(check_magic()) {
       // everything's good by now, boot is successful
       dprintf("... check magic successful\n");
-      memset(open_files, 0, MAX_OPEN_FILES*sizeof(open_file_t));
+      drop_open_files();
+      if(dedup_rebuild() < 0) {
+	dprintf("... failed to rebuild dedup index, boot failed\n");
+	osErrno = E_GENERAL;
+	return -1;
+      }
       return 0;
     } else {      
       // mismatched magic number
@@ -849,8 +2217,25 @@ int FS_Boot(char* backstore_fname)
   }
 }
 
-int FS_Sync()
+static int fs_sync()
 {
+  // nothing can change while a snapshot is mounted
+  if(mounted_snapshot >= 0) return 0;
+
+  // the bytes held back by File_Append() (if they couldn't be written
+  // out when the call started) and the delayed blocks go to the disk
+  // first
+  if(appending && append_settle() < 0) {
+    dprintf("FS_Sync():\n... failed to write out appended bytes\n");
+    osErrno = E_NO_SPACE;
+    return -1;
+  }
+  if(delayed_flush_all() < 0) {
+    dprintf("FS_Sync():\n... failed to flush delayed blocks\n");
+    osErrno = E_NO_SPACE;
+    return -1;
+  }
+
   if(Disk_Save(bs_filename) < 0) {
     // if can't write to file, something's wrong with the backstore
     dprintf("FS_Sync():\n... failed to save disk to file '%s'\n", bs_filename);
@@ -863,385 +2248,2806 @@ int FS_Sync()
   }
 }
 
-int File_Create(char* file)
+static int fs_set_dedup(int enable)
 {
-  dprintf("File_Create('%s'):\n", file);
-  return create_file_or_directory(0, file);
+  dprintf("FS_SetDedup(%d):\n", enable);
+  if(is_read_only()) return -1;
+  // no block is delayed in dedup mode
+  if(delayed_flush_all() < 0) {
+    osErrno = E_NO_SPACE;
+    return -1;
+  }
+  char sb[SECTOR_SIZE];
+  if(Disk_Read(SUPERBLOCK_START_SECTOR, sb) < 0) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  ((superblock_t*)sb)->dedup = enable ? 1 : 0;
+  if(Disk_Write(SUPERBLOCK_START_SECTOR, sb) < 0 || dedup_rebuild() < 0) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  return 0;
 }
 
-int File_Unlink(char* file)
+// collect the data sectors referenced by the inodes stored in an inode
+// table sector 'buf' into 'sectors' (starting at index 'n'); when
+// 'bitmap' is given, only inodes marked in use there are considered;
+// return the new number of collected sectors
+static int collect_data_sectors(char* buf, int first_inode, char bitmap[][SECTOR_SIZE],
+				int* sectors, int n)
 {
-  /* YOUR CODE */
-
-  dprintf("File_Unlink('%s'):\n", file);
-  int child_inode;
-  char child_fname[MAX_NAME];
-  int parent_inode = follow_path(file, &child_inode, child_fname);
+  for(int i=0; i<INODES_PER_SECTOR && first_inode+i<MAX_FILES; i++) {
+    int ino = first_inode+i;
+    if(bitmap && !BITMAP_TEST(bitmap, INODE_BITMAP_BITS, ino))
+      continue;
+    inode_t* inode = (inode_t*)(buf+i*sizeof(inode_t));
+    if(inode->flags & INODE_INLINE) continue;
+    for(int j=0; j<MAX_SECTORS_PER_FILE; j++)
+      if(inode->data[j] > 0) sectors[n++] = inode->data[j];
+  }
+  return n;
+}
 
-  return remove_inode(0, parent_inode, child_inode);
+// find the snapshot slot with the given name in the superblock 'super';
+// return -1 if there's no such snapshot
+static int find_snapshot(superblock_t* super, char* name)
+{
+  for(int i=0; i<MAX_SNAPSHOTS; i++) {
+    if(super->snapshots[i].name[0] && !strncmp(super->snapshots[i].name, name, MAX_NAME))
+      return i;
+  }
+  return -1;
 }
 
-int File_Open(char* file)
+static int fs_snapshot(char* name)
 {
-  dprintf("File_Open('%s'):\n", file);
-  int fd = new_file_fd();
-  if(fd < 0) {
-    dprintf("... max open files reached\n");
-    osErrno = E_TOO_MANY_OPEN_FILES;
+  dprintf("FS_Snapshot('%s'):\n", name);
+  if(is_read_only()) return -1;
+  char sb[SECTOR_SIZE];
+  superblock_t* super = (superblock_t*)sb;
+  if(!name || !*name || illegal_filename(name) ||
+     Disk_Read(SUPERBLOCK_START_SECTOR, sb) < 0 || find_snapshot(super, name) >= 0) {
+    dprintf("... can't create snapshot '%s'\n", name ? name : "(null)");
+    osErrno = E_CREATE;
+    return -1;
+  }
+  int slot;
+  for(slot=0; slot<MAX_SNAPSHOTS && super->snapshots[slot].name[0]; slot++);
+  if(slot == MAX_SNAPSHOTS) {
+    dprintf("... all %d snapshot slots are in use\n", MAX_SNAPSHOTS);
+    osErrno = E_CREATE;
+    return -1;
+  }
+  // the snapshot has the delayed blocks too
+  if(delayed_flush_all() < 0) {
+    osErrno = E_NO_SPACE;
     return -1;
   }
 
-  int child_inode;
-  follow_path(file, &child_inode, NULL);
-  if(child_inode >= 0) { // child is the one
-    // load the disk sector containing the inode
-    int inode_sector = INODE_TABLE_START_SECTOR+child_inode/INODES_PER_SECTOR;
-    char inode_buffer[SECTOR_SIZE];
-    if(Disk_Read(inode_sector, inode_buffer) < 0) { osErrno = E_GENERAL; return -1; }
-    dprintf("... load inode table for inode from disk sector %d\n", inode_sector);
+  // find the inode table sectors in use, and all data sectors their
+  // inodes refer to
+  char bitmap[INODE_BITMAP_SECTORS][SECTOR_SIZE];
+  for(int i=0; i<INODE_BITMAP_SECTORS; i++) {
+    if(Disk_Read(BITMAP_SECTOR(INODE_BITMAP_START_SECTOR, i), bitmap[i]) < 0) {
+      osErrno = E_GENERAL;
+      return -1;
+    }
+  }
+  int used[MAX_INODE_TABLE_SECTORS], nused = 0, nrefs = 0;
+  int* refs = malloc(MAX_FILES*MAX_SECTORS_PER_FILE*sizeof(int));
+  if(!refs) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  for(int t=0; t<INODE_TABLE_SECTORS; t++) {
+    int any = 0;
+    for(int ino=t*INODES_PER_SECTOR; ino<(t+1)*INODES_PER_SECTOR && ino<MAX_FILES; ino++)
+      if(BITMAP_TEST(bitmap, INODE_BITMAP_BITS, ino)) any = 1;
+    if(!any) continue;
+    char buf[INODE_BUFFER_SIZE];
+    if(inodes_read(INODE_TABLE_SECTOR(t), buf) < 0) {
+      free(refs);
+      osErrno = E_GENERAL;
+      return -1;
+    }
+    nrefs = collect_data_sectors(buf, t*INODES_PER_SECTOR, bitmap, refs, nrefs);
+    used[nused++] = t;
+  }
 
-    // get the inode
-    int inode_start_entry = (inode_sector-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
-    int offset = child_inode-inode_start_entry;
-    assert(0 <= offset && offset < INODES_PER_SECTOR);
-    inode_t* child = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
-    dprintf("... inode %d (size=%d, type=%d)\n",
-	    child_inode, child->size, child->type);
+  // the snapshot takes one more reference to each data sector, and gets
+  // its own copy of the inode table sectors in use
+  int newsecs[MAX_INODE_TABLE_SECTORS+SNAPSHOT_MAP_SECTORS];
+  if(bitmap_alloc_many(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, TOTAL_SECTORS,
+		       nused+SNAPSHOT_MAP_SECTORS, newsecs) < 0) {
+    free(refs);
+    dprintf("... error: disk is full\n");
+    osErrno = E_NO_SPACE;
+    return -1;
+  }
+  if(sector_adjust_refs_many(nrefs, refs, 1) < 0) {
+    free(refs);
+    bitmap_reset_many(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS,
+		      nused+SNAPSHOT_MAP_SECTORS, newsecs);
+    dprintf("... error: can't take another reference to the data sectors\n");
+    osErrno = E_NO_SPACE;
+    return -1;
+  }
+  free(refs);
 
-    if(child->type != 0) {
-      dprintf("... error: '%s' is not a file\n", file);
+  char map[SNAPSHOT_MAP_SECTORS][SECTOR_SIZE];
+  memset(map, 0, sizeof(map));
+  for(int k=0; k<nused; k++) {
+    char buf[INODE_BUFFER_SIZE];
+    if(inodes_read(INODE_TABLE_SECTOR(used[k]), buf) < 0) {
+      osErrno = E_GENERAL;
+      return -1;
+    }
+    // the copy keeps only the inodes in use, so that it can be released
+    // without the bitmap later on
+    for(int i=0; i<INODES_PER_SECTOR; i++) {
+      int ino = used[k]*INODES_PER_SECTOR+i;
+      if(ino >= MAX_FILES || !BITMAP_TEST(bitmap, INODE_BITMAP_BITS, ino))
+	memset(buf+i*sizeof(inode_t), 0, sizeof(inode_t));
+    }
+    if(inodes_write(newsecs[k], buf) < 0) {
       osErrno = E_GENERAL;
       return -1;
     }
+    ((int*)map)[used[k]] = newsecs[k];
+  }
 
-    // initialize open file entry and return its index
-    open_files[fd].inode = child_inode;
-    open_files[fd].size = child->size;
-    open_files[fd].pos = 0;
-    return fd;
-  } else {
-    dprintf("... file '%s' is not found\n", file);
-    osErrno = E_NO_SUCH_FILE;
+  // the reference counts may have moved the superblock on
+  if(Disk_Read(SUPERBLOCK_START_SECTOR, sb) < 0) {
+    osErrno = E_GENERAL;
     return -1;
-  }  
+  }
+  for(int m=0; m<SNAPSHOT_MAP_SECTORS; m++) {
+    super->snapshots[slot].map[m] = newsecs[nused+m];
+    if(Disk_Write(newsecs[nused+m], map[m]) < 0) {
+      osErrno = E_GENERAL;
+      return -1;
+    }
+  }
+  strncpy(super->snapshots[slot].name, name, MAX_NAME);
+  if(Disk_Write(SUPERBLOCK_START_SECTOR, sb) < 0) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  dprintf("... snapshot '%s' taken in slot %d (%d inode table sectors, %d data references)\n",
+	  name, slot, nused, nrefs);
+  return 0;
 }
 
-int File_Read(int fd, void* buffer, int size)
+static int fs_snapshot_delete(char* name)
 {
-  /* YOUR CODE */
+  dprintf("FS_SnapshotDelete('%s'):\n", name);
+  if(is_read_only()) return -1;
+  char sb[SECTOR_SIZE];
+  superblock_t* super = (superblock_t*)sb;
+  int slot;
+  if(!name || Disk_Read(SUPERBLOCK_START_SECTOR, sb) < 0 ||
+     (slot = find_snapshot(super, name)) < 0) {
+    dprintf("... snapshot '%s' is not found\n", name ? name : "(null)");
+    osErrno = E_NO_SUCH_FILE;
+    return -1;
+  }
 
-	int file_inode = open_files[fd].inode; // file_inode will have the inode number for the file to be read.
-                                              //Here, open_files is a structure containing the value of inode with variable name inode.
-	if(!file_inode) // If the file is not open (i.e open_files[fd].inode returns 0), return -1, and set osErrno to E_BAD_FD.
-  {  
-		osErrno = E_BAD_FD;  
-		return -1;
-	}
+  // the snapshot drops its reference to every data sector it refers to
+  // and gives back its own sectors
+  char map[SNAPSHOT_MAP_SECTORS][SECTOR_SIZE];
+  int owned[MAX_INODE_TABLE_SECTORS+SNAPSHOT_MAP_SECTORS], nowned = 0, nrefs = 0;
+  int* refs = malloc(MAX_FILES*MAX_SECTORS_PER_FILE*sizeof(int));
+  if(!refs) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  for(int m=0; m<SNAPSHOT_MAP_SECTORS; m++) {
+    if(Disk_Read(super->snapshots[slot].map[m], map[m]) < 0) {
+      free(refs);
+      osErrno = E_GENERAL;
+      return -1;
+    }
+    owned[nowned++] = super->snapshots[slot].map[m];
+  }
+  for(int t=0; t<INODE_TABLE_SECTORS; t++) {
+    int copy = ((int*)map)[t];
+    char buf[INODE_BUFFER_SIZE];
+    if(!copy) continue;
+    if(inodes_read(copy, buf) < 0) {
+      free(refs);
+      osErrno = E_GENERAL;
+      return -1;
+    }
+    // inodes not in use are all zeros in the copy
+    nrefs = collect_data_sectors(buf, t*INODES_PER_SECTOR, NULL, refs, nrefs);
+    owned[nowned++] = copy;
+  }
+  int ret = release_sectors(nrefs, refs);
+  free(refs);
+  if(ret < 0 || bitmap_reset_many(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS,
+				  nowned, owned) < 0 ||
+     Disk_Read(SUPERBLOCK_START_SECTOR, sb) < 0) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  memset(&super->snapshots[slot], 0, sizeof(snapshot_t));
+  if(Disk_Write(SUPERBLOCK_START_SECTOR, sb) < 0) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  dprintf("... snapshot '%s' deleted (%d data references dropped)\n", name, nrefs);
+  return 0;
+}
 
-	// load the disk sector containing the child inode
-     
-	int inode_sector = INODE_TABLE_START_SECTOR+file_inode/INODES_PER_SECTOR; //inode_sector will have the sector number that contains file_inode which is our required file inode.
-	char inode_buffer[SECTOR_SIZE]; 
+static int fs_boot_snapshot(char* backstore_fname, char* name)
+{
+  dprintf("FS_BootSnapshot('%s', '%s'):\n", backstore_fname, name);
+  if(FS_Boot(backstore_fname) < 0) return -1;
+
+  char sb[SECTOR_SIZE];
+  superblock_t* super = (superblock_t*)sb;
+  int slot;
+  if(!name || Disk_Read(SUPERBLOCK_START_SECTOR, sb) < 0 ||
+     (slot = find_snapshot(super, name)) < 0) {
+    dprintf("... snapshot '%s' is not found\n", name ? name : "(null)");
+    osErrno = E_NO_SUCH_FILE;
+    return -1;
+  }
+  char map[SNAPSHOT_MAP_SECTORS][SECTOR_SIZE];
+  for(int m=0; m<SNAPSHOT_MAP_SECTORS; m++) {
+    if(Disk_Read(super->snapshots[slot].map[m], map[m]) < 0) {
+      osErrno = E_GENERAL;
+      return -1;
+    }
+  }
+  memcpy(snapshot_table, map, sizeof(snapshot_table));
+  mounted_snapshot = slot;
+  dprintf("... snapshot '%s' mounted read-only\n", name);
+  return 0;
+}
 
-        // from the line below, after Dish_read "inode_buffer" will contain the inode_sector's content
-	if(Disk_Read(inode_sector, inode_buffer) < 0) return -1; 
+static int file_create(char* file)
+{
+  dprintf("File_Create('%s'):\n", file);
+  if(is_read_only()) return -1;
+  return create_file_or_directory(0, file);
+}
 
-	dprintf("... load inode table for child inode from disk sector %d\n", inode_sector);
-	
-	
-	// get the child inode  
-	int inode_start_entry = (inode_sector-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR; // inode_start_entry will have inode number that will be in the start of the inode_sector
-	int offset = file_inode-inode_start_entry; // now we have the offset to go from the inode_start_entry to reach to our desired inode.
-	assert(0 <= offset && offset < INODES_PER_SECTOR); // offset can be 0 to INODE_PER_SECTOR. otherwise assert function will give an error message and abort program execution
-	inode_t* file = (inode_t*)(inode_buffer+offset*sizeof(inode_t)); // Here, inode_buffer will provide starting address of inode_buffer[]. but we need only our 
-                                                                         // desired file_inode content.so we are adding offset adress with starting address to get there.
-                                                                         // Now, file will point to the file_inode.
+// unlink the file 'child_inode' (-1 if it wasn't found) from the
+// directory 'parent_inode'; 'file' is only for messages
+static int unlink_child(int parent_inode, int child_inode, char* file)
+{
+  if(child_inode < 0) {
+    dprintf("... file '%s' is not found\n", file);
+    osErrno = E_NO_SUCH_FILE;
+    return -1;
+  }
+  if(is_file_mapped(child_inode)) {
+    dprintf("... file '%s' is mapped\n", file);
+    osErrno = E_FILE_IN_USE;
+    return -1;
+  }
 
-	// Necessary variables needed for file_read
-        int i,j,count=0;
-        char* charBuffer = (char*) buffer;
-        char temp_buffer[SECTOR_SIZE];
-	int s_pos = open_files[fd].pos;
+  // the blocks still delayed never get sectors
+  delayed_drop(child_inode, 0);
+  return remove_inode(0, parent_inode, child_inode);
+}
 
+static int file_unlink(char* file)
+{
+  /* YOUR CODE */
 
-	// define start variables to read starting from file pointer
+  dprintf("File_Unlink('%s'):\n", file);
+  if(is_read_only()) return -1;
+  int child_inode;
+  char child_fname[MAX_NAME];
+  int parent_inode = follow_path(file, &child_inode, child_fname);
+  if(parent_inode < 0) child_inode = -1;
+  return unlink_child(parent_inode, child_inode, file);
+}
+
+// resolve the directory 'dir' for a batched operation: load the disk
+// sector holding its inode into 'inode_buffer' (through
+// 'inode_sector') and all its dirent sectors into 'dirents'; return
+// the inode of the directory, or -1 if it cannot be established
+static int load_batch_dir(char* dir, int* inode_sector, char* inode_buffer,
+			  char dirents[][DIRENT_BUFFER_SIZE])
+{
+  int dir_inode;
+  if(follow_path(dir, &dir_inode, NULL) < 0 || dir_inode < 0) {
+    dprintf("... directory '%s' is not found\n", dir);
+    return -1;
+  }
+
+  *inode_sector = INODE_TABLE_SECTOR(dir_inode/INODES_PER_SECTOR);
+  if(inodes_read(*inode_sector, inode_buffer) < 0) return -1;
+  int offset = dir_inode-INODE_TABLE_INDEX(*inode_sector)*INODES_PER_SECTOR;
+  assert(0 <= offset && offset < INODES_PER_SECTOR);
+  inode_t* parent = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
+  if(parent->type != 1) {
+    dprintf("... '%s' is not a directory\n", dir);
+    return -1;
+  }
+
+  int groups = (parent->size+DIRENTS_PER_SECTOR-1)/DIRENTS_PER_SECTOR;
+  for(int g=0; g<groups; g++) {
+    if(dirents_read(parent->data[g], dirents[g]) < 0) return -1;
+  }
+  return dir_inode;
+}
+
+static int file_create_many(char* dir, char** names, int n)
+{
+  dprintf("File_CreateMany('%s', %d):\n", dir, n);
+  if(is_read_only()) return -1;
+  if(n < 0 || (n > 0 && !names)) {
+    osErrno = E_CREATE;
+    return -1;
+  }
+  if(n == 0) return 0;
+
+  int parent_sector;
+  char parent_buffer[INODE_BUFFER_SIZE];
+  char dirents[MAX_SECTORS_PER_FILE][DIRENT_BUFFER_SIZE];
+  int parent_inode = load_batch_dir(dir, &parent_sector, parent_buffer, dirents);
+  if(parent_inode < 0) {
+    osErrno = E_CREATE;
+    return -1;
+  }
+  int offset = parent_inode-INODE_TABLE_INDEX(parent_sector)*INODES_PER_SECTOR;
+  inode_t* parent = (inode_t*)(parent_buffer+offset*sizeof(inode_t));
+
+  if(parent->size+n > MAX_SECTORS_PER_FILE*DIRENTS_PER_SECTOR) {
+    dprintf("... directory '%s' can't hold %d more entries\n", dir, n);
+    osErrno = E_CREATE;
+    return -1;
+  }
+
+  // validate all names before touching the disk: each must be legal,
+  // unique within the batch, and not already present in the directory
+  for(int k=0; k<n; k++) {
+    if(!names[k] || !*names[k] || illegal_filename(names[k])) {
+      dprintf("... illegal file name: '%s'\n", names[k] ? names[k] : "(null)");
+      osErrno = E_CREATE;
+      return -1;
+    }
+    for(int m=0; m<k; m++) {
+      if(!strcmp(names[m], names[k])) {
+	dprintf("... duplicate file name in batch: '%s'\n", names[k]);
+	osErrno = E_CREATE;
+	return -1;
+      }
+    }
+    for(int e=0; e<parent->size; e++) {
+      dirent_t* d = (dirent_t*)dirents[e/DIRENTS_PER_SECTOR]+e%DIRENTS_PER_SECTOR;
+      if(!strncmp(d->fname, names[k], MAX_NAME)) {
+	dprintf("... file '%s' already exists, failed to create\n", names[k]);
+	osErrno = E_CREATE;
+	return -1;
+      }
+    }
+  }
+
+  // allocate all inodes and all new dirent sectors with one pass over
+  // each bitmap, in the directory's block group if there's room
+  alloc_near(parent_inode);
+  int old_groups = (parent->size+DIRENTS_PER_SECTOR-1)/DIRENTS_PER_SECTOR;
+  int new_groups = (parent->size+n+DIRENTS_PER_SECTOR-1)/DIRENTS_PER_SECTOR;
+  int inodes[n], sectors[MAX_SECTORS_PER_FILE];
+  if(bitmap_alloc_many(INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS,
+		       MAX_FILES, n, inodes) < 0) {
+    dprintf("... error: inode table can't hold %d more inodes\n", n);
+    osErrno = E_CREATE;
+    return -1;
+  }
+  if(bitmap_alloc_many(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS,
+		       TOTAL_SECTORS, new_groups-old_groups, sectors) < 0) {
+    dprintf("... error: disk is full\n");
+    bitmap_reset_many(INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, n, inodes);
+    osErrno = E_CREATE;
+    return -1;
+  }
+
+  // from here on, a failure gives back all that the batch took (see
+  // below), so that it applies fully or not at all
+  int shared[MAX_SECTORS_PER_FILE];
+  memcpy(shared, parent->data, sizeof(shared));
+
+  // initialize the new inodes; they come out of the bitmap in
+  // increasing order within each block group, and a group at a time,
+  // so the inodes of an inode table sector are all together and each
+  // sector is written once (the sector shared with the parent is
+  // written with the parent below)
+  for(int k=0; k<n; ) {
+    int sector = INODE_TABLE_SECTOR(inodes[k]/INODES_PER_SECTOR);
+    char inode_buffer[INODE_BUFFER_SIZE];
+    char* buf = (sector == parent_sector) ? parent_buffer : inode_buffer;
+    if(buf == inode_buffer && inodes_read(sector, inode_buffer) < 0) goto fail;
+    for(; k<n && INODE_TABLE_SECTOR(inodes[k]/INODES_PER_SECTOR) == sector; k++) {
+      inode_t* child = (inode_t*)(buf+(inodes[k]%INODES_PER_SECTOR)*sizeof(inode_t));
+      memset(child, 0, sizeof(inode_t));
+      child->flags = INODE_INLINE;
+      dprintf("... new child inode %d for '%s'\n", inodes[k], names[k]);
+    }
+    if(buf == inode_buffer && inodes_write(sector, inode_buffer) < 0) goto fail;
+  }
+
+  // append the dirents in memory, then write each touched dirent
+  // sector once (copying a shared one first)
+  for(int g=old_groups; g<new_groups; g++) {
+    parent->data[g] = sectors[g-old_groups];
+    memset(dirents[g], 0, DIRENT_BUFFER_SIZE);
+  }
+  int first_group = parent->size/DIRENTS_PER_SECTOR;
+  for(int k=0; k<n; k++) {
+    int e = parent->size+k;
+    dirent_t* d = (dirent_t*)dirents[e/DIRENTS_PER_SECTOR]+e%DIRENTS_PER_SECTOR;
+    strncpy(d->fname, names[k], MAX_NAME);
+    d->inode = inodes[k];
+  }
+  for(int g=first_group; g<new_groups; g++) {
+    if((g < old_groups && sector_own(&parent->data[g]) < 0) ||
+       dirents_write(parent->data[g], dirents[g]) < 0) goto fail;
+    dprintf("... update disk sector %d for dirent group %d\n", parent->data[g], g);
+  }
+
+  // update the parent inode only once
+  parent->size += n;
+  if(inodes_write(parent_sector, parent_buffer) < 0) goto fail;
+  dprintf("... successfully created %d files in '%s'\n", n, dir);
+  return n;
+
+ fail:
+  // the parent doesn't link any of the batch: its inodes and new dirent
+  // sectors are freed, and so are the copies of shared dirent sectors,
+  // which get their reference back
+  dprintf("... failed, giving back %d inodes and %d sectors\n", n, new_groups-old_groups);
+  bitmap_reset_many(INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, n, inodes);
+  bitmap_reset_many(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS,
+		    new_groups-old_groups, sectors);
+  for(int g=0; g<old_groups; g++) {
+    if(parent->data[g] == shared[g]) continue;
+    bitmap_reset(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, parent->data[g]);
+    sector_adjust_refs(shared[g], 1);
+  }
+  osErrno = E_CREATE;
+  return -1;
+}
+
+static int file_unlink_many(char* dir, char** names, int n)
+{
+  dprintf("File_UnlinkMany('%s', %d):\n", dir, n);
+  if(is_read_only()) return -1;
+  if(n < 0 || (n > 0 && !names)) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  if(n == 0) return 0;
+
+  int parent_sector;
+  char parent_buffer[INODE_BUFFER_SIZE];
+  char dirents[MAX_SECTORS_PER_FILE][DIRENT_BUFFER_SIZE];
+  int parent_inode = load_batch_dir(dir, &parent_sector, parent_buffer, dirents);
+  if(parent_inode < 0) {
+    osErrno = E_NO_SUCH_DIR;
+    return -1;
+  }
+  int offset = parent_inode-INODE_TABLE_INDEX(parent_sector)*INODES_PER_SECTOR;
+  inode_t* parent = (inode_t*)(parent_buffer+offset*sizeof(inode_t));
+#define BATCH_DIRENT(e) ((dirent_t*)dirents[(e)/DIRENTS_PER_SECTOR]+(e)%DIRENTS_PER_SECTOR)
+
+  // a batch longer than the directory must name a missing file or the
+  // same one twice (and would not fit on the stack)
+  if(n > parent->size) {
+    dprintf("... directory '%s' has only %d entries\n", dir, parent->size);
+    osErrno = E_NO_SUCH_FILE;
+    return -1;
+  }
+
+  // validate the whole batch first: every name must be an existing
+  // regular file that is not currently open
+  int victims[n];
+  for(int k=0; k<n; k++) {
+    victims[k] = -1;
+    for(int e=0; e<parent->size && names[k]; e++) {
+      if(!strncmp(BATCH_DIRENT(e)->fname, names[k], MAX_NAME)) {
+	victims[k] = BATCH_DIRENT(e)->inode;
+	break;
+      }
+    }
+    if(victims[k] < 0) {
+      dprintf("... file '%s' is not found\n", names[k] ? names[k] : "(null)");
+      osErrno = E_NO_SUCH_FILE;
+      return -1;
+    }
+    for(int m=0; m<k; m++) {
+      if(victims[m] == victims[k]) {
+	dprintf("... file '%s' given twice\n", names[k]);
+	osErrno = E_NO_SUCH_FILE;
+	return -1;
+      }
+    }
+    if(is_file_open(victims[k]) || is_file_mapped(victims[k])) {
+      dprintf("... file '%s' is in use\n", names[k]);
+      osErrno = E_FILE_IN_USE;
+      return -1;
+    }
+  }
+
+  // sort the victims so that inodes sharing an inode table sector are
+  // adjacent, and make sure all of them are regular files
+  qsort(victims, n, sizeof(int), compare_int);
+  for(int k=0; k<n; k++) {
+    char inode_buffer[INODE_BUFFER_SIZE];
+    if(inodes_read(INODE_TABLE_SECTOR(victims[k]/INODES_PER_SECTOR), inode_buffer) < 0) {
+      osErrno = E_GENERAL;
+      return -1;
+    }
+    inode_t* child = (inode_t*)(inode_buffer+(victims[k]%INODES_PER_SECTOR)*sizeof(inode_t));
+    if(child->type != 0) {
+      dprintf("... inode %d is not a file\n", victims[k]);
+      osErrno = E_GENERAL;
+      return -1;
+    }
+  }
+
+  // clear the inodes, writing each inode table sector once, and
+  // collect their data sectors for release
+  int freed[n*MAX_SECTORS_PER_FILE+MAX_SECTORS_PER_FILE], nfreed = 0;
+  for(int k=0; k<n; ) {
+    int sector = INODE_TABLE_SECTOR(victims[k]/INODES_PER_SECTOR);
+    char inode_buffer[INODE_BUFFER_SIZE];
+    char* buf = (sector == parent_sector) ? parent_buffer : inode_buffer;
+    if(buf == inode_buffer && inodes_read(sector, inode_buffer) < 0) {
+      osErrno = E_GENERAL;
+      return -1;
+    }
+    for(; k<n && INODE_TABLE_SECTOR(victims[k]/INODES_PER_SECTOR) == sector; k++) {
+      inode_t* child = (inode_t*)(buf+(victims[k]%INODES_PER_SECTOR)*sizeof(inode_t));
+      for(int i=0; !(child->flags & INODE_INLINE) && i<MAX_SECTORS_PER_FILE; i++)
+	if(child->data[i] > 0) freed[nfreed++] = child->data[i];
+      memset(child, 0, sizeof(inode_t));
+    }
+    if(buf == inode_buffer && inodes_write(sector, inode_buffer) < 0) {
+      osErrno = E_GENERAL;
+      return -1;
+    }
+  }
+
+  // remove the dirents by moving the last entry into each hole
+  int first_dirty = parent->size;
+  for(int k=0; k<n; k++) {
+    int e;
+    for(e=0; e<parent->size; e++)
+      if(BATCH_DIRENT(e)->inode == victims[k]) break;
+    assert(e < parent->size);
+    int last = parent->size-1;
+    memcpy(BATCH_DIRENT(e), BATCH_DIRENT(last), sizeof(dirent_t));
+    memset(BATCH_DIRENT(last), 0, sizeof(dirent_t));
+    if(e < first_dirty) first_dirty = e;
+    parent->size--;
+  }
+#undef BATCH_DIRENT
+
+  int old_groups = (parent->size+n+DIRENTS_PER_SECTOR-1)/DIRENTS_PER_SECTOR;
+  int new_groups = (parent->size+DIRENTS_PER_SECTOR-1)/DIRENTS_PER_SECTOR;
+  for(int g=first_dirty/DIRENTS_PER_SECTOR; g<new_groups; g++) {
+    if(sector_own(&parent->data[g]) < 0 || dirents_write(parent->data[g], dirents[g]) < 0) {
+      osErrno = E_GENERAL;
+      return -1;
+    }
+  }
+  // dirent sectors emptied at the tail are returned to the disk
+  for(int g=new_groups; g<old_groups; g++) {
+    freed[nfreed++] = parent->data[g];
+    parent->data[g] = 0;
+  }
+
+  if(inodes_write(parent_sector, parent_buffer) < 0 ||
+     bitmap_reset_many(INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, n, victims) < 0 ||
+     release_sectors(nfreed, freed) < 0) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  dprintf("... successfully unlinked %d files from '%s'\n", n, dir);
+  return n;
+}
+
+// return 1 if the directory 'dir_inode' is one of the directories
+// leading to the last file/directory of the absolute path 'path'
+static int path_crosses(char* path, int dir_inode)
+{
+  char prefix[MAX_PATH];
+  strncpy(prefix, path, MAX_PATH-1);
+  prefix[MAX_PATH-1] = '\0';
+  char* slash;
+  while((slash = strrchr(prefix, '/')) != NULL) {
+    *slash = '\0';
+    int inode;
+    if(follow_path(*prefix ? prefix : "/", &inode, NULL) >= 0 && inode == dir_inode)
+      return 1;
+  }
+  return 0;
+}
+
+static int file_rename(char* from, char* to)
+{
+  dprintf("File_Rename('%s', '%s'):\n", from, to);
+  if(is_read_only()) return -1;
+  int child_inode;
+  int from_parent = follow_path(from, &child_inode, NULL);
+  if(from_parent < 0 || child_inode < 0) {
+    dprintf("... file '%s' is not found\n", from);
+    osErrno = E_NO_SUCH_FILE;
+    return -1;
+  }
+  if(child_inode == 0) {
+    dprintf("... can't rename the root directory\n");
+    osErrno = E_ROOT_DIR;
+    return -1;
+  }
+
+  int to_inode;
+  char to_fname[MAX_NAME];
+  int to_parent = follow_path(to, &to_inode, to_fname);
+  if(to_parent < 0 || to_inode >= 0) {
+    dprintf("... can't use '%s' as the new name\n", to);
+    osErrno = E_CREATE;
+    return -1;
+  }
+  if(path_crosses(to, child_inode)) {
+    dprintf("... can't move '%s' into itself\n", from);
+    osErrno = E_CREATE;
+    return -1;
+  }
+
+  if(to_parent != from_parent) {
+    // link under the new parent first, then unlink from the old one
+    if(add_dirent(to_parent, to_fname, child_inode) < 0) {
+      osErrno = E_CREATE;
+      return -1;
+    }
+    if(remove_dirent(from_parent, child_inode) < 0) {
+      remove_dirent(to_parent, child_inode);
+      osErrno = E_GENERAL;
+      return -1;
+    }
+    dprintf("... moved inode %d from directory %d to %d\n", child_inode, from_parent, to_parent);
+    return 0;
+  }
+
+  // same parent: only the name in the dirent changes
+  alloc_near(from_parent);
+  int inode_sector = INODE_TABLE_SECTOR(from_parent/INODES_PER_SECTOR);
+  char inode_buffer[INODE_BUFFER_SIZE];
+  if(inodes_read(inode_sector, inode_buffer) < 0) { osErrno = E_GENERAL; return -1; }
+  inode_t* parent = (inode_t*)(inode_buffer+(from_parent%INODES_PER_SECTOR)*sizeof(inode_t));
+  for(int e=0; e<parent->size; e+=DIRENTS_PER_SECTOR) {
+    char buf[DIRENT_BUFFER_SIZE];
+    int group = e/DIRENTS_PER_SECTOR;
+    if(dirents_read(parent->data[group], buf) < 0) { osErrno = E_GENERAL; return -1; }
+    for(int i=0; i<DIRENTS_PER_SECTOR && e+i<parent->size; i++) {
+      dirent_t* dirent = (dirent_t*)buf+i;
+      if(dirent->inode != child_inode) continue;
+      strncpy(dirent->fname, to_fname, MAX_NAME);
+      if(sector_own(&parent->data[group]) < 0 || dirents_write(parent->data[group], buf) < 0 ||
+	 inodes_write(inode_sector, inode_buffer) < 0) {
+	osErrno = E_GENERAL;
+	return -1;
+      }
+      dprintf("... renamed dirent %d of directory %d to '%s'\n", e+i, from_parent, to_fname);
+      return 0;
+    }
+  }
+  osErrno = E_GENERAL;
+  return -1;
+}
+
+static int file_copy(char* from, char* to, int share)
+{
+  dprintf("File_Copy('%s', '%s', share=%d):\n", from, to, share);
+  if(is_read_only()) return -1;
+  int src_inode;
+  if(follow_path(from, &src_inode, NULL) < 0 || src_inode < 0) {
+    dprintf("... file '%s' is not found\n", from);
+    osErrno = E_NO_SUCH_FILE;
+    return -1;
+  }
+  if(delayed_flush(src_inode) < 0) { osErrno = E_NO_SPACE; return -1; }
+  char inode_buffer[INODE_BUFFER_SIZE];
+  int inode_sector = INODE_TABLE_SECTOR(src_inode/INODES_PER_SECTOR);
+  if(inodes_read(inode_sector, inode_buffer) < 0) { osErrno = E_GENERAL; return -1; }
+  inode_t src;
+  memcpy(&src, inode_buffer+(src_inode%INODES_PER_SECTOR)*sizeof(inode_t), sizeof(inode_t));
+  if(src.type != 0) {
+    dprintf("... error: '%s' is not a file\n", from);
+    osErrno = E_GENERAL;
+    return -1;
+  }
+
+  int dst_inode;
+  char fname[MAX_NAME];
+  int parent_inode = follow_path(to, &dst_inode, fname);
+  if(parent_inode < 0 || dst_inode >= 0) {
+    dprintf("... can't create file '%s'\n", to);
+    osErrno = E_CREATE;
+    return -1;
+  }
+
+  // build the block map of the copy: with 'share', a sector gains a
+  // reference instead of being copied (unless its count is saturated)
+  int data[MAX_SECTORS_PER_FILE], blocks[MAX_SECTORS_PER_FILE], nblocks = 0;
+  for(int i=0; i<MAX_SECTORS_PER_FILE; i++) {
+    data[i] = 0;
+    if(!src.data[i] || (src.flags & INODE_INLINE)) continue;
+    if(share && sector_adjust_refs(src.data[i], 1) == 0) data[i] = src.data[i];
+    else blocks[nblocks++] = i;
+  }
+
+  // the rest is copied sector by sector into sectors allocated at once,
+  // in the block group the copy's inode will be taken from
+  int sectors[MAX_SECTORS_PER_FILE];
+  alloc_near(parent_inode);
+  if(nblocks > 0 && bitmap_alloc_many(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS,
+				      TOTAL_SECTORS, nblocks, sectors) < 0) {
+    dprintf("... error: disk is full\n");
+    int shared[MAX_SECTORS_PER_FILE], nshared = 0;
+    for(int i=0; i<MAX_SECTORS_PER_FILE; i++)
+      if(data[i]) shared[nshared++] = data[i];
+    release_sectors(nshared, shared);
+    osErrno = E_NO_SPACE;
+    return -1;
+  }
+  for(int k=0; k<nblocks; k++) {
+    char buf[SECTOR_SIZE];
+    if(Disk_Read(src.data[blocks[k]], buf) < 0 || Disk_Write(sectors[k], buf) < 0) {
+      osErrno = E_GENERAL;
+      return -1;
+    }
+    data[blocks[k]] = sectors[k];
+  }
+
+  int all[MAX_SECTORS_PER_FILE], nall = 0;
+  for(int i=0; i<MAX_SECTORS_PER_FILE; i++)
+    if(data[i]) all[nall++] = data[i];
+  dst_inode = add_inode(0, parent_inode, fname);
+  if(dst_inode < 0) {
+    release_sectors(nall, all);
+    osErrno = E_CREATE;
+    return -1;
+  }
+  inode_sector = INODE_TABLE_SECTOR(dst_inode/INODES_PER_SECTOR);
+  if(inodes_read(inode_sector, inode_buffer) < 0) { osErrno = E_GENERAL; return -1; }
+  inode_t* dst = (inode_t*)(inode_buffer+(dst_inode%INODES_PER_SECTOR)*sizeof(inode_t));
+  dst->size = src.size;
+  dst->flags = src.flags;
+  if(src.flags & INODE_INLINE) memcpy(dst->data, src.data, sizeof(data));
+  else memcpy(dst->data, data, sizeof(data));
+  if(inodes_write(inode_sector, inode_buffer) < 0) { osErrno = E_GENERAL; return -1; }
+  dprintf("... copied inode %d to inode %d (%d sectors copied, %d shared)\n",
+	  src_inode, dst_inode, nblocks, nall-nblocks);
+  return 0;
+}
+
+static int file_set_compression(char* file, int enable)
+{
+  dprintf("File_SetCompression('%s', %d):\n", file, enable);
+  if(is_read_only()) return -1;
+  int child_inode;
+  if(follow_path(file, &child_inode, NULL) < 0 || child_inode < 0) {
+    dprintf("... file '%s' is not found\n", file);
+    osErrno = E_NO_SUCH_FILE;
+    return -1;
+  }
+  if(delayed_flush(child_inode) < 0) { osErrno = E_NO_SPACE; return -1; }
+  alloc_near(child_inode);
+  int inode_sector = INODE_TABLE_SECTOR(child_inode/INODES_PER_SECTOR);
+  char inode_buffer[INODE_BUFFER_SIZE];
+  if(inodes_read(inode_sector, inode_buffer) < 0) { osErrno = E_GENERAL; return -1; }
+  inode_t* inode = (inode_t*)(inode_buffer+(child_inode%INODES_PER_SECTOR)*sizeof(inode_t));
+  if(inode->type != 0) {
+    dprintf("... error: '%s' is not a file\n", file);
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  if(!(inode->flags & INODE_COMPRESSED) == !enable) return 0;
+  if(is_file_mapped(child_inode)) {
+    dprintf("... file '%s' is mapped\n", file);
+    osErrno = E_FILE_IN_USE;
+    return -1;
+  }
+
+  // convert the content to the other form
+  char content[MAX_FILE_SIZE];
+  if(load_content(inode, content) < 0) { osErrno = E_GENERAL; return -1; }
+  if(inode->flags & INODE_INLINE) {
+    memset(inode->data, 0, sizeof(inode->data));
+    inode->flags &= ~INODE_INLINE;
+  }
+  int ret;
+  if(enable) {
+    inode->flags |= INODE_COMPRESSED;
+    ret = compressed_store(inode, content, inode->size);
+  } else {
+    inode->flags &= ~INODE_COMPRESSED;
+    ret = store_blocks(inode, content, inode->size <= INLINE_MAX ? 0 : inode->size);
+    if(ret == 0 && inode->size <= INLINE_MAX) {
+      memcpy(inode->data, content, inode->size);
+      inode->flags |= INODE_INLINE;
+    }
+  }
+  if(ret < 0 || inodes_write(inode_sector, inode_buffer) < 0) {
+    osErrno = E_NO_SPACE;
+    return -1;
+  }
+  return 0;
+}
+
+static int file_stat(char* path, FS_Stat_t* st)
+{
+  dprintf("File_Stat('%s'):\n", path);
+  int child_inode;
+  if(follow_path(path, &child_inode, NULL) < 0 || child_inode < 0) {
+    dprintf("... '%s' is not found\n", path);
+    osErrno = E_NO_SUCH_FILE;
+    return -1;
+  }
+  int inode_sector = INODE_TABLE_SECTOR(child_inode/INODES_PER_SECTOR);
+  char inode_buffer[INODE_BUFFER_SIZE];
+  if(inode_table_read(inode_sector, inode_buffer) < 0) { osErrno = E_GENERAL; return -1; }
+  inode_t* inode = (inode_t*)(inode_buffer+(child_inode%INODES_PER_SECTOR)*sizeof(inode_t));
+  st->inode = child_inode;
+  st->type = inode->type;
+  st->size = inode->size;
+  return 0;
+}
+
+// open the file 'child_inode' (-1 if it wasn't found); 'file' is only
+// for messages
+static int open_child(int child_inode, char* file)
+{
+  int fd = new_file_fd();
+  if(fd < 0) {
+    dprintf("... max open files reached\n");
+    osErrno = E_TOO_MANY_OPEN_FILES;
+    return -1;
+  }
+
+  if(child_inode >= 0) { // child is the one
+    // load the disk sector containing the inode
+    int inode_sector = INODE_TABLE_SECTOR(child_inode/INODES_PER_SECTOR);
+    char inode_buffer[INODE_BUFFER_SIZE];
+    if(inode_table_read(inode_sector, inode_buffer) < 0) { osErrno = E_GENERAL; return -1; }
+    dprintf("... load inode table for inode from disk sector %d\n", inode_sector);
+
+    // get the inode
+    int inode_start_entry = INODE_TABLE_INDEX(inode_sector)*INODES_PER_SECTOR;
+    int offset = child_inode-inode_start_entry;
+    assert(0 <= offset && offset < INODES_PER_SECTOR);
+    inode_t* child = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
+    dprintf("... inode %d (size=%d, type=%d)\n",
+	    child_inode, child->size, child->type);
+
+    if(child->type != 0) {
+      dprintf("... error: '%s' is not a file\n", file);
+      osErrno = E_GENERAL;
+      return -1;
+    }
+
+    // initialize open file entry and return its index
+    open_files[fd].inode = child_inode;
+    open_files[fd].size = child->size;
+    open_files[fd].pos = 0;
+    open_files[fd].pending_off = -1;
+    open_files[fd].pending_new = 0;
+    return fd;
+  } else {
+    dprintf("... file '%s' is not found\n", file);
+    osErrno = E_NO_SUCH_FILE;
+    return -1;
+  }  
+}
+
+static int file_open(char* file)
+{
+  dprintf("File_Open('%s'):\n", file);
+  int child_inode = -1;
+  follow_path(file, &child_inode, NULL);
+  return open_child(child_inode, file);
+}
+
+// directory handles: the directory is resolved once, and the names
+// given with a handle are looked up in it directly, however deep it is
+static int dir_open_handle(char* path)
+{
+  dprintf("Dir_OpenHandle('%s'):\n", path);
+  int h;
+  for(h=0; h<MAX_DIR_HANDLES && dir_handles[h].used; h++);
+  if(h == MAX_DIR_HANDLES) {
+    dprintf("... max directory handles reached\n");
+    osErrno = E_TOO_MANY_OPEN_FILES;
+    return -1;
+  }
+  FS_Stat_t st;
+  if(file_stat(path, &st) < 0 || st.type != 1) {
+    dprintf("... directory '%s' is not found\n", path);
+    osErrno = E_NO_SUCH_DIR;
+    return -1;
+  }
+  dir_handles[h].used = 1;
+  dir_handles[h].inode = st.inode;
+  dprintf("... handle %d for directory inode %d\n", h, st.inode);
+  return h;
+}
+
+static int dir_close_handle(int dh)
+{
+  dprintf("Dir_CloseHandle(%d):\n", dh);
+  if(0 > dh || dh >= MAX_DIR_HANDLES || !dir_handles[dh].used) {
+    dprintf("... %d not a directory handle\n", dh);
+    osErrno = E_BAD_FD;
+    return -1;
+  }
+  dir_handles[dh].used = 0;
+  return 0;
+}
+
+// look up the entry 'name' (a single file name) of the directory of
+// handle 'dh'; return the inode of the directory, with the inode of
+// the entry (-1 if there's none) in '*child_inode', or -1 if the
+// handle or the name is bad (with osErrno set)
+static int lookup_at(int dh, char* name, int* child_inode)
+{
+  if(0 > dh || dh >= MAX_DIR_HANDLES || !dir_handles[dh].used) {
+    dprintf("... %d not a directory handle\n", dh);
+    osErrno = E_BAD_FD;
+    return -1;
+  }
+  if(!name || !*name || illegal_filename(name)) {
+    dprintf("... illegal file name: '%s'\n", name ? name : "(null)");
+    osErrno = E_NO_SUCH_FILE;
+    return -1;
+  }
+  int parent_inode = dir_handles[dh].inode;
+  int sector = INODE_TABLE_SECTOR(parent_inode/INODES_PER_SECTOR);
+  char buffer[INODE_BUFFER_SIZE];
+  if(inode_table_read(sector, buffer) < 0) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  COUNT(path_components);
+  *child_inode = find_child_inode(parent_inode, name, &sector, buffer);
+  if(*child_inode < -1) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  return parent_inode;
+}
+
+static int file_open_at(int dh, char* name)
+{
+  dprintf("File_OpenAt(%d, '%s'):\n", dh, name);
+  int child_inode;
+  if(lookup_at(dh, name, &child_inode) < 0) return -1;
+  return open_child(child_inode, name);
+}
+
+static int file_create_at(int dh, char* name)
+{
+  dprintf("File_CreateAt(%d, '%s'):\n", dh, name);
+  if(is_read_only()) return -1;
+  int child_inode;
+  int parent_inode = lookup_at(dh, name, &child_inode);
+  if(parent_inode < 0) {
+    osErrno = E_CREATE;
+    return -1;
+  }
+  return create_child(0, parent_inode, child_inode, name, name);
+}
+
+static int file_unlink_at(int dh, char* name)
+{
+  dprintf("File_UnlinkAt(%d, '%s'):\n", dh, name);
+  if(is_read_only()) return -1;
+  int child_inode;
+  int parent_inode = lookup_at(dh, name, &child_inode);
+  if(parent_inode < 0) return -1;
+  return unlink_child(parent_inode, child_inode, name);
+}
+
+static int file_read(int fd, void* buffer, int size)
+{
+  /* YOUR CODE */
+
+	int file_inode = open_files[fd].inode; // file_inode will have the inode number for the file to be read.
+                                              //Here, open_files is a structure containing the value of inode with variable name inode.
+	if(!file_inode) // If the file is not open (i.e open_files[fd].inode returns 0), return -1, and set osErrno to E_BAD_FD.
+  {  
+		osErrno = E_BAD_FD;  
+		return -1;
+	}
+
+	// load the disk sector containing the child inode
+     
+	int inode_sector = INODE_TABLE_SECTOR(file_inode/INODES_PER_SECTOR); //inode_sector will have the sector number that contains file_inode which is our required file inode.
+	char inode_buffer[INODE_BUFFER_SIZE]; 
+
+        // from the line below, after Dish_read "inode_buffer" will contain the inode_sector's content
+	if(inode_table_read(inode_sector, inode_buffer) < 0) return -1; 
+
+	dprintf("... load inode table for child inode from disk sector %d\n", inode_sector);
+	
+	
+	// get the child inode  
+	int inode_start_entry = INODE_TABLE_INDEX(inode_sector)*INODES_PER_SECTOR; // inode_start_entry will have inode number that will be in the start of the inode_sector
+	int offset = file_inode-inode_start_entry; // now we have the offset to go from the inode_start_entry to reach to our desired inode.
+	assert(0 <= offset && offset < INODES_PER_SECTOR); // offset can be 0 to INODE_PER_SECTOR. otherwise assert function will give an error message and abort program execution
+	inode_t* file = (inode_t*)(inode_buffer+offset*sizeof(inode_t)); // Here, inode_buffer will provide starting address of inode_buffer[]. but we need only our 
+                                                                         // desired file_inode content.so we are adding offset adress with starting address to get there.
+                                                                         // Now, file will point to the file_inode.
+
+	// a small file is read straight out of its inode
+	if(file->flags & INODE_INLINE) {
+		int n = file->size - open_files[fd].pos;
+		if(n > size) n = size;
+		if(n < 0) n = 0;
+		memcpy(buffer, (char*)file->data + open_files[fd].pos, n);
+		open_files[fd].pos += n;
+		return n;
+	}
+
+	// a compressed file is decompressed as a whole
+	if(file->flags & INODE_COMPRESSED) {
+		char content[MAX_FILE_SIZE];
+		if(load_content(file, content) < 0) {
+			osErrno = E_GENERAL;
+			return -1;
+		}
+		int n = file->size - open_files[fd].pos;
+		if(n > size) n = size;
+		if(n < 0) n = 0;
+		memcpy(buffer, content + open_files[fd].pos, n);
+		open_files[fd].pos += n;
+		return n;
+	}
+
+	// Necessary variables needed for file_read
+        int i,j,count=0;
+        char* charBuffer = (char*) buffer;
+	char* delayed;
+	int s_pos = open_files[fd].pos;
+
+
+	// define start variables to read starting from file pointer
 	int start_sector = open_files[fd].pos / SECTOR_SIZE; // start_sector will have the sector number containing pos. pos, we know from the open_file structure that it read/write position
 	int startbyte = open_files[fd].pos % SECTOR_SIZE; // initialization of startbyte where it will have the specific byte number of that sector indicated by pos
  
 
 
-	// while loop will read the content of the data sectors allocated to the file we want to read sequentially
-         i=start_sector;
-	
-         while(i < MAX_SECTORS_PER_FILE)
-         {
-		if (file->data[i]) // "file->data[i]" from the specific inode will provide the sector numbers containg the data for the file, one by one.
-                      {
-			Disk_Read(file->data[i], temp_buffer); // Disk_Read will read the sector data which will be read into a temporary buffer named temp_buffer. 
-			dprintf("\n From sector %d we have Buffer contents: %s", file->data[i], temp_buffer);
-                        j=startbyte;  //for first sector it may start from any other postition rather than 0.
-			while(j < SECTOR_SIZE)
-                        {	
-				if ((count+s_pos < file->size) && (count < size)){	// while still inside of the file & reading into size of buffer
-					charBuffer[count++] = temp_buffer[j]; // content of temporary buffer will be copied to charbuffer. at first iteration it will be started from pos
-                                                                // later on it will start copying from first position of temp_buffer.
-				} 
-                        j++;
-			}
-	
-			startbyte = 0; // after the first sector, the later sectors will be read fully , so startb (start byte) will be 0 here for reading buf
-                                    // so reset
-		}
-        i++;
+	// while loop will read the content of the data sectors allocated to the file we want to read sequentially,
+	// until the buffer is full or the file ends
+         i=start_sector;
+	
+         while(i < MAX_SECTORS_PER_FILE && count < size && count+s_pos < file->size)
+         {
+		j = SECTOR_SIZE-startbyte; //for first sector it may start from any other postition rather than 0.
+		if (j > size-count) j = size-count; // no more than fits in the buffer
+		if (j > file->size-s_pos-count) j = file->size-s_pos-count; // and no more than is left in the file
+		if (file->data[i]) // "file->data[i]" from the specific inode will provide the sector numbers containg the data for the file, one by one.
+                      {
+			const char* sector_data = Disk_Map(file->data[i]); // Disk_Map lends us the sector itself, so it's copied only once, straight into charBuffer
+			if (!sector_data) {
+				osErrno = E_GENERAL;
+				return -1;
+			}
+			dprintf("... read from sector %d\n", file->data[i]);
+			memcpy(charBuffer+count, sector_data+startbyte, j);
+			Disk_Unmap(file->data[i], 0);
+		}
+		else if ((delayed = delayed_block(fd, i, 0))) memcpy(charBuffer+count, delayed+startbyte, j); // a block written but not flushed yet
+		else memset(charBuffer+count, 0, j); // a block without a sector is a hole, which reads as zeros
+		count += j;
+		startbyte = 0; // after the first sector, the later sectors will be read fully , so startb (start byte) will be 0 here for reading buf
+                            // so reset
+        i++;
+	}
+	
+	open_files[fd].pos += count; // value of the pos variable will be updated with new one
+
+	return count; // by returning count, the function is providing the number of bytes actually read which can be less than or equal to size.
+}
+ 
+
+// map a file into memory for reading: a file whose blocks follow one
+// another on disk is viewed in place (its sectors stay lent out by the
+// disk until it's unmapped, so later writes to it show through), and
+// any other file is read into a copy
+static const void* file_mmap(int fd, int* len)
+{
+  dprintf("File_Mmap(%d):\n", fd);
+  if(0 > fd || fd >= MAX_OPEN_FILES || open_files[fd].inode <= 0 || !len) {
+    dprintf("... fd=%d not an open file\n", fd);
+    osErrno = E_BAD_FD;
+    return NULL;
+  }
+  int m;
+  for(m=0; m<MAX_MMAPS && mmaps[m].addr; m++);
+  if(m == MAX_MMAPS) {
+    dprintf("... too many files mapped\n");
+    osErrno = E_TOO_MANY_OPEN_FILES;
+    return NULL;
+  }
+
+  int ino = open_files[fd].inode;
+  char inode_buffer[INODE_BUFFER_SIZE];
+  if(delayed_flush(ino) < 0) {
+    osErrno = E_NO_SPACE;
+    return NULL;
+  }
+  if(inode_table_read(INODE_TABLE_SECTOR(ino/INODES_PER_SECTOR), inode_buffer) < 0) {
+    osErrno = E_GENERAL;
+    return NULL;
+  }
+  inode_t* file = (inode_t*)(inode_buffer+(ino%INODES_PER_SECTOR)*sizeof(inode_t));
+  int nsectors = (file->size+SECTOR_SIZE-1)/SECTOR_SIZE;
+
+  // the blocks have to follow one another, and so must the sectors the
+  // disk lends out
+  int contiguous = file->size > 0 && !(file->flags & (INODE_INLINE|INODE_COMPRESSED));
+  for(int i=0; contiguous && i<nsectors; i++)
+    contiguous = file->data[i] && file->data[i] == file->data[0]+i;
+  if(contiguous) {
+    const char* addr = NULL;
+    int i;
+    for(i=0; i<nsectors; i++) {
+      const char* p = Disk_Map(file->data[i]);
+      if(!p) break;
+      if(i == 0) addr = p;
+      if(p != addr+i*SECTOR_SIZE) {
+	Disk_Unmap(file->data[i], 0);
+	break;
+      }
+    }
+    if(i == nsectors) {
+      mmaps[m].addr = addr;
+      mmaps[m].inode = ino;
+      mmaps[m].sector = file->data[0];
+      mmaps[m].nsectors = nsectors;
+      mmaps[m].held = 0;
+      *len = file->size;
+      dprintf("... inode %d viewed in place (sectors %d-%d)\n", ino, file->data[0],
+	      file->data[0]+nsectors-1);
+      return addr;
+    }
+    while(i-- > 0) Disk_Unmap(file->data[i], 0);
+  }
+
+  // a copy it is, read without moving the file's position
+  char* copy = malloc(file->size > 0 ? file->size : 1);
+  if(!copy) {
+    osErrno = E_GENERAL;
+    return NULL;
+  }
+  int pos = open_files[fd].pos;
+  open_files[fd].pos = 0;
+  int n = file_read(fd, copy, file->size);
+  open_files[fd].pos = pos;
+  if(n != file->size) {
+    free(copy);
+    osErrno = E_GENERAL;
+    return NULL;
+  }
+  mmaps[m].addr = copy;
+  mmaps[m].inode = ino;
+  mmaps[m].sector = mmaps[m].nsectors = 0;
+  *len = n;
+  dprintf("... inode %d copied (%d bytes)\n", ino, n);
+  return copy;
+}
+
+static int file_munmap(const void* addr)
+{
+  dprintf("File_Munmap(%p):\n", addr);
+  int m;
+  for(m=0; m<MAX_MMAPS && (!addr || mmaps[m].addr != addr); m++);
+  if(m == MAX_MMAPS) {
+    dprintf("... not a mapped file\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  if(!mmaps[m].nsectors) {
+    free((void*)mmaps[m].addr);
+    mmaps[m].addr = NULL;
+    return 0;
+  }
+
+  // the sectors held for the view go back to the disk, unless another
+  // view of them takes them over
+  int freed[MAX_SECTORS_PER_FILE], nfreed = 0;
+  for(int i=0; i<mmaps[m].nsectors; i++) Disk_Unmap(mmaps[m].sector+i, 0);
+  mmaps[m].addr = NULL;
+  for(int i=0; i<mmaps[m].nsectors; i++)
+    if((mmaps[m].held & (1u << i)) && !mmap_hold(mmaps[m].sector+i))
+      freed[nfreed++] = mmaps[m].sector+i;
+  mmaps[m].held = 0;
+  if(nfreed > 0) dprintf("... %d sectors held for the view released\n", nfreed);
+  if(bitmap_reset_many(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, nfreed, freed) < 0) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  return 0;
+}
+
+static int file_write(int fd, void* buffer, int size)
+{
+  /* YOUR CODE */
+  int file_inode = open_files[fd].inode; // file_inode will have the inode number for the file where we want to write the content of buffer.
+                                              //Here, open_files is a structure containing the value of inode with variable name inode.
+	if(!file_inode) {                    // If the file is not open (i.e open_files[fd].inode returns 0), it will show the error message and return -1, and set osErrno to E_BAD_FD.
+		osErrno = E_BAD_FD;
+		printf("File was not opened\n");
+		return -1;
+	}
+	if(is_read_only()) return -1;
+	alloc_near(file_inode); // data blocks go to the file's block group
+
+	// load the disk sector containing the child inode
+	int inode_sector = INODE_TABLE_SECTOR(file_inode/INODES_PER_SECTOR); //inode_sector will have the sector number that contains file_inode which is our required file inode.
+	char inode_buffer[INODE_BUFFER_SIZE];
+        
+        // from the line below, after inodes_read "inode_buffer" will contain the inode_sector's content 
+	if(inodes_read(inode_sector, inode_buffer) < 0) return -1; 
+	dprintf("... load inode table for child inode from disk sector %d\n", inode_sector);
+	
+	
+	// get the child inode
+	int inode_start_entry = INODE_TABLE_INDEX(inode_sector)*INODES_PER_SECTOR; // inode_start_entry will have inode number that will be in the start of the inode_sector
+	int offset = file_inode-inode_start_entry; // now we have the offset to go from the inode_start_entry to reach to our desired inode.
+	assert(0 <= offset && offset < INODES_PER_SECTOR); // offset can be 0 to INODE_PER_SECTOR. otherwise assert function will give an error message and abort program execution
+	inode_t* file = (inode_t*)(inode_buffer+offset*sizeof(inode_t)); // Here, inode_buffer will provide starting address of inode_buffer[]. but we need only our 
+                                                                         // desired file_inode content.so we are adding offset adress with starting address to get there.
+                                                                         // Now, file will point to the file_inode.
+        
+
+
+	if((open_files[fd].pos + size) > MAX_FILE_SIZE){  // "open_files[fd].pos" will provide the position in the file where we want to write 
+                                                  // It will be added with "size" which is the size of the data we want to write to file from buffer.
+                                                 // Thus if the file exceeds the maximum file size, it would return -1 and set osErrno to E_FILE_TOO_BIG showing an error message.
+		osErrno = E_FILE_TOO_BIG;
+		printf("File was too big\n");
+		return -1;
+	}
+        
+	// an empty file left by an earlier version can still be kept inline
+	if(file->type == 0 && file->size == 0 && !file->data[0] && !(file->flags & INODE_COMPRESSED))
+		file->flags |= INODE_INLINE;
+
+	// a compressed file is rewritten as a whole
+	int end = open_files[fd].pos + size;
+	if(file->flags & INODE_COMPRESSED) {
+		char content[MAX_FILE_SIZE];
+		if(load_content(file, content) < 0) {
+			osErrno = E_GENERAL;
+			return -1;
+		}
+		memcpy(content + open_files[fd].pos, buffer, size);
+		if(compressed_store(file, content, end > file->size ? end : file->size) < 0) {
+			osErrno = E_NO_SPACE;
+			return -1;
+		}
+		open_files[fd].pos = end;
+		if(end > file->size) file->size = end;
+		open_files[fd].size = file->size;
+		if(inodes_write(inode_sector, inode_buffer) < 0) return -1;
+		return size;
+	}
+
+	// a small file is written into its inode as long as it fits there;
+	// otherwise, its content moves to a data block first
+	// the delayed blocks the write adds (all those it touches, and block
+	// 0 of an inline file, if it's moved out) must have sectors left for
+	// them, or else nothing is written
+	if(!dedup_enabled && !((file->flags & INODE_INLINE) && end <= INLINE_MAX)) {
+		int inl = file->flags & INODE_INLINE, fresh = 0;
+		for(int b=0; b<MAX_SECTORS_PER_FILE; b++) {
+			int touched = (b*SECTOR_SIZE < end && (b+1)*SECTOR_SIZE > open_files[fd].pos) ||
+				(inl && b == 0 && file->size > 0);
+			if(touched && (inl || (!file->data[b] && !delayed_block(fd, b, 0)))) fresh++;
+		}
+		if(fresh && !sectors_room(fresh)) {
+			osErrno = E_NO_SPACE;
+			return -1;
+		}
+	}
+
+	if(file->flags & INODE_INLINE) {
+		if(end <= INLINE_MAX) {
+			memcpy((char*)file->data + open_files[fd].pos, buffer, size);
+			open_files[fd].pos = end;
+			if(end > file->size) file->size = open_files[fd].size = end;
+			if(inodes_write(inode_sector, inode_buffer) < 0) return -1;
+			return size;
+		}
+		if(inline_to_block(fd, file) < 0) {
+			osErrno = E_NO_SPACE;
+			return -1;
+		}
+	}
+
+        // Necessary variables needed for file_write
+	int i, j,count=0;
+	char* charBuffer = (char*) buffer;
+	int t_size = size;
+        char temp_buffer[SECTOR_SIZE];
+
+        // We may have to write data to a sector from starting byte or pos can be in any other byte
+
+	int start_sector = open_files[fd].pos / SECTOR_SIZE; // start_sector will have the sector number containing pos. pos, we know from the open_file structure that it is read/write position
+	int startbyte = open_files[fd].pos % SECTOR_SIZE; // initialization of startb where it will have the specific byte number of that sector indicated by pos 
+
+	// while loop will write the content of buffer to the data sectors allocated to the file sequentially. 
+        // first have to check if we will start writing to an already existing sector or have to allocate e new one before writing. 
+        i=start_sector;
+        while((i < MAX_SECTORS_PER_FILE) && (count<size))
+        {       
+		// a block with no sector yet is delayed (outside dedup mode): it's
+		// written in memory, and gets its sector when the file is flushed
+		if(!dedup_enabled && !file->data[i]) {
+			char* block = delayed_block(fd, i, 1);
+			if(!block) {
+				osErrno = E_NO_SPACE;
+				return -1;
+			}
+			j = SECTOR_SIZE-startbyte;
+			if(j > size-count) j = size-count;
+			memcpy(block+startbyte, charBuffer+count, j);
+			dprintf("... write to delayed block %d\n", i);
+			count += j;
+			t_size -= j;
+			startbyte = 0;
+			i++;
+			continue;
+		}
+
+		// in dedup mode, a full block may share a sector holding the same data
+		if(dedup_enabled && startbyte == 0 && size-count >= SECTOR_SIZE) {
+			if(dedup_write_block(&file->data[i], charBuffer+count) < 0) {
+				osErrno = E_NO_SPACE;
+				return -1;
+			}
+			count += SECTOR_SIZE;
+			t_size -= SECTOR_SIZE;
+			i++;
+			continue;
+		}
+		
+               //if we are writing in an already allocated sectors
+		if (file->data[i]) // "file->data[i]" from the specific inode will provide the sector number where to write
+                {  
+			// a sector shared with another file is copied first
+			if(sector_own(&file->data[i]) < 0) {
+				osErrno = E_NO_SPACE;
+				return -1;
+			}
+			dedup_forget(file->data[i]); // the block is about to change in place
+			Disk_Read(file->data[i], temp_buffer); // Disk_Read will read the previously existing sector data which will be saved into buf.
+                        j=startbyte;
+			while(j < SECTOR_SIZE)
+                        {
+				// write data to buffer
+				if(t_size-- > 0) 
+                                    temp_buffer[j] = charBuffer[count++]; // buffer[] has the content to write in the sector. It will be copied to temp_buffer[] from the startbyte index 
+                                                           // that is from the byte we want to write the buffer[] value.
+                        j++;
+
+			}
+			startbyte = 0; // after the first sector, in the later sectors buffer[] will written from the starting byte , so startbyte will be 0 here for writing
+                                      // so reset
+
+			dprintf("... write to sector %d\n", file->data[i]);
+
+			Disk_Write(file->data[i], temp_buffer); // Now, Disk_Write will write the temp_buff content into the sector specified by "file->data[i]" 
+		}
+		else // if "file->data[i]" won't provide any sector index that means we have to write into a new file sector which is not yet allocated to that file
+                    //thus have to allocate new sector 
+                {   
+			
+			int newsector = bitmap_first_unused(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, TOTAL_SECTORS);
+			if(newsector == -1) //if there is no new sector available, the write cannot be completed due to a lack of space on disk. It will set osErrno to E_NO_SPACE.
+                        {
+				osErrno = E_NO_SPACE; 
+				return -1;
+			}
+			file->data[i] = newsector; // "file->data[i]" value will be updated with new sector value newsector 
+
+			char temp_buffer2[SECTOR_SIZE];
+
+			memset(temp_buffer2, 0, SECTOR_SIZE); // temp_buffer will be intialized with 0 upto SECTOR_SIZE (512B here)
+                        
+                        j=startbyte; // past the end of the file, the write may start in the middle of a hole
+
+			while(j < SECTOR_SIZE)
+                        {
+				// write to temp_buffer2
+				if(t_size-- > 0)
+                                   temp_buffer2[j] = charBuffer[count++]; // buffer[] has the content to write in the sector. It will be copied to temp_buffer2[] from the buffer[]
+                         j++;
+			}
+			startbyte = 0;
+
+			//save changes
+			dprintf("... write to new sector %d\n", file->data[i]);
+			Disk_Write(file->data[i], temp_buffer2);// Now, Disk_Write will write the temp_buffer2 content into the sector specified by "file->data[i]" 
+		}
+           i++;
+	}
+
+	//save changes 
+	open_files[fd].pos += size; // new position value for write will be set to pos
+	if(end > file->size) file->size = end; // the file grows only if we wrote past its previous end
+	open_files[fd].size = file->size; // open_file structure content will be changed as well with the new size of the file
+
+	inodes_write(inode_sector, inode_buffer); // inode_sector that means the sector of the file inode will be updated with new inode_buffer.
+
+	return size;
+}
+static int file_seek(int fd, int offset)
+{
+  /* YOUR CODE */
+	int file_inode = open_files[fd].inode; // file_inode will have the inode number for the file where we want to update the current location of the file pointer.
+                                               //Here, open_files is a structure containing the value of inode with variable name inode.
+	if(!file_inode) {          // If the file is not open (i.e open_files[fd].inode returns 0), it will show the error message and return -1, and set osErrno to E_BAD_FD.
+		osErrno = E_BAD_FD; 
+		return -1;
+	}
+
+	// seeking past the end of the file is fine: a write there leaves a
+	// hole, which reads as zeros
+	if (MAX_FILE_SIZE < offset || offset < 0){  // If offset is larger than the maximum file size or negative, it return -1 and set osErrno to E_SEEK_OUT_OF_BOUNDS;
+		osErrno = E_SEEK_OUT_OF_BOUNDS;
+		return -1;
+	}
+
+	
+	open_files[fd].pos = offset; // pos will be updated with new offset value
+
+	return open_files[fd].pos;
+}
+
+// appends: File_Append() writes at the end of the file, which it keeps
+// in the open file entry along with the bytes appended to the last
+// block; they're held back (and written with a single File_Write())
+// until the block fills up or any other public call comes, which also
+// makes it forget the end of the file, as does an append through
+// another open file entry of the same file; so a file that's only
+// appended to is written a block at a time
+
+// write out the bytes held back for the file open as 'fd'; return 0
+// if successful, -1 otherwise (they're kept then)
+static int append_flush(int fd)
+{
+  open_file_t* f = &open_files[fd];
+  if(f->pending_len == 0) return 0;
+  // the sector kept for a new block is the one it takes now
+  int pos = f->pos, fresh = f->pending_new;
+  f->pos = f->pending_off;
+  f->pending_new = 0;
+  int n = file_write(fd, f->pending, f->pending_len);
+  f->pos = pos;
+  if(n < 0) {
+    f->pending_new = fresh;
+    return -1;
+  }
+  dprintf("... wrote %d appended bytes at %d\n", n, f->pending_off);
+  f->pending_off += n;
+  f->pending_len = 0;
+  return 0;
+}
+
+// stop keeping the end of the file open as 'fd'
+static void append_forget(int fd)
+{
+  if(open_files[fd].pending_off < 0) return;
+  open_files[fd].pending_off = -1;
+  appending--;
+}
+
+// write out the bytes held back for all open files and forget where
+// they end, since the next public call may change that; return 0 if
+// successful, -1 otherwise (the files whose bytes couldn't be written
+// out keep them, and their end)
+static int append_settle()
+{
+  int ret = 0;
+  for(int fd=0; fd<MAX_OPEN_FILES; fd++) {
+    if(open_files[fd].inode <= 0 || open_files[fd].pending_off < 0) continue;
+    if(append_flush(fd) == 0) append_forget(fd);
+    else ret = -1;
+  }
+  return ret;
+}
+
+static int file_append(int fd, void* buffer, int size)
+{
+  if(0 > fd || fd >= MAX_OPEN_FILES || open_files[fd].inode <= 0) {
+    osErrno = E_BAD_FD;
+    return -1;
+  }
+  if(is_read_only()) return -1;
+  if(size < 0) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  open_file_t* f = &open_files[fd];
+  if(!f->pending && !(f->pending = malloc(SECTOR_SIZE))) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+
+  // the fast path: the bytes stay in the block of those held back
+  int end = f->pending_off+f->pending_len;
+  if(f->pending_off >= 0 && end+size <= (f->pending_off/SECTOR_SIZE+1)*SECTOR_SIZE &&
+     end+size <= MAX_FILE_SIZE) {
+    memcpy(f->pending+f->pending_len, buffer, size);
+    f->pending_len += size;
+    if((end+size)%SECTOR_SIZE == 0 && append_flush(fd) < 0) {
+      f->pending_len -= size;
+      return -1;
+    }
+    f->pos = f->size = end+size;
+    return size;
+  }
+
+  // otherwise, anything held back is written out first, by the other
+  // entries of the file as well (which forget its end), and the end of
+  // the file comes from its inode
+  if(append_flush(fd) < 0) return -1;
+  for(int other=0; other<MAX_OPEN_FILES; other++) {
+    if(other == fd || open_files[other].inode != f->inode || open_files[other].pending_off < 0)
+      continue;
+    if(append_flush(other) < 0) return -1;
+    append_forget(other);
+  }
+  dprintf("File_Append(%d, %d):\n", fd, size);
+  char inode_buffer[INODE_BUFFER_SIZE];
+  int ino = f->inode;
+  alloc_near(ino);
+  if(inodes_read(INODE_TABLE_SECTOR(ino/INODES_PER_SECTOR), inode_buffer) < 0) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  inode_t* file = (inode_t*)(inode_buffer+(ino%INODES_PER_SECTOR)*sizeof(inode_t));
+  end = file->size;
+  if(end+size > MAX_FILE_SIZE) {
+    osErrno = E_FILE_TOO_BIG;
+    return -1;
+  }
+
+  // the blocks the bytes go to that have no sector yet (nor a delayed
+  // block), the one held back included, must have sectors left for
+  // them, or else nothing is appended
+  int inl = file->flags & INODE_INLINE, fresh = 0, last = -1;
+  if(!(file->flags & INODE_COMPRESSED) && (!inl || end+size > INLINE_MAX)) {
+    for(int b=end/SECTOR_SIZE; b*SECTOR_SIZE < end+size; b++) {
+      if(inl || (!file->data[b] && !delayed_block(fd, b, 0))) {
+	fresh++;
+	last = b;
+      }
+    }
+  }
+  if(fresh && !sectors_room(fresh)) {
+    osErrno = E_NO_SPACE;
+    return -1;
+  }
+
+  // the bytes up to the last block are written now, and the rest are
+  // held back
+  int held = (end+size)%SECTOR_SIZE;
+  if(held > size) held = size;
+  if(size > held) {
+    f->pos = end;
+    if(file_write(fd, buffer, size-held) < 0) return -1;
+  }
+  if(f->pending_off < 0) appending++;
+  f->pending_off = end+size-held;
+  f->pending_len = held;
+  f->pending_new = held > 0 && last == (end+size-1)/SECTOR_SIZE;
+  memcpy(f->pending, (char*)buffer+size-held, held);
+  f->pos = f->size = end+size;
+  return size;
+}
+
+// set the size of every open file entry of inode 'ino'
+static void set_open_size(int ino, int size)
+{
+  for(int fd=0; fd<MAX_OPEN_FILES; fd++)
+    if(open_files[fd].inode == ino) open_files[fd].size = size;
+}
+
+// cut an open file down to 'len' bytes, giving back the sectors of the
+// blocks past the end, or extend it to 'len' bytes with a hole; the
+// position of the file stays where it is
+static int file_truncate(int fd, int len)
+{
+  dprintf("File_Truncate(%d, %d):\n", fd, len);
+  if(0 > fd || fd >= MAX_OPEN_FILES || open_files[fd].inode <= 0) {
+    dprintf("... fd=%d not an open file\n", fd);
+    osErrno = E_BAD_FD;
+    return -1;
+  }
+  if(is_read_only()) return -1;
+  if(len < 0 || len > MAX_FILE_SIZE) {
+    dprintf("... length %d out of range\n", len);
+    osErrno = E_FILE_TOO_BIG;
+    return -1;
+  }
+  int ino = open_files[fd].inode;
+  alloc_near(ino);
+  int inode_sector = INODE_TABLE_SECTOR(ino/INODES_PER_SECTOR);
+  char inode_buffer[INODE_BUFFER_SIZE];
+  if(inodes_read(inode_sector, inode_buffer) < 0) { osErrno = E_GENERAL; return -1; }
+  inode_t* file = (inode_t*)(inode_buffer+(ino%INODES_PER_SECTOR)*sizeof(inode_t));
+  if(len == file->size) return 0;
+  if(len < file->size && is_file_mapped(ino)) {
+    dprintf("... inode %d is mapped\n", ino);
+    osErrno = E_FILE_IN_USE;
+    return -1;
+  }
+
+  if(file->flags & INODE_COMPRESSED) {
+    // the content is compressed again, without the bytes cut off
+    char content[MAX_FILE_SIZE];
+    if(load_content(file, content) < 0) { osErrno = E_GENERAL; return -1; }
+    memset(content+len, 0, MAX_FILE_SIZE-len);
+    if(compressed_store(file, content, len) < 0) { osErrno = E_NO_SPACE; return -1; }
+  } else if(file->flags & INODE_INLINE) {
+    // the bytes cut off are cleared, as they read as zeros if the file
+    // grows again
+    if(len < file->size) memset((char*)file->data+len, 0, file->size-len);
+    else if(len > INLINE_MAX && inline_to_block(fd, file) < 0) { osErrno = E_NO_SPACE; return -1; }
+  } else if(len < file->size) {
+    int keep = (len+SECTOR_SIZE-1)/SECTOR_SIZE;
+    int surplus[MAX_SECTORS_PER_FILE], nsurplus = 0;
+    char* delayed;
+    delayed_drop(ino, keep);
+    for(int i=keep; i<MAX_SECTORS_PER_FILE; i++) {
+      if(file->data[i]) surplus[nsurplus++] = file->data[i];
+      file->data[i] = 0;
+    }
+    // the rest of the last block is cleared for the same reason
+    if(len%SECTOR_SIZE && file->data[keep-1]) {
+      char buf[SECTOR_SIZE];
+      if(sector_own(&file->data[keep-1]) < 0) { osErrno = E_NO_SPACE; return -1; }
+      dedup_forget(file->data[keep-1]);
+      if(Disk_Read(file->data[keep-1], buf) < 0) { osErrno = E_GENERAL; return -1; }
+      memset(buf+len%SECTOR_SIZE, 0, SECTOR_SIZE-len%SECTOR_SIZE);
+      if(Disk_Write(file->data[keep-1], buf) < 0) { osErrno = E_GENERAL; return -1; }
+    } else if(len%SECTOR_SIZE && (delayed = delayed_block(fd, keep-1, 0)))
+      memset(delayed+len%SECTOR_SIZE, 0, SECTOR_SIZE-len%SECTOR_SIZE);
+    if(release_sectors(nsurplus, surplus) < 0) { osErrno = E_GENERAL; return -1; }
+    dprintf("... released %d sectors of inode %d\n", nsurplus, ino);
+  }
+
+  file->size = len;
+  if(inodes_write(inode_sector, inode_buffer) < 0) { osErrno = E_GENERAL; return -1; }
+  set_open_size(ino, len);
+  return 0;
+}
+
+// make sure the first 'len' bytes of an open file have sectors: the
+// holes among them are given zeroed sectors, allocated in one pass
+// (in a single run if there's one), and the file grows to 'len' bytes
+// if it's shorter; the position of the file stays where it is
+static int file_allocate(int fd, int len)
+{
+  dprintf("File_Allocate(%d, %d):\n", fd, len);
+  if(0 > fd || fd >= MAX_OPEN_FILES || open_files[fd].inode <= 0) {
+    dprintf("... fd=%d not an open file\n", fd);
+    osErrno = E_BAD_FD;
+    return -1;
+  }
+  if(is_read_only()) return -1;
+  if(len < 0 || len > MAX_FILE_SIZE) {
+    dprintf("... length %d out of range\n", len);
+    osErrno = E_FILE_TOO_BIG;
+    return -1;
+  }
+  int ino = open_files[fd].inode;
+  alloc_near(ino);
+  int inode_sector = INODE_TABLE_SECTOR(ino/INODES_PER_SECTOR);
+  char inode_buffer[INODE_BUFFER_SIZE];
+  // the delayed blocks get their sectors first, so the file can end up
+  // in a single run
+  if(delayed_flush(ino) < 0) { osErrno = E_NO_SPACE; return -1; }
+  if(inodes_read(inode_sector, inode_buffer) < 0) { osErrno = E_GENERAL; return -1; }
+  inode_t* file = (inode_t*)(inode_buffer+(ino%INODES_PER_SECTOR)*sizeof(inode_t));
+  int size = len > file->size ? len : file->size;
+
+  if(file->flags & INODE_COMPRESSED) {
+    // what a compressed file takes depends on its content, so there's
+    // nothing to reserve; it only grows
+    if(size > file->size) {
+      char content[MAX_FILE_SIZE];
+      if(load_content(file, content) < 0) { osErrno = E_GENERAL; return -1; }
+      if(compressed_store(file, content, size) < 0) { osErrno = E_NO_SPACE; return -1; }
+    }
+  } else {
+    // a file that no longer fits in its inode moves out of it first
+    if((file->flags & INODE_INLINE) && size > INLINE_MAX && inline_to_block(-1, file) < 0) {
+      osErrno = E_NO_SPACE;
+      return -1;
+    }
+    unsigned int fresh = 0;
+    if(!(file->flags & INODE_INLINE) &&
+       alloc_blocks(file, FIRST_BLOCKS((len+SECTOR_SIZE-1)/SECTOR_SIZE), &fresh) < 0) {
+      dprintf("... error: disk is full\n");
+      osErrno = E_NO_SPACE;
+      return -1;
+    }
+    char zeros[SECTOR_SIZE];
+    int nfresh = 0;
+    memset(zeros, 0, SECTOR_SIZE);
+    for(int i=0; i<MAX_SECTORS_PER_FILE; i++) {
+      if(!(fresh & (1u << i))) continue;
+      if(Disk_Write(file->data[i], zeros) < 0) { osErrno = E_GENERAL; return -1; }
+      nfresh++;
+    }
+    dprintf("... allocated %d sectors to inode %d\n", nfresh, ino);
+  }
+
+  file->size = size;
+  if(inodes_write(inode_sector, inode_buffer) < 0) { osErrno = E_GENERAL; return -1; }
+  set_open_size(ino, size);
+  return 0;
+}
+
+static int file_close(int fd)
+{
+  dprintf("File_Close(%d):\n", fd);
+  if(0 > fd || fd > MAX_OPEN_FILES) {
+    dprintf("... fd=%d out of bound\n", fd);
+    osErrno = E_BAD_FD;
+    return -1;
+  }
+  if(open_files[fd].inode <= 0) {
+    dprintf("... fd=%d not an open file\n", fd);
+    osErrno = E_BAD_FD;
+    return -1;
+  }
+
+  // the bytes held back by File_Append() and the delayed blocks of
+  // the file are flushed; if they can't be, they're lost and the file
+  // keeps holes there
+  int ret = 0;
+  if(append_flush(fd) < 0) ret = -1;
+  append_forget(fd);
+  free(open_files[fd].pending);
+  open_files[fd].pending = NULL;
+  open_files[fd].pending_len = 0;
+  open_files[fd].pending_new = 0;
+  if(delayed_flush(open_files[fd].inode) < 0) {
+    delayed_drop(open_files[fd].inode, 0);
+    osErrno = E_NO_SPACE;
+    ret = -1;
+  }
+
+  dprintf("... file closed successfully\n");
+  open_files[fd].inode = 0;
+  return ret;
+}
+
+static int dir_create(char* path)
+{
+  dprintf("Dir_Create('%s'):\n", path);
+  if(is_read_only()) return -1;
+  return create_file_or_directory(1, path);
+}
+
+static int dir_unlink(char* path)
+{
+  /* YOUR CODE */
+
+  dprintf("Dir_Unlink('%s'):\n", path);
+  if(is_read_only()) return -1;
+  int child_inode;
+  char child_fname[MAX_NAME];
+  int parent_inode = follow_path(path, &child_inode, child_fname);
+  if(parent_inode < 0 || child_inode < 0) {
+    dprintf("... directory '%s' is not found\n", path);
+    osErrno = E_NO_SUCH_DIR;
+    return -1;
+  }
+  if(child_inode == 0) {
+    dprintf("... can't unlink the root directory\n");
+    osErrno = E_ROOT_DIR;
+    return -1;
+  }
+  if(is_dir_handle_open(child_inode)) {
+    dprintf("... directory '%s' has a handle open\n", path);
+    osErrno = E_FILE_IN_USE;
+    return -1;
+  }
+
+  return remove_inode(1, parent_inode, child_inode);
+}
+
+static int dir_size(char* path)
+{
+  /* YOUR CODE */
+  // UNTESTED, but uses nearly the same code as the sample code to get an inode,
+  // so it should work
+  inode_t* inode;
+  if (get_inode_from_path(path, &inode) >= 0)
+    return inode->size;
+
+  return 0;
+}
+
+static int dir_read(char* path, void* buffer, int size) {
+	int target_inode, sector_number, read_buffer_size, position_in_sector,shift = 0, a,b,c, arr[MAX_SECTORS_PER_FILE],data_availability;
+	char File_Name[16],target_sector_buffer[INODE_BUFFER_SIZE];
+	//calling follow_path function to extract target_inode
+	if(follow_path(path, &target_inode, File_Name) < 0 || target_inode < 0){
+		osErrno = E_NO_SUCH_DIR;
+		return -1;
 	}
-	
-	open_files[fd].pos += count; // value of the pos variable will be updated with new one
+    int offset = target_inode%INODES_PER_SECTOR;
+	assert(offset >= 0 && offset < INODES_PER_SECTOR);
+         //target_inode = 13
+	//load child inode's sector
+	position_in_sector = target_inode/INODES_PER_SECTOR;
+	sector_number = INODE_TABLE_SECTOR(position_in_sector);   //3  //
+
+	//Checking whether there is something to read in the target sector. If not return -1 as error
+	data_availability = inode_table_read(sector_number, target_sector_buffer);
+	if(data_availability < 0)
+	   return -1;  //If there is nothing to read in the sector
+
+
+	inode_t* target_directory = (inode_t*)(target_sector_buffer+offset*sizeof(inode_t));
+	read_buffer_size = target_directory->size*sizeof(dirent_t);
+	// check the type of inode whether its a diectory or a file
+	if(target_directory->type !=1){
+		osErrno = E_GENERAL;
+		return -1;
+	}
+
+	//check the parameter buffer does not exceed the directory size * inode dorectory size
+	if(read_buffer_size > size){
+		osErrno = E_BUFFER_TOO_SMALL;
+		return -1;
+	}
+
+	//we need to read all the sectors holding the dirents of the target directory, i.e. the first (size+DIRENTS_PER_SECTOR-1)/DIRENTS_PER_SECTOR data sectors
+	int nsectors = (target_directory->size+DIRENTS_PER_SECTOR-1)/DIRENTS_PER_SECTOR;
+	for(c = 0; c < nsectors; c++){
+            arr[c] = target_directory->data[c];
+        }
+
+    //traverse through the array and copy the dirents in use (the first 'size' ones) to the buffer, straight from the disk
+    //(unpacked on the way if they're packed)
+    for(a=0;a<nsectors;a++){
+        const char* directory_storage = Disk_Map(arr[a]);
+        if(!directory_storage)
+            return -1;
+        b = target_directory->size-a*DIRENTS_PER_SECTOR;
+        if(b > DIRENTS_PER_SECTOR)
+            b = DIRENTS_PER_SECTOR;
+        unpack_dirents(directory_storage, buffer+shift, b);
+        //shifting to the next free slot
+        shift = shift+b*sizeof(dirent_t);
+        Disk_Unmap(arr[a], 0);
+    }
+
+	dprintf("Target directory size = %d\n", target_directory->size);
+	return target_directory->size;
+}
+
+/* consistency check (fsck) */
+
+// the check works on a private copy of the whole disk: the directory
+// tree is walked by a pool of threads taking directories off a queue,
+// each inode being checked (and fixed in 'inodes') by the one thread
+// that finds its first valid dirent; all repairs are then written back
+// by the calling thread alone, rebuilding both bitmaps and the sector
+// reference counts from the references found
+typedef struct _check {
+  char (*image)[SECTOR_SIZE]; // copy of the disk
+  inode_t* inodes; // copy of the inode table (unpacked), fixed as checked
+  char* inuse; // inodes marked in the inode bitmap
+  char* linked; // inodes reached from the root directory
+  char* meta; // sectors holding file system metadata beyond the fixed part
+  int* refs; // references to each sector from linked inodes
+  int* snaprefs; // references to each sector from snapshots
+  dirent_t** dirents; // fixed dirents of directories that need them
+  char* dirty; // inodes fixed
+  int bad_snapshot[MAX_SNAPSHOTS];
+
+  // directories waiting to be scanned, and those queued or being scanned
+  int* queue;
+  int qhead, qtail, pending;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  FS_CheckReport_t* report;
+} check_t;
+
+// count a problem of the given class and pass its description on
+static void check_problem(check_t* c, int* counter, const char* fmt, ...)
+  __attribute__((format(printf, 3, 4)));
+static void check_problem(check_t* c, int* counter, const char* fmt, ...)
+{
+  char msg[128];
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(msg, sizeof(msg), fmt, ap);
+  va_end(ap);
+  pthread_mutex_lock(&c->lock);
+  (*counter)++;
+  if(c->report->problem) c->report->problem(msg, c->report->arg);
+  pthread_mutex_unlock(&c->lock);
+}
+
+// return 1 if 'sector' may hold data of a file or directory
+static int check_data_sector(check_t* c, int sector)
+{
+  return sector >= 0 && sector < TOTAL_SECTORS && !FIXED_SECTOR(sector) && !c->meta[sector];
+}
+
+// return bit 'pos' of the bitmap starting at 'start' in the copy of
+// the disk
+static int check_bit(check_t* c, int start, int pos)
+{
+  int bits = BITMAP_BITS(start);
+  return (c->image[BITMAP_SECTOR(start, pos/bits)][pos%bits/8] & (128 >> (pos%8))) != 0;
+}
+
+// check the inode 'ino' (without its dirents), fixing its copy; a
+// compressed stream that can't be decompressed leaves the file empty
+static void check_inode(check_t* c, int ino)
+{
+  inode_t* inode = &c->inodes[ino];
+  FS_CheckReport_t* r = c->report;
+  int known = inode->type == 0 ? INODE_INLINE|INODE_COMPRESSED : 0;
+  if(inode->flags & ~known) {
+    check_problem(c, &r->bad_inodes, "inode %d: invalid flags 0x%x", ino, inode->flags);
+    inode->flags &= known;
+    c->dirty[ino] = 1;
+  }
+  if((inode->flags & INODE_INLINE) && (inode->flags & INODE_COMPRESSED)) {
+    check_problem(c, &r->bad_inodes, "inode %d: both inline and compressed", ino);
+    inode->flags &= ~INODE_COMPRESSED;
+    c->dirty[ino] = 1;
+  }
+  int max = inode->type == 1 ? MAX_SECTORS_PER_FILE*DIRENTS_PER_SECTOR :
+    (inode->flags & INODE_INLINE) ? INLINE_MAX : MAX_FILE_SIZE;
+  if(inode->size < 0 || inode->size > max) {
+    check_problem(c, &r->bad_inodes, "inode %d: size %d out of range", ino, inode->size);
+    inode->size = inode->size < 0 ? 0 : max;
+    c->dirty[ino] = 1;
+  }
+  if(inode->flags & INODE_INLINE) return;
+
+  for(int j=0; j<MAX_SECTORS_PER_FILE; j++) {
+    if(inode->data[j] && !check_data_sector(c, inode->data[j])) {
+      check_problem(c, &r->bad_inodes, "inode %d: block %d points to sector %d",
+		    ino, j, inode->data[j]);
+      inode->data[j] = 0;
+      c->dirty[ino] = 1;
+    }
+  }
+
+  if((inode->flags & INODE_COMPRESSED) && inode->size > 0) {
+    char stream[MAX_FILE_SIZE], content[MAX_FILE_SIZE];
+    int ok = inode->data[0] != 0;
+    if(ok) {
+      memcpy(stream, c->image[inode->data[0]], SECTOR_SIZE);
+      int clen = *(int*)stream;
+      int total = (clen > 0 ? clen : inode->size)+sizeof(int);
+      ok = clen >= 0 && total <= MAX_FILE_SIZE;
+      for(int i=1; ok && i*SECTOR_SIZE<total; i++) {
+	if(!(ok = inode->data[i] != 0)) break;
+	memcpy(stream+i*SECTOR_SIZE, c->image[inode->data[i]], SECTOR_SIZE);
+      }
+      if(ok && clen > 0)
+	ok = LZ_Decompress(stream+sizeof(int), clen, content, MAX_FILE_SIZE) == inode->size;
+    }
+    if(!ok) {
+      check_problem(c, &r->bad_inodes, "inode %d: compressed content is damaged", ino);
+      inode->size = 0;
+      memset(inode->data, 0, sizeof(inode->data));
+      c->dirty[ino] = 1;
+    }
+  }
+}
+
+// count the references of a checked inode to its data sectors
+static void check_count_refs(check_t* c, int ino)
+{
+  inode_t* inode = &c->inodes[ino];
+  if(inode->flags & INODE_INLINE) return;
+  for(int j=0; j<MAX_SECTORS_PER_FILE; j++)
+    if(inode->data[j]) __atomic_fetch_add(&c->refs[inode->data[j]], 1, __ATOMIC_RELAXED);
+}
+
+// check a directory and its dirents, queueing the subdirectories and
+// checking the files it links
+static void check_dir(check_t* c, int dir)
+{
+  inode_t* inode = &c->inodes[dir];
+  FS_CheckReport_t* r = c->report;
+  check_inode(c, dir);
+
+  dirent_t* kept = malloc(inode->size*sizeof(dirent_t)+1);
+  int nkept = 0;
+  char dirents[DIRENT_BUFFER_SIZE];
+  for(int e=0; e<inode->size; e++) {
+    int group = e/DIRENTS_PER_SECTOR;
+    if(!inode->data[group]) {
+      if(e%DIRENTS_PER_SECTOR == 0)
+	check_problem(c, &r->bad_dirents, "directory %d: dirent group %d is lost", dir, group);
+      continue;
+    }
+    if(e%DIRENTS_PER_SECTOR == 0)
+      unpack_dirents(c->image[inode->data[group]], dirents, DIRENTS_PER_SECTOR);
+    dirent_t* d = (dirent_t*)dirents+e%DIRENTS_PER_SECTOR;
+    if(!memchr(d->fname, 0, MAX_NAME) || !d->fname[0] || illegal_filename(d->fname)) {
+      check_problem(c, &r->bad_dirents, "directory %d: dirent %d has an invalid name", dir, e);
+      continue;
+    }
+    int child = d->inode;
+    if(child <= 0 || child >= MAX_FILES || !c->inuse[child] ||
+       (c->inodes[child].type != 0 && c->inodes[child].type != 1)) {
+      check_problem(c, &r->bad_dirents, "directory %d: '%s' refers to invalid inode %d",
+		    dir, d->fname, child);
+      continue;
+    }
+    int dup = 0;
+    for(int k=0; k<nkept && !dup; k++) dup = !strcmp(kept[k].fname, d->fname);
+    if(dup) {
+      check_problem(c, &r->bad_dirents, "directory %d: '%s' appears twice", dir, d->fname);
+      continue;
+    }
+    if(__atomic_exchange_n(&c->linked[child], 1, __ATOMIC_ACQ_REL)) {
+      check_problem(c, &r->bad_dirents, "directory %d: '%s' links inode %d linked elsewhere",
+		    dir, d->fname, child);
+      continue;
+    }
+    kept[nkept++] = *d;
+
+    if(c->inodes[child].type == 1) {
+      pthread_mutex_lock(&c->lock);
+      c->queue[c->qtail++] = child;
+      c->pending++;
+      pthread_cond_signal(&c->cond);
+      pthread_mutex_unlock(&c->lock);
+    } else {
+      check_inode(c, child);
+      check_count_refs(c, child);
+    }
+  }
+
+  if(nkept < inode->size) {
+    // the dirents left are compacted, and the sectors they no longer
+    // need are given up
+    inode->size = nkept;
+    for(int g=(nkept+DIRENTS_PER_SECTOR-1)/DIRENTS_PER_SECTOR; g<MAX_SECTORS_PER_FILE; g++)
+      inode->data[g] = 0;
+    c->dirents[dir] = kept;
+    c->dirty[dir] = 1;
+  } else free(kept);
+  check_count_refs(c, dir);
+}
+
+static void* check_worker(void* arg)
+{
+  check_t* c = arg;
+  pthread_mutex_lock(&c->lock);
+  for(;;) {
+    while(c->qhead == c->qtail && c->pending > 0) pthread_cond_wait(&c->cond, &c->lock);
+    if(c->qhead == c->qtail) break;
+    int dir = c->queue[c->qhead++];
+    pthread_mutex_unlock(&c->lock);
+    check_dir(c, dir);
+    pthread_mutex_lock(&c->lock);
+    if(--c->pending == 0) pthread_cond_broadcast(&c->cond);
+  }
+  pthread_mutex_unlock(&c->lock);
+  return NULL;
+}
+
+// check the snapshots, marking the sectors they own as metadata and
+// counting their references to data sectors
+static void check_snapshots(check_t* c, superblock_t* super)
+{
+  FS_CheckReport_t* r = c->report;
+  int (*maps)[MAX_INODE_TABLE_SECTORS] = calloc(MAX_SNAPSHOTS, sizeof(*maps));
+
+  // first, the sectors owned by each snapshot
+  for(int s=0; s<MAX_SNAPSHOTS; s++) {
+    snapshot_t* snap = &super->snapshots[s];
+    if(!snap->name[0]) continue;
+    int ok = memchr(snap->name, 0, MAX_NAME) != NULL;
+    for(int m=0; ok && m<SNAPSHOT_MAP_SECTORS; m++) {
+      ok = check_data_sector(c, snap->map[m]);
+      if(ok) memcpy((char*)maps[s]+m*SECTOR_SIZE, c->image[snap->map[m]],
+		    m < SNAPSHOT_MAP_SECTORS-1 ? SECTOR_SIZE :
+		    sizeof(maps[s])-m*SECTOR_SIZE);
+    }
+    for(int t=0; ok && t<INODE_TABLE_SECTORS; t++)
+      ok = !maps[s][t] || check_data_sector(c, maps[s][t]);
+    if(!ok) {
+      check_problem(c, &r->bad_snapshots, "snapshot slot %d: invalid map", s);
+      c->bad_snapshot[s] = 1;
+      continue;
+    }
+    for(int m=0; m<SNAPSHOT_MAP_SECTORS; m++) c->meta[snap->map[m]] = 1;
+    for(int t=0; t<INODE_TABLE_SECTORS; t++) if(maps[s][t]) c->meta[maps[s][t]] = 1;
+  }
+
+  // then, their references to data sectors
+  for(int s=0; s<MAX_SNAPSHOTS; s++) {
+    if(!super->snapshots[s].name[0] || c->bad_snapshot[s]) continue;
+    int ok = 1;
+    char buf[INODE_BUFFER_SIZE];
+    for(int t=0; ok && t<INODE_TABLE_SECTORS; t++) {
+      if(!maps[s][t]) continue;
+      unpack_inodes(c->image[maps[s][t]], buf);
+      for(int i=0; ok && i<INODES_PER_SECTOR; i++) {
+	inode_t* inode = (inode_t*)buf+i;
+	if(inode->flags & INODE_INLINE) continue;
+	for(int j=0; ok && j<MAX_SECTORS_PER_FILE; j++)
+	  ok = !inode->data[j] || check_data_sector(c, inode->data[j]);
+      }
+    }
+    if(!ok) {
+      check_problem(c, &r->bad_snapshots, "snapshot '%s': invalid block pointers",
+		    super->snapshots[s].name);
+      c->bad_snapshot[s] = 1;
+      continue;
+    }
+    int sectors[INODE_BUFFER_SIZE/sizeof(inode_t)*MAX_SECTORS_PER_FILE];
+    for(int t=0; t<INODE_TABLE_SECTORS; t++) {
+      if(!maps[s][t]) continue;
+      unpack_inodes(c->image[maps[s][t]], buf);
+      int n = collect_data_sectors(buf, t*INODES_PER_SECTOR, NULL, sectors, 0);
+      for(int k=0; k<n; k++) c->snaprefs[sectors[k]]++;
+    }
+  }
+  free(maps);
+}
+
+// allocate a sector not in use while repairing
+static int check_alloc(check_t* c)
+{
+  for(int s=DATABLOCK_START_SECTOR; s<TOTAL_SECTORS; s++)
+    if(!FIXED_SECTOR(s) && !c->meta[s] && !c->refs[s] && !c->snaprefs[s]) return s;
+  return -1;
+}
+
+// write the repairs back to the disk; return 0 if successful, -1
+// otherwise
+static int check_repair(check_t* c, superblock_t* super)
+{
+  // the compacted dirents go to sectors of the directory's own
+  for(int dir=0; dir<MAX_FILES; dir++) {
+    if(!c->dirents[dir]) continue;
+    inode_t* inode = &c->inodes[dir];
+    for(int g=0; g*DIRENTS_PER_SECTOR<inode->size; g++) {
+      int s = inode->data[g];
+      if(!s || c->refs[s]+c->snaprefs[s] > 1) {
+	int newsec = check_alloc(c);
+	if(newsec < 0) return -1;
+	if(s) c->refs[s]--;
+	c->refs[newsec]++;
+	inode->data[g] = newsec;
+      }
+      char buf[DIRENT_BUFFER_SIZE];
+      memset(buf, 0, DIRENT_BUFFER_SIZE);
+      int n = inode->size-g*DIRENTS_PER_SECTOR;
+      if(n > DIRENTS_PER_SECTOR) n = DIRENTS_PER_SECTOR;
+      memcpy(buf, c->dirents[dir]+g*DIRENTS_PER_SECTOR, n*sizeof(dirent_t));
+      if(dirents_write(inode->data[g], buf) < 0) return -1;
+    }
+  }
+
+  // the inodes, with those not linked cleared
+  for(int t=0; t<INODE_TABLE_SECTORS; t++) {
+    int dirty = 0;
+    for(int ino=t*INODES_PER_SECTOR; ino<(t+1)*INODES_PER_SECTOR && ino<MAX_FILES; ino++) {
+      if(!c->linked[ino]) memset(&c->inodes[ino], 0, sizeof(inode_t));
+      dirty |= c->dirty[ino] || c->inuse[ino] != c->linked[ino];
+    }
+    if(dirty && inodes_write(INODE_TABLE_SECTOR(t), (char*)&c->inodes[t*INODES_PER_SECTOR]) < 0)
+      return -1;
+  }
+
+  // the reference counts, in the sectors already holding them as far as
+  // they're valid
+  for(int t=0; t<REFCNT_SECTORS; t++) {
+    char counts[SECTOR_SIZE];
+    int shared = 0;
+    memset(counts, 0, SECTOR_SIZE);
+    for(int i=0; i<SECTOR_SIZE && t*SECTOR_SIZE+i<TOTAL_SECTORS; i++) {
+      int refs = c->refs[t*SECTOR_SIZE+i]+c->snaprefs[t*SECTOR_SIZE+i];
+      if(refs > 1) {
+	counts[i] = refs-1 > MAX_SECTOR_REFS ? MAX_SECTOR_REFS : refs-1;
+	shared = 1;
+      }
+    }
+    if(super->refcnt[t] && !c->meta[super->refcnt[t]]) super->refcnt[t] = 0;
+    if(shared && !super->refcnt[t]) {
+      if((super->refcnt[t] = check_alloc(c)) < 0) return -1;
+      c->meta[super->refcnt[t]] = 1;
+    }
+    if(super->refcnt[t] && Disk_Write(super->refcnt[t], counts) < 0) return -1;
+  }
+  for(int s=0; s<MAX_SNAPSHOTS; s++)
+    if(c->bad_snapshot[s]) memset(&super->snapshots[s], 0, sizeof(snapshot_t));
+  if(Disk_Write(SUPERBLOCK_START_SECTOR, (char*)super) < 0) return -1;
+
+  // and both bitmaps
+  char bitmap[SECTOR_BITMAP_SECTORS][SECTOR_SIZE];
+  memset(bitmap, 0, sizeof(bitmap));
+  for(int ino=0; ino<MAX_FILES; ino++)
+    if(c->linked[ino]) BITMAP_SET(bitmap, INODE_BITMAP_BITS, ino);
+  for(int i=0; i<INODE_BITMAP_SECTORS; i++)
+    if(Disk_Write(BITMAP_SECTOR(INODE_BITMAP_START_SECTOR, i), bitmap[i]) < 0) return -1;
+  memset(bitmap, 0, sizeof(bitmap));
+  for(int s=0; s<TOTAL_SECTORS; s++)
+    if(FIXED_SECTOR(s) || c->meta[s] || c->refs[s] || c->snaprefs[s])
+      BITMAP_SET(bitmap, SECTOR_BITMAP_BITS, s);
+  for(int i=0; i<SECTOR_BITMAP_SECTORS; i++)
+    if(Disk_Write(BITMAP_SECTOR(SECTOR_BITMAP_START_SECTOR, i), bitmap[i]) < 0) return -1;
+  memset(bitmap_full, 0, sizeof(bitmap_full));
+  free_sectors = -1;
+  return dedup_rebuild();
+}
+
+static int fs_check(int repair, int threads, FS_CheckReport_t* report)
+{
+  dprintf("FS_Check(%d, %d):\n", repair, threads);
+  if(!report) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  if(repair && is_read_only()) return -1;
+  for(int i=0; repair && i<MAX_OPEN_FILES; i++) {
+    if(open_files[i].inode > 0 || (i < MAX_DIR_HANDLES && dir_handles[i].used)) {
+      dprintf("... can't repair with files or directory handles open\n");
+      osErrno = E_FILE_IN_USE;
+      return -1;
+    }
+  }
+  void (*problem)(const char*, void*) = report->problem;
+  void* arg = report->arg;
+  memset(report, 0, sizeof(*report));
+  report->problem = problem;
+  report->arg = arg;
+  if(threads <= 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if(threads <= 0) threads = 1;
+
+  check_t c;
+  memset(&c, 0, sizeof(c));
+  c.report = report;
+  c.image = malloc(TOTAL_SECTORS*SECTOR_SIZE);
+  c.inodes = malloc(INODE_TABLE_SECTORS*INODES_PER_SECTOR*sizeof(inode_t));
+  c.inuse = calloc(MAX_FILES, 1);
+  c.linked = calloc(MAX_FILES, 1);
+  c.dirty = calloc(MAX_FILES, 1);
+  c.meta = calloc(TOTAL_SECTORS, 1);
+  c.refs = calloc(TOTAL_SECTORS, sizeof(int));
+  c.snaprefs = calloc(TOTAL_SECTORS, sizeof(int));
+  c.dirents = calloc(MAX_FILES, sizeof(dirent_t*));
+  c.queue = malloc(MAX_FILES*sizeof(int));
+  pthread_t* workers = malloc(threads*sizeof(pthread_t));
+  pthread_mutex_init(&c.lock, NULL);
+  pthread_cond_init(&c.cond, NULL);
+  int ret = -1;
+  if(!c.image || !c.inodes || !c.inuse || !c.linked || !c.dirty || !c.meta ||
+     !c.refs || !c.snaprefs || !c.dirents || !c.queue || !workers) goto done;
+
+  // the copy of the disk, and what the fixed part says
+  for(int s=0; s<TOTAL_SECTORS; s++)
+    if(Disk_Read(s, c.image[s]) < 0) goto done;
+  superblock_t* super = (superblock_t*)c.image[SUPERBLOCK_START_SECTOR];
+  if(super->magic != OS_MAGIC) {
+    dprintf("... not a file system\n");
+    goto done;
+  }
+  for(int t=0; t<INODE_TABLE_SECTORS; t++)
+    unpack_inodes(c.image[INODE_TABLE_SECTOR(t)], (char*)&c.inodes[t*INODES_PER_SECTOR]);
+  for(int ino=0; ino<MAX_FILES; ino++)
+    c.inuse[ino] = check_bit(&c, INODE_BITMAP_START_SECTOR, ino);
+  for(int t=0; t<REFCNT_SECTORS; t++) {
+    if(!super->refcnt[t]) continue;
+    if(check_data_sector(&c, super->refcnt[t])) c.meta[super->refcnt[t]] = 1;
+    else check_problem(&c, &report->refcnt_errors, "reference counts %d: invalid sector %d",
+		       t, super->refcnt[t]);
+  }
+  check_snapshots(&c, super);
+  // the sectors held for views of mapped files are still in use
+  for(int m=0; m<MAX_MMAPS; m++)
+    for(int i=0; mmaps[m].addr && i<mmaps[m].nsectors; i++)
+      if(mmaps[m].held & (1u << i)) c.meta[mmaps[m].sector+i] = 1;
+
+  // walk the tree from the root
+  if(!c.inuse[0] || c.inodes[0].type != 1) {
+    dprintf("... root directory is missing\n");
+    goto done;
+  }
+  c.linked[0] = 1;
+  c.queue[c.qtail++] = 0;
+  c.pending = 1;
+  int nworkers;
+  for(nworkers=0; nworkers<threads; nworkers++)
+    if(pthread_create(&workers[nworkers], NULL, check_worker, &c)) break;
+  if(nworkers == 0) check_worker(&c);
+  for(int i=0; i<nworkers; i++) pthread_join(workers[i], NULL);
+
+  // what's left over, and what the bitmaps and the counts should say;
+  // bitmap_init() marks one bit more than it's asked to, so inode 1 and
+  // the first data sector of every flat disk are marked in use for
+  // nothing (grouped disks are formatted with that in mind)
+  inode_t unused;
+  memset(&unused, 0, sizeof(unused));
+  for(int ino=0; ino<MAX_FILES; ino++) {
+    if(!c.linked[ino]) {
+      if(c.inuse[ino] && !(ino == 1 && !grouped_format && !memcmp(&c.inodes[ino], &unused, sizeof(unused))))
+	check_problem(&c, &report->orphans, "inode %d: in use but not linked", ino);
+      continue;
+    }
+    report->inodes++;
+    if(c.inodes[ino].type == 1) report->directories++;
+  }
+  for(int ino=MAX_FILES; ino<INODE_BITMAP_SECTORS*INODE_BITMAP_BITS; ino++)
+    if(check_bit(&c, INODE_BITMAP_START_SECTOR, ino))
+      check_problem(&c, &report->bitmap_errors, "inode bitmap: bit %d past the table is set", ino);
+  int marked_free = 0, marked_used = 0, counts_wrong = 0, too_shared = 0;
+  for(int s=0; s<TOTAL_SECTORS; s++) {
+    int refs = c.refs[s]+c.snaprefs[s];
+    int used = FIXED_SECTOR(s) || c.meta[s] || refs > 0;
+    int marked = check_bit(&c, SECTOR_BITMAP_START_SECTOR, s);
+    if(used) report->sectors++;
+    if(used && !marked) marked_free++;
+    if(!used && marked && (grouped_format || s != DATABLOCK_START_SECTOR)) marked_used++;
+    int t = s/SECTOR_SIZE;
+    int stored = super->refcnt[t] && c.meta[super->refcnt[t]] ?
+      (unsigned char)c.image[super->refcnt[t]][s%SECTOR_SIZE] : 0;
+    if(refs-1 > MAX_SECTOR_REFS) too_shared++;
+    else if(stored != (refs > 1 ? refs-1 : 0)) counts_wrong++;
+  }
+  report->bitmap_errors += marked_free+marked_used;
+  report->refcnt_errors += counts_wrong+too_shared;
+  if(marked_free && problem) problem("sector bitmap: sectors in use are marked free", arg);
+  if(marked_used && problem) problem("sector bitmap: sectors not in use are marked in use", arg);
+  if(counts_wrong && problem) problem("reference counts don't match the references", arg);
+  if(too_shared && problem) problem("sectors have more references than can be counted", arg);
+
+  ret = report->bad_dirents+report->bad_inodes+report->orphans+report->bitmap_errors+
+    report->refcnt_errors+report->bad_snapshots;
+  dprintf("... %d inodes, %d sectors in use, %d problems\n", report->inodes, report->sectors, ret);
+  if(repair && ret > 0) {
+    // the superblock is written back from the copy
+    char sb[SECTOR_SIZE];
+    memcpy(sb, super, SECTOR_SIZE);
+    if(check_repair(&c, (superblock_t*)sb) < 0) {
+      dprintf("... repair failed\n");
+      ret = -1;
+      goto done;
+    }
+    report->repaired = 1;
+  }
+
+ done:
+  if(ret < 0) osErrno = E_GENERAL;
+  for(int ino=0; c.dirents && ino<MAX_FILES; ino++) free(c.dirents[ino]);
+  free(c.image); free(c.inodes); free(c.inuse); free(c.linked); free(c.dirty);
+  free(c.meta); free(c.refs); free(c.snaprefs); free(c.dirents); free(c.queue);
+  free(workers);
+  pthread_mutex_destroy(&c.lock);
+  pthread_cond_destroy(&c.cond);
+  return ret;
+}
+/* defragmentation */
+
+// tally the fragmentation of the data blocks of the files and
+// directories in use, and of the free data sectors
+static int frag_measure(FS_Frag_t* frag)
+{
+  char bitmap[SECTOR_BITMAP_SECTORS][SECTOR_SIZE];
+  memset(frag, 0, sizeof(*frag));
+  for(int i=0; i<INODE_BITMAP_SECTORS; i++)
+    if(Disk_Read(BITMAP_SECTOR(INODE_BITMAP_START_SECTOR, i), bitmap[i]) < 0) return -1;
+  for(int t=0; t<INODE_TABLE_SECTORS; t++) {
+    char buf[INODE_BUFFER_SIZE];
+    int loaded = 0;
+    for(int ino=t*INODES_PER_SECTOR; ino<(t+1)*INODES_PER_SECTOR && ino<MAX_FILES; ino++) {
+      if(!BITMAP_TEST(bitmap, INODE_BITMAP_BITS, ino)) continue;
+      if(!loaded && inodes_read(INODE_TABLE_SECTOR(t), buf) < 0) return -1;
+      loaded = 1;
+      inode_t* inode = (inode_t*)(buf+(ino%INODES_PER_SECTOR)*sizeof(inode_t));
+      if(inode->flags & INODE_INLINE) continue;
+      int blocks = 0, extents = 0, last = 0;
+      for(int j=0; j<MAX_SECTORS_PER_FILE; j++) {
+	if(!inode->data[j]) continue;
+	if(inode->data[j] != last+1) extents++;
+	last = inode->data[j];
+	blocks++;
+      }
+      if(!blocks) continue;
+      frag->files++;
+      frag->blocks += blocks;
+      frag->extents += extents;
+      if(extents > 1) frag->fragmented++;
+    }
+  }
+
+  for(int i=0; i<SECTOR_BITMAP_SECTORS; i++)
+    if(Disk_Read(BITMAP_SECTOR(SECTOR_BITMAP_START_SECTOR, i), bitmap[i]) < 0) return -1;
+  for(int s=DATABLOCK_START_SECTOR, run=0; s<=TOTAL_SECTORS; s++) {
+    if(s < TOTAL_SECTORS && !BITMAP_TEST(bitmap, SECTOR_BITMAP_BITS, s)) {
+      run++;
+      continue;
+    }
+    if(run > 0) frag->free_runs++;
+    if(run > frag->largest_free) frag->largest_free = run;
+    run = 0;
+  }
+  return 0;
+}
+
+// defragment the inode 'inode' (number 'ino'): a directory drops the
+// dirent sectors it doesn't use, and the data blocks are copied to a
+// single run of free sectors (keeping holes) unless they're already
+// in one, or some of them are shared; the caller writes the inode back
+// and then releases the sectors it no longer refers to; return 2 if
+// the blocks moved, 1 if the inode changed otherwise, 0 if it didn't,
+// and -1 on error
+static int defrag_inode(int ino, inode_t* inode)
+{
+  if(inode->flags & INODE_INLINE) return 0;
+  int changed = 0;
+  if(inode->type == 1) {
+    for(int g=(inode->size+DIRENTS_PER_SECTOR-1)/DIRENTS_PER_SECTOR; g<MAX_SECTORS_PER_FILE; g++) {
+      if(!inode->data[g]) continue;
+      dprintf("... directory %d drops unused dirent sector %d\n", ino, inode->data[g]);
+      inode->data[g] = 0;
+      changed = 1;
+    }
+  }
+
+  int blocks[MAX_SECTORS_PER_FILE], old[MAX_SECTORS_PER_FILE], n = 0, contiguous = 1;
+  for(int j=0; j<MAX_SECTORS_PER_FILE; j++) {
+    if(!inode->data[j]) continue;
+    if(n > 0 && inode->data[j] != old[n-1]+1) contiguous = 0;
+    blocks[n] = j;
+    old[n++] = inode->data[j];
+  }
+  if(contiguous) return changed;
+  for(int k=0; k<n; k++) {
+    int refs = sector_refs(old[k]);
+    if(refs < 0) return -1;
+    if(refs > 0) {
+      dprintf("... inode %d shares sector %d, left as it is\n", ino, old[k]);
+      return changed;
+    }
+  }
+  alloc_near(ino);
+  int first = bitmap_alloc_run(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, TOTAL_SECTORS, n);
+  if(first < 0) {
+    dprintf("... no run of %d free sectors for inode %d\n", n, ino);
+    return changed;
+  }
+
+  for(int k=0; k<n; k++) {
+    char buf[SECTOR_SIZE];
+    if(Disk_Read(old[k], buf) < 0 || Disk_Write(first+k, buf) < 0) return -1;
+    inode->data[blocks[k]] = first+k;
+  }
+  dprintf("... moved %d blocks of inode %d to sectors %d-%d\n", n, ino, first, first+n-1);
+  return 2;
+}
+
+static int fs_fragmentation(FS_Frag_t* frag)
+{
+  dprintf("FS_Fragmentation():\n");
+  if(!frag || frag_measure(frag) < 0) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  return 0;
+}
+
+static int fs_defrag(FS_Frag_t* before, FS_Frag_t* after)
+{
+  dprintf("FS_Defrag():\n");
+  if(is_read_only()) return -1;
+  if(before && frag_measure(before) < 0) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+
+  char bitmap[INODE_BITMAP_SECTORS][SECTOR_SIZE];
+  for(int i=0; i<INODE_BITMAP_SECTORS; i++) {
+    if(Disk_Read(BITMAP_SECTOR(INODE_BITMAP_START_SECTOR, i), bitmap[i]) < 0) {
+      osErrno = E_GENERAL;
+      return -1;
+    }
+  }
+  int moved = 0;
+  for(int t=0; t<INODE_TABLE_SECTORS; t++) {
+    char buf[INODE_BUFFER_SIZE];
+    if(inodes_read(INODE_TABLE_SECTOR(t), buf) < 0) {
+      osErrno = E_GENERAL;
+      return -1;
+    }
+    for(int ino=t*INODES_PER_SECTOR; ino<(t+1)*INODES_PER_SECTOR && ino<MAX_FILES; ino++) {
+      if(!BITMAP_TEST(bitmap, INODE_BITMAP_BITS, ino)) continue;
+      if(is_file_mapped(ino)) continue; // its sectors are lent out
+      inode_t* inode = (inode_t*)(buf+(ino%INODES_PER_SECTOR)*sizeof(inode_t));
+      int old[MAX_SECTORS_PER_FILE];
+      memcpy(old, inode->data, sizeof(old));
+      int ret = defrag_inode(ino, inode);
+      if(ret < 0 || (ret > 0 && inodes_write(INODE_TABLE_SECTOR(t), buf) < 0)) {
+	osErrno = E_GENERAL;
+	return -1;
+      }
+      if(ret == 0) continue;
+
+      // the old sectors are only given back once the inode refers to
+      // the new ones
+      int freed[MAX_SECTORS_PER_FILE], nfreed = 0;
+      for(int j=0; j<MAX_SECTORS_PER_FILE; j++)
+	if(old[j] && old[j] != inode->data[j]) freed[nfreed++] = old[j];
+      if(release_sectors(nfreed, freed) < 0) {
+	osErrno = E_GENERAL;
+	return -1;
+      }
+      if(ret == 2) moved++;
+    }
+  }
+
+  // moved blocks are indexed anew
+  if((dedup_enabled && dedup_rebuild() < 0) || (after && frag_measure(after) < 0)) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  dprintf("... %d files moved\n", moved);
+  return moved;
+}
 
-	return count; // by returning count, the function is providing the number of bytes actually read which can be less than or equal to size.
+/* the public functions account for their calls and hand them over to
+   the implementations above */
+
+#define API(api, call, bytes) do {					\
+    unsigned long long start_ = api_enter(api);			\
+    int ret_ = (call);							\
+    return api_leave(api, start_, ret_, (bytes));			\
+  } while(0)
+
+int FS_Boot(char* backstore_fname)
+{
+  API(FS_API_BOOT, fs_boot(backstore_fname), 0);
 }
- 
 
-int File_Write(int fd, void* buffer, int size)
+int FS_Sync()
 {
-  /* YOUR CODE */
-  int file_inode = open_files[fd].inode; // file_inode will have the inode number for the file where we want to write the content of buffer.
-                                              //Here, open_files is a structure containing the value of inode with variable name inode.
-	if(!file_inode) {                    // If the file is not open (i.e open_files[fd].inode returns 0), it will show the error message and return -1, and set osErrno to E_BAD_FD.
-		osErrno = E_BAD_FD;
-		printf("File was not opened\n");
-		return -1;
-	}
+  API(FS_API_SYNC, fs_sync(), 0);
+}
 
-	// load the disk sector containing the child inode
-	int inode_sector = INODE_TABLE_START_SECTOR+file_inode/INODES_PER_SECTOR; //inode_sector will have the sector number that contains file_inode which is our required file inode.
-	char inode_buffer[SECTOR_SIZE];
-        
-        // from the line below, after Disk_read "inode_buffer" will contain the inode_sector's content 
-	if(Disk_Read(inode_sector, inode_buffer) < 0) return -1; 
-	dprintf("... load inode table for child inode from disk sector %d\n", inode_sector);
-	
-	
-	// get the child inode
-	int inode_start_entry = (inode_sector-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR; // inode_start_entry will have inode number that will be in the start of the inode_sector
-	int offset = file_inode-inode_start_entry; // now we have the offset to go from the inode_start_entry to reach to our desired inode.
-	assert(0 <= offset && offset < INODES_PER_SECTOR); // offset can be 0 to INODE_PER_SECTOR. otherwise assert function will give an error message and abort program execution
-	inode_t* file = (inode_t*)(inode_buffer+offset*sizeof(inode_t)); // Here, inode_buffer will provide starting address of inode_buffer[]. but we need only our 
-                                                                         // desired file_inode content.so we are adding offset adress with starting address to get there.
-                                                                         // Now, file will point to the file_inode.
-        
+int FS_SetDedup(int enable)
+{
+  API(FS_API_SET_DEDUP, fs_set_dedup(enable), 0);
+}
 
+int FS_Snapshot(char* name)
+{
+  API(FS_API_SNAPSHOT, fs_snapshot(name), 0);
+}
 
-	if((file->size + size) > MAX_FILE_SIZE){  // "file->size" will provide the current size of the file where we want to write 
-                                                  // It will be added with "size" which is the size of the data we want to write to file from buffer.
-                                                 // Thus if the file exceeds the maximum file size, it would return -1 and set osErrno to E_FILE_TOO_BIG showing an error message.
-		osErrno = E_FILE_TOO_BIG;
-		printf("File was too big\n");
-		return -1;
-	}
-        
-        // Necessary variables needed for file_write
-	int i, j,count=0;
-	char* charBuffer = (char*) buffer;
-	int t_size = size;
-        char temp_buffer[SECTOR_SIZE];
+int FS_SnapshotDelete(char* name)
+{
+  API(FS_API_SNAPSHOT_DELETE, fs_snapshot_delete(name), 0);
+}
 
-        // We may have to write data to a sector from starting byte or pos can be in any other byte
+int FS_BootSnapshot(char* backstore_fname, char* name)
+{
+  API(FS_API_BOOT_SNAPSHOT, fs_boot_snapshot(backstore_fname, name), 0);
+}
 
-	int start_sector = open_files[fd].pos / SECTOR_SIZE; // start_sector will have the sector number containing pos. pos, we know from the open_file structure that it is read/write position
-	int startbyte = open_files[fd].pos % SECTOR_SIZE; // initialization of startb where it will have the specific byte number of that sector indicated by pos 
+int File_Create(char* file)
+{
+  API(FS_API_FILE_CREATE, file_create(file), 0);
+}
 
-	// while loop will write the content of buffer to the data sectors allocated to the file sequentially. 
-        // first have to check if we will start writing to an already existing sector or have to allocate e new one before writing. 
-        i=start_sector;
-        while((i < MAX_SECTORS_PER_FILE) && (count<size))
-        {       
-		
-               //if we are writing in an already allocated sectors
-		if (file->data[i]) // "file->data[i]" from the specific inode will provide the sector number where to write
-                {  
-			Disk_Read(file->data[i], temp_buffer); // Disk_Read will read the previously existing sector data which will be saved into buf.
-                        j=startbyte;
-			while(j < SECTOR_SIZE)
-                        {
-				// write data to buffer
-				if(t_size-- > 0) 
-                                    temp_buffer[j] = charBuffer[count++]; // buffer[] has the content to write in the sector. It will be copied to temp_buffer[] from the startbyte index 
-                                                           // that is from the byte we want to write the buffer[] value.
-                        j++;
+int File_Open(char* file)
+{
+  API(FS_API_FILE_OPEN, file_open(file), 0);
+}
 
-			}
-			startbyte = 0; // after the first sector, in the later sectors buffer[] will written from the starting byte , so startbyte will be 0 here for writing
-                                      // so reset
+int File_Read(int fd, void* buffer, int size)
+{
+  API(FS_API_FILE_READ, file_read(fd, buffer, size), ret_ > 0 ? ret_ : 0);
+}
 
-			dprintf("In sector %d we are writing: %s\n", file->data[i], temp_buffer); // print the contents of particular sectors
+int File_Write(int fd, void* buffer, int size)
+{
+  API(FS_API_FILE_WRITE, file_write(fd, buffer, size), ret_ > 0 ? ret_ : 0);
+}
 
-			Disk_Write(file->data[i], temp_buffer); // Now, Disk_Write will write the temp_buff content into the sector specified by "file->data[i]" 
-		}
-		else // if "file->data[i]" won't provide any sector index that means we have to write into a new file sector which is not yet allocated to that file
-                    //thus have to allocate new sector 
-                {   
-			
-			int newsector = bitmap_first_unused(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, SECTOR_BITMAP_SIZE);
-			if(newsector == -1) //if there is no new sector available, the write cannot be completed due to a lack of space on disk. It will set osErrno to E_NO_SPACE.
-                        {
-				osErrno = E_NO_SPACE; 
-				return -1;
-			}
-			file->data[i] = newsector; // "file->data[i]" value will be updated with new sector value newsector 
+int File_Seek(int fd, int offset)
+{
+  API(FS_API_FILE_SEEK, file_seek(fd, offset), 0);
+}
 
-			char temp_buffer2[SECTOR_SIZE];
+int File_Close(int fd)
+{
+  API(FS_API_FILE_CLOSE, file_close(fd), 0);
+}
 
-			memset(temp_buffer2, 0, SECTOR_SIZE); // temp_buffer will be intialized with 0 upto SECTOR_SIZE (512B here)
-                        
-                        j=0;
+int File_Unlink(char* file)
+{
+  API(FS_API_FILE_UNLINK, file_unlink(file), 0);
+}
 
-			while(j < SECTOR_SIZE)
-                        {
-				// write to temp_buffer2
-				if(t_size-- > 0)
-                                   temp_buffer2[j] = charBuffer[count++]; // buffer[] has the content to write in the sector. It will be copied to temp_buffer2[] from the buffer[]
-                         j++;
-			}
+int File_CreateMany(char* dir, char** names, int n)
+{
+  API(FS_API_FILE_CREATE_MANY, file_create_many(dir, names, n), 0);
+}
 
-			//save changes
-			dprintf("\nIn new sector %d we are writing: %s\n", file->data[i], temp_buffer2); 
-			Disk_Write(file->data[i], temp_buffer2);// Now, Disk_Write will write the temp_buffer2 content into the sector specified by "file->data[i]" 
-		}
-           i++;
-	}
+int File_UnlinkMany(char* dir, char** names, int n)
+{
+  API(FS_API_FILE_UNLINK_MANY, file_unlink_many(dir, names, n), 0);
+}
 
-	//save changes 
-	open_files[fd].pos += size; // new position value for write will be set to pos
-	file->size += size; // inode content for the particular will be updated incrementing the file size by adding the new buffer size
-	open_files[fd].size += size; // open_file structure content will be changed as well by incrementing the size of the file with new adding new buffer size
+int File_Rename(char* from, char* to)
+{
+  API(FS_API_FILE_RENAME, file_rename(from, to), 0);
+}
 
-	Disk_Write(inode_sector, inode_buffer); // inode_sector that means the sector of the file inode will be updated with new inode_buffer.
+int File_Copy(char* from, char* to, int share)
+{
+  API(FS_API_FILE_COPY, file_copy(from, to, share), 0);
+}
 
-	return size;
+int File_SetCompression(char* file, int enable)
+{
+  API(FS_API_FILE_SET_COMPRESSION, file_set_compression(file, enable), 0);
 }
-int File_Seek(int fd, int offset)
+
+int File_Stat(char* path, FS_Stat_t* st)
 {
-  /* YOUR CODE */
-	int file_inode = open_files[fd].inode; // file_inode will have the inode number for the file where we want to update the current location of the file pointer.
-                                               //Here, open_files is a structure containing the value of inode with variable name inode.
-	if(!file_inode) {          // If the file is not open (i.e open_files[fd].inode returns 0), it will show the error message and return -1, and set osErrno to E_BAD_FD.
-		osErrno = E_BAD_FD; 
-		return -1;
-	}
+  API(FS_API_FILE_STAT, file_stat(path, st), 0);
+}
 
-	if (open_files[fd].size < offset || offset < 0){  // If offset is larger than the size of the file or negative, it return -1 and set osErrno to E_SEEK_OUT_OF_BOUNDS;
-		osErrno = E_SEEK_OUT_OF_BOUNDS;
-		return -1;
-	}
+int Dir_Create(char* path)
+{
+  API(FS_API_DIR_CREATE, dir_create(path), 0);
+}
 
-	
-	open_files[fd].pos = offset; // pos will be updated with new offset value
+int Dir_Unlink(char* path)
+{
+  API(FS_API_DIR_UNLINK, dir_unlink(path), 0);
+}
 
-	return open_files[fd].pos;
+int Dir_Size(char* path)
+{
+  API(FS_API_DIR_SIZE, dir_size(path), 0);
 }
 
-int File_Close(int fd)
+int Dir_Read(char* path, void* buffer, int size)
 {
-  dprintf("File_Close(%d):\n", fd);
-  if(0 > fd || fd > MAX_OPEN_FILES) {
-    dprintf("... fd=%d out of bound\n", fd);
-    osErrno = E_BAD_FD;
-    return -1;
-  }
-  if(open_files[fd].inode <= 0) {
-    dprintf("... fd=%d not an open file\n", fd);
-    osErrno = E_BAD_FD;
-    return -1;
-  }
+  API(FS_API_DIR_READ, dir_read(path, buffer, size), 0);
+}
 
-  dprintf("... file closed successfully\n");
-  open_files[fd].inode = 0;
-  return 0;
+int FS_Check(int repair, int threads, FS_CheckReport_t* report)
+{
+  API(FS_API_CHECK, fs_check(repair, threads, report), 0);
 }
 
-int Dir_Create(char* path)
+int FS_Fragmentation(FS_Frag_t* frag)
 {
-  dprintf("Dir_Create('%s'):\n", path);
-  return create_file_or_directory(1, path);
+  API(FS_API_FRAGMENTATION, fs_fragmentation(frag), 0);
 }
 
-int Dir_Unlink(char* path)
+int FS_Defrag(FS_Frag_t* before, FS_Frag_t* after)
 {
-  /* YOUR CODE */
+  API(FS_API_DEFRAG, fs_defrag(before, after), 0);
+}
 
-  dprintf("Dir_Unlink('%s'):\n", path);
-  int child_inode;
-  char child_fname[MAX_NAME];
-  int parent_inode = follow_path(path, &child_inode, child_fname);
+const void* File_Mmap(int fd, int* len)
+{
+  unsigned long long start = api_enter(FS_API_FILE_MMAP);
+  const void* addr = file_mmap(fd, len);
+  api_leave(FS_API_FILE_MMAP, start, addr ? 0 : -1, addr ? *len : 0);
+  return addr;
+}
 
-  return remove_inode(1, parent_inode, child_inode);
+int File_Munmap(const void* addr)
+{
+  API(FS_API_FILE_MUNMAP, file_munmap(addr), 0);
 }
 
-int Dir_Size(char* path)
+int File_Truncate(int fd, int len)
 {
-  /* YOUR CODE */
-  // UNTESTED, but uses nearly the same code as the sample code to get an inode,
-  // so it should work
-  inode_t* inode;
-  if (get_inode_from_path(path, &inode) >= 0)
-    return inode->size;
+  API(FS_API_FILE_TRUNCATE, file_truncate(fd, len), 0);
+}
 
-  return 0;
+int File_Allocate(int fd, int len)
+{
+  API(FS_API_FILE_ALLOCATE, file_allocate(fd, len), 0);
 }
 
-int Dir_Read(char* path, void* buffer, int size) {
-	int target_inode, sector_number, read_buffer_size, position_in_sector,shift = 0, a,b,c, arr[MAX_SECTORS_PER_FILE],data_availability;
-	char File_Name[16],target_sector_buffer[512], directory_storage[512];
-	//calling follow_path function to extract target_inode
-	follow_path(path, &target_inode, File_Name);
-    int offset = target_inode%SECTOR_SIZE;
-	assert(offset >= 0 && offset < INODES_PER_SECTOR);
-         //target_inode = 13
-	//load child inode's sector
-	position_in_sector = target_inode/INODES_PER_SECTOR;
-	sector_number = INODE_TABLE_START_SECTOR+ position_in_sector;   //3  //
+int File_Append(int fd, void* buffer, int size)
+{
+  API(FS_API_FILE_APPEND, file_append(fd, buffer, size), size);
+}
 
-	//Checking whether there is something to read in the target sector. If not return -1 as error
-	data_availability = Disk_Read(sector_number, target_sector_buffer);
-	if(data_availability < 0)
-	   return -1;  //If there is nothing to read in the sector
+int Dir_OpenHandle(char* path)
+{
+  API(FS_API_DIR_OPEN_HANDLE, dir_open_handle(path), 0);
+}
 
+int Dir_CloseHandle(int dh)
+{
+  API(FS_API_DIR_CLOSE_HANDLE, dir_close_handle(dh), 0);
+}
 
-	inode_t* target_directory = (inode_t*)(target_sector_buffer+offset*sizeof(inode_t));
-	read_buffer_size = target_directory->size*sizeof(dirent_t);
-	// check the type of inode whether its a diectory or a file
-	if(target_directory->type !=1){
-		osErrno = E_GENERAL;
-		return -1;
-	}
+int File_OpenAt(int dh, char* name)
+{
+  API(FS_API_FILE_OPEN_AT, file_open_at(dh, name), 0);
+}
 
-	//check the parameter buffer does not exceed the directory size * inode dorectory size
-	if(read_buffer_size > size){
-		osErrno = E_BUFFER_TOO_SMALL;
-		return -1;
-	}
+int File_CreateAt(int dh, char* name)
+{
+  API(FS_API_FILE_CREATE_AT, file_create_at(dh, name), 0);
+}
 
-	//we need to read all the sectors of the target directories and storing the directories in an array that has data as not equal zero
-	for(c = 0; c < MAX_SECTORS_PER_FILE; c++){
-		if(target_directory->data[c] != 0){
-            arr[c] = target_directory->data[c];
-            }
-        }
+int File_UnlinkAt(int dh, char* name)
+{
+  API(FS_API_FILE_UNLINK_AT, file_unlink_at(dh, name), 0);
+}
 
-    //traverse through the array and for each sector checking the directories inode. If the directory inode is not zero i.e. 1, then
-    dirent_t* target_dir_position;
-    for(a=0;a<sizeof(arr);a++){
-        Disk_Read(arr[a], directory_storage);
-        for(b = 0; b < DIRENTS_PER_SECTOR; b++){
-            target_dir_position = (dirent_t*)(directory_storage+b*sizeof(dirent_t));
-            if(target_dir_position->inode != 0){
-                memcpy(buffer+shift, (void*)target_dir_position, sizeof(dirent_t));
-                //shifting to the next slot
-                shift = shift+sizeof(dirent_t);
-            }
-        }
-    }
+int FS_GetStats(FS_Stats_t* st)
+{
+  if(st == NULL) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  *st = stats;
+  return 0;
+}
 
-	dprintf("Target directory size = %d\n", target_directory->size);
-	return target_directory->size;
+int FS_ResetStats()
+{
+  memset(&stats, 0, sizeof(stats));
+  return 0;
+}
+
+const char* FS_ApiName(int api)
+{
+  return api >= 0 && api < FS_API_COUNT ? api_names[api] : "-";
+}
+
+int FS_Trace(int enable)
+{
+  int was = trace_on;
+  trace_on = enable ? 1 : 0;
+  return was;
+}
+
+int FS_TraceRead(char* buffer, int size)
+{
+  int len = 0;
+  if(trace_next-trace_seen > TRACE_ENTRIES) trace_seen = trace_next-TRACE_ENTRIES;
+  while(trace_seen < trace_next) {
+    trace_entry_t* e = &trace_ring[trace_seen%TRACE_ENTRIES];
+    int n = snprintf(buffer+len, size-len, "%llu %s %s\n", e->ns, FS_ApiName(e->api), e->msg);
+    if(n >= size-len) break; // the rest doesn't fit
+    len += n;
+    trace_seen++;
+  }
+  if(size > 0) buffer[len] = '\0';
+  return len;
 }
@@ -20,6 +20,7 @@ typedef enum {
     E_DIR_NOT_EMPTY,
     E_ROOT_DIR,
     E_BUFFER_TOO_SMALL, 
+    E_READ_ONLY,
 } FS_Error_t;
     
 // used for errors
@@ -42,7 +43,23 @@ extern int osErrno;
 int FS_Boot(char *path);
 int FS_Sync();
 
-// file ops
+// turn dedup mode on or off (the setting is kept on disk): in dedup
+// mode, a full block written to a file shares the sector of an
+// identical block already on disk instead of taking a new one
+int FS_SetDedup(int enable);
+
+// snapshots: FS_Snapshot() freezes the current state of the file
+// system under the given name (sharing all data sectors copy-on-write),
+// and FS_BootSnapshot() boots a disk with one of its snapshots mounted
+// read-only
+int FS_Snapshot(char *name);
+int FS_SnapshotDelete(char *name);
+int FS_BootSnapshot(char *path, char *name);
+
+// file ops; the blocks a file gets by being written (outside dedup
+// mode) only get their sectors when it's closed or at FS_Sync(), all
+// at once, so running out of space may be reported (E_NO_SPACE) only
+// then; a file unlinked before that never takes any sectors
 int File_Create(char *file);
 int File_Open(char *file);
 int File_Read(int fd, void *buffer, int size);
@@ -51,10 +68,204 @@ int File_Seek(int fd, int offset);
 int File_Close(int fd);
 int File_Unlink(char *file);
 
+// batched file ops; the directory 'dir' is resolved once and the
+// whole batch either succeeds (returning n) or fails (returning -1)
+int File_CreateMany(char *dir, char **names, int n);
+int File_UnlinkMany(char *dir, char **names, int n);
+
+// move a file or directory by relinking its dirent only, and copy a
+// file within the file system; with 'share' set, the copy shares the
+// data sectors of the original (copy-on-write) instead of duplicating
+int File_Rename(char *from, char *to);
+int File_Copy(char *from, char *to, int share);
+
+// turn transparent compression of a file's content on or off
+int File_SetCompression(char *file, int enable);
+
+// map an open file into memory for reading: the returned view of its
+// content ('len' bytes) is read-only and stays valid until
+// File_Munmap(), even after the file is closed; a file whose blocks
+// follow one another on disk is viewed in place, without a copy (and
+// later writes to the file show through), any other file is copied;
+// a mapped file can't be unlinked or (de)compressed, and isn't
+// defragmented
+const void* File_Mmap(int fd, int* len);
+int File_Munmap(const void* addr);
+
+// sparse files: File_Seek() may go past the end of a file (up to
+// MAX_FILE_SIZE), and a write there leaves a hole, which takes no
+// sectors and reads as zeros; File_Truncate() cuts an open file down to
+// 'len' bytes, giving back the sectors past the end, or extends it with
+// a hole, and File_Allocate() gives the first 'len' bytes of an open
+// file zeroed sectors wherever they have none, all at once (in a single
+// run of sectors if there's one), extending the file if it's shorter;
+// neither moves the position of the file, and a mapped file can't be
+// cut down
+int File_Truncate(int fd, int len);
+int File_Allocate(int fd, int len);
+
+// write at the end of an open file (which is where its position ends
+// up); meant for files that are only appended to, as the bytes
+// appended to the last block are only written out once it fills up,
+// or before any other call is made, so small appends in a row are
+// mere memory copies
+int File_Append(int fd, void *buffer, int size);
+
+// look up a file or directory without opening it
+typedef struct {
+    int inode;      // inode number (the root directory is 0)
+    int type;       // 0 for a regular file, 1 for a directory
+    int size;       // bytes in a file, or entries in a directory
+} FS_Stat_t;
+int File_Stat(char *path, FS_Stat_t *st);
+
 // directory ops
 int Dir_Create(char *path);
 int Dir_Unlink(char *path);
 int Dir_Size(char *path);
 int Dir_Read(char *path, void *buffer, int size);
 
+// directory handles: Dir_OpenHandle() resolves the path of a directory
+// once, and the *At() calls then work on a file 'name' (a single file
+// name, not a path) right in that directory, so they cost the same
+// however deep it is; a directory with a handle open can't be unlinked
+int Dir_OpenHandle(char *path);
+int Dir_CloseHandle(int dh);
+int File_OpenAt(int dh, char *name);
+int File_CreateAt(int dh, char *name);
+int File_UnlinkAt(int dh, char *name);
+
+// consistency check (fsck): cross-check the directory tree, the inodes,
+// both bitmaps, the sector reference counts and the snapshots of the
+// booted file system, walking the tree with 'threads' threads (0 for
+// one per CPU); every problem found is counted in 'report' and passed
+// to its 'problem' callback (if set); with 'repair' set (which needs
+// the live file system with no open files), the problems are fixed:
+// bad dirents are dropped, inodes not linked are freed, invalid block
+// pointers are cleared, damaged snapshots are deleted, and the bitmaps
+// and reference counts are rebuilt (FS_Sync() saves the result);
+// return the number of problems found, or -1 on error
+typedef struct {
+    int inodes;         // inodes linked into the tree
+    int directories;    // of which directories
+    int sectors;        // sectors in use
+    int bad_dirents;    // dirents with a bad name or inode, or linking one twice
+    int bad_inodes;     // invalid flags, size or block pointers, damaged content
+    int orphans;        // inodes in use that aren't linked
+    int bitmap_errors;  // bits not matching what's in use
+    int refcnt_errors;  // sectors with a wrong reference count
+    int bad_snapshots;  // snapshots that can't be read back
+    int repaired;       // set if the problems were fixed
+    void (*problem)(const char *msg, void *arg);
+    void *arg;
+} FS_CheckReport_t;
+int FS_Check(int repair, int threads, FS_CheckReport_t *report);
+
+// fragmentation of the data blocks of files and directories, and of
+// the free sectors
+typedef struct {
+    int files;          // files and directories with data blocks
+    int fragmented;     // of which stored in more than one run of sectors
+    int extents;        // runs of consecutive sectors they're stored in
+    int blocks;         // data blocks they have
+    int free_runs;      // runs of free data sectors
+    int largest_free;   // sectors in the longest of them
+} FS_Frag_t;
+int FS_Fragmentation(FS_Frag_t *frag);
+
+// defragment the mounted file system (files may stay open): the blocks
+// of each fragmented file or directory are moved to a single run of
+// free sectors if there's one and none of them is shared, and the
+// dirent sectors a directory doesn't use are given back; 'before' and
+// 'after' (either may be NULL) get the fragmentation; return the
+// number of files and directories moved, or -1 on error
+int FS_Defrag(FS_Frag_t *before, FS_Frag_t *after);
+
+// asynchronous ops: requests submitted to a ring are carried out by a
+// pool of worker threads, and their completions are reaped later (in
+// any order, matched through 'user'); the file system calls of the
+// workers are serialized, so the caller must not make synchronous
+// calls while requests are in flight
+typedef enum {
+    FS_OP_OPEN,     // File_Open(path)
+    FS_OP_CREATE,   // File_Create(path)
+    FS_OP_CLOSE,    // File_Close(fd)
+    FS_OP_READ,     // File_Read(fd, buffer, size)
+    FS_OP_WRITE,    // File_Write(fd, buffer, size)
+} FS_Op_t;
+
+typedef struct {
+    FS_Op_t op;
+    char *path;     // for open and create
+    int fd;         // for close, read and write
+    void *buffer;   // for read and write
+    int size;       // for read and write
+    int offset;     // for read and write: where to seek first, or -1
+    void *user;     // handed back with the completion
+} FS_Request;
+
+typedef struct {
+    void *user;     // as given in the request
+    int result;     // what the call returned
+    int error;      // osErrno if result < 0
+} FS_Completion;
+
+// start 'workers' threads serving a ring of 'entries' requests; return
+// a file descriptor (an eventfd) that becomes readable whenever there
+// are completions to reap, or -1 on error
+int FS_AsyncInit(int entries, int workers);
+// submit up to 'n' requests; return how many were queued (fewer when
+// the ring is full), or -1 on error
+int FS_AsyncSubmit(FS_Request *reqs, int n);
+// reap up to 'max' completions, waiting until at least 'min' are there
+// (or nothing else is in flight); return how many were reaped
+int FS_AsyncReap(FS_Completion *cqes, int max, int min);
+// finish the requests already submitted and stop the workers
+int FS_AsyncShutdown();
+
+// statistics: every public call is accounted under its own entry,
+// including the work of any other public call it makes
+typedef enum {
+    FS_API_BOOT, FS_API_SYNC, FS_API_SET_DEDUP, FS_API_SNAPSHOT,
+    FS_API_SNAPSHOT_DELETE, FS_API_BOOT_SNAPSHOT,
+    FS_API_FILE_CREATE, FS_API_FILE_OPEN, FS_API_FILE_READ, FS_API_FILE_WRITE,
+    FS_API_FILE_SEEK, FS_API_FILE_CLOSE, FS_API_FILE_UNLINK,
+    FS_API_FILE_CREATE_MANY, FS_API_FILE_UNLINK_MANY, FS_API_FILE_RENAME,
+    FS_API_FILE_COPY, FS_API_FILE_SET_COMPRESSION, FS_API_FILE_STAT,
+    FS_API_DIR_CREATE, FS_API_DIR_UNLINK, FS_API_DIR_SIZE, FS_API_DIR_READ,
+    FS_API_CHECK, FS_API_FRAGMENTATION, FS_API_DEFRAG,
+    FS_API_FILE_MMAP, FS_API_FILE_MUNMAP, FS_API_FILE_TRUNCATE, FS_API_FILE_ALLOCATE,
+    FS_API_FILE_APPEND, FS_API_DIR_OPEN_HANDLE, FS_API_DIR_CLOSE_HANDLE,
+    FS_API_FILE_OPEN_AT, FS_API_FILE_CREATE_AT, FS_API_FILE_UNLINK_AT,
+    FS_API_COUNT
+} FS_Api_t;
+
+typedef struct {
+    unsigned long long calls;
+    unsigned long long errors;          // calls that returned -1
+    unsigned long long bytes;           // read or written by File_Read/File_Write
+    unsigned long long disk_reads;      // Disk_Read calls
+    unsigned long long disk_writes;     // Disk_Write calls
+    unsigned long long bitmap_scans;    // passes over the inode or sector bitmap
+    unsigned long long path_components; // names resolved in paths
+    unsigned long long nanoseconds;     // time spent in the calls
+} FS_ApiStats_t;
+
+typedef struct {
+    FS_ApiStats_t api[FS_API_COUNT];
+} FS_Stats_t;
+
+int FS_GetStats(FS_Stats_t *stats);
+int FS_ResetStats();
+const char *FS_ApiName(int api);
+
+// tracing: while it's on (it's off unless turned on here, or by setting
+// LIBFS_TRACE in the environment before FS_Boot()), detailed messages
+// are kept in a ring of the most recent ones; FS_Trace() returns the
+// previous setting, and FS_TraceRead() hands out the messages not read
+// yet, one per line as "<nanoseconds> <call> <message>", returning the
+// number of bytes put in 'buffer'
+int FS_Trace(int enable);
+int FS_TraceRead(char *buffer, int size);
+
 #endif /* __LibFS_h__ */
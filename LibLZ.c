@@ -0,0 +1,151 @@
+#include <string.h>
+#include "LibLZ.h"
+
+// the compressed data is a series of sequences, each made of a token
+// byte, the literal bytes and a back-reference to earlier output:
+//
+//   token: literal count (high 4 bits) and match length - MIN_MATCH
+//          (low 4 bits); a value of 15 means more bytes follow, each
+//          adding up to 255 to the count (the last one is < 255)
+//   literals, then the offset of the match (2 bytes, little endian)
+//
+// the last sequence has literals only and ends the data
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+
+// size of the hash table of recently seen 4-byte sequences
+#define HASH_BITS 12
+#define HASH_SIZE (1 << HASH_BITS)
+
+static unsigned int hash4(const unsigned char* p)
+{
+  unsigned int v;
+  memcpy(&v, p, sizeof(v));
+  return (v*2654435761u) >> (32-HASH_BITS);
+}
+
+// append a long count (beyond the 15 held by the token) to 'out'
+static int put_count(unsigned char* out, int op, int count)
+{
+  while(count >= 255) {
+    out[op++] = 255;
+    count -= 255;
+  }
+  out[op++] = count;
+  return op;
+}
+
+// append a sequence of 'nlit' literals followed by a match of 'mlen'
+// bytes (none if 0) at distance 'offset'; return the new output
+// position, or -1 if the sequence doesn't fit in 'cap' bytes
+static int put_sequence(unsigned char* out, int op, int cap,
+			const unsigned char* lit, int nlit, int offset, int mlen)
+{
+  int ml = mlen ? mlen-MIN_MATCH : 0;
+  int need = 1 + (nlit/255+1) + nlit + (mlen ? 2+(ml/255+1) : 0);
+  if(op+need > cap) return -1;
+
+  unsigned char* token = out+op++;
+  *token = (nlit >= 15 ? 15 : nlit) << 4;
+  if(nlit >= 15) op = put_count(out, op, nlit-15);
+  memcpy(out+op, lit, nlit);
+  op += nlit;
+
+  if(mlen) {
+    out[op++] = offset & 0xff;
+    out[op++] = offset >> 8;
+    *token |= (ml >= 15 ? 15 : ml);
+    if(ml >= 15) op = put_count(out, op, ml-15);
+  }
+  return op;
+}
+
+/*
+ * LZ_Compress
+ *
+ * Greedy single-pass compression: each position is looked up in a hash
+ * table of earlier 4-byte sequences, and a match is extended as far as
+ * it goes.
+ */
+int LZ_Compress(const char* src, int srclen, char* dst, int dstcap)
+{
+  const unsigned char* in = (const unsigned char*)src;
+  unsigned char* out = (unsigned char*)dst;
+  int table[HASH_SIZE];
+  int ip = 0, anchor = 0, op = 0;
+
+  if(srclen < 0 || !src || !dst) return -1;
+  for(int i=0; i<HASH_SIZE; i++) table[i] = -1;
+
+  while(ip+MIN_MATCH <= srclen) {
+    unsigned int h = hash4(in+ip);
+    int ref = table[h];
+    table[h] = ip;
+    if(ref < 0 || ip-ref > MAX_OFFSET || memcmp(in+ref, in+ip, MIN_MATCH)) {
+      ip++;
+      continue;
+    }
+
+    int mlen = MIN_MATCH;
+    while(ip+mlen < srclen && in[ref+mlen] == in[ip+mlen]) mlen++;
+    op = put_sequence(out, op, dstcap, in+anchor, ip-anchor, ip-ref, mlen);
+    if(op < 0) return -1;
+    ip += mlen;
+    anchor = ip;
+  }
+
+  // whatever is left goes out as literals
+  return put_sequence(out, op, dstcap, in+anchor, srclen-anchor, 0, 0);
+}
+
+/*
+ * LZ_Decompress
+ *
+ * Replays the sequences; every count and offset is checked against the
+ * input and output bounds, so corrupted data can't overrun 'dst'.
+ */
+int LZ_Decompress(const char* src, int srclen, char* dst, int dstcap)
+{
+  const unsigned char* in = (const unsigned char*)src;
+  unsigned char* out = (unsigned char*)dst;
+  int ip = 0, op = 0;
+
+  if(srclen < 0 || !src || !dst) return -1;
+  while(ip < srclen) {
+    int token = in[ip++];
+    int nlit = token >> 4, b;
+    if(nlit == 15) {
+      do {
+	if(ip >= srclen) return -1;
+	b = in[ip++];
+	nlit += b;
+      } while(b == 255);
+    }
+    if(nlit > srclen-ip || nlit > dstcap-op) return -1;
+    memcpy(out+op, in+ip, nlit);
+    ip += nlit;
+    op += nlit;
+    if(ip == srclen) break; // the last sequence has no match
+
+    if(ip+2 > srclen) return -1;
+    int offset = in[ip] | (in[ip+1] << 8);
+    ip += 2;
+    if(offset == 0 || offset > op) return -1;
+    int mlen = token & 15;
+    if(mlen == 15) {
+      do {
+	if(ip >= srclen) return -1;
+	b = in[ip++];
+	mlen += b;
+      } while(b == 255);
+    }
+    mlen += MIN_MATCH;
+    if(mlen > dstcap-op) return -1;
+
+    // the match may overlap the bytes it produces
+    if(offset >= mlen) memcpy(out+op, out+op-offset, mlen);
+    else for(int k=0; k<mlen; k++) out[op+k] = out[op-offset+k];
+    op += mlen;
+  }
+  return op;
+}
@@ -0,0 +1,22 @@
+//
+// LibLZ.h
+//
+// A small self-contained LZ77 codec in the spirit of LZ4 (byte-aligned
+// sequences of literals and back-references, no entropy coding), used
+// by LibFS to compress the content of files marked for compression.
+//
+//
+
+#ifndef __LibLZ_h__
+#define __LibLZ_h__
+
+// compress 'srclen' bytes from 'src' into 'dst' which has room for
+// 'dstcap' bytes; return the compressed size, or -1 if it doesn't fit
+int LZ_Compress(const char* src, int srclen, char* dst, int dstcap);
+
+// decompress 'srclen' bytes from 'src' into 'dst' which has room for
+// 'dstcap' bytes; return the decompressed size, or -1 if the input is
+// malformed or doesn't fit
+int LZ_Decompress(const char* src, int srclen, char* dst, int dstcap);
+
+#endif /* __LibLZ_h__ */
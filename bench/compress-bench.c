@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "LibFS.h"
+#include "LibLZ.h"
+
+// one input is at most the size of the largest file
+#define CHUNK 15360
+#define CODEC_ROUNDS 200
+#define SCRATCH_DISK "compress-bench-disk"
+
+typedef struct {
+  char name[64];
+  char data[CHUNK];
+  int len;
+} input_t;
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+static void make_text(input_t* in)
+{
+  static char* words[] = { "the ", "file ", "system ", "sector ", "inode ",
+			   "of ", "a ", "disk ", "is ", "written ", "to ", "and\n" };
+  strcpy(in->name, "text");
+  for(in->len = 0; in->len < CHUNK; ) {
+    char* w = words[rand()%12];
+    int n = strlen(w);
+    if(in->len+n > CHUNK) n = CHUNK-in->len;
+    memcpy(in->data+in->len, w, n);
+    in->len += n;
+  }
+}
+
+static void make_random(input_t* in)
+{
+  strcpy(in->name, "random");
+  for(in->len = 0; in->len < CHUNK; in->len++) in->data[in->len] = rand();
+}
+
+static int load_file(input_t* in, char* path)
+{
+  FILE* f = fopen(path, "rb");
+  if(!f) return -1;
+  snprintf(in->name, sizeof(in->name), "%s", path);
+  in->len = fread(in->data, 1, CHUNK, f);
+  fclose(f);
+  return in->len > 0 ? 0 : -1;
+}
+
+// compress and decompress the input repeatedly; report the ratio and
+// the throughput of both directions
+static void bench_codec(input_t* in)
+{
+  static char packed[2*CHUNK], unpacked[CHUNK];
+  int clen = 0;
+  double t0 = now();
+  for(int i=0; i<CODEC_ROUNDS; i++)
+    clen = LZ_Compress(in->data, in->len, packed, sizeof(packed));
+  double t1 = now();
+  for(int i=0; i<CODEC_ROUNDS; i++)
+    LZ_Decompress(packed, clen, unpacked, sizeof(unpacked));
+  double t2 = now();
+  if(clen < 0 || memcmp(in->data, unpacked, in->len)) {
+    printf("%-24s codec round trip FAILED\n", in->name);
+    return;
+  }
+  double mb = (double)in->len*CODEC_ROUNDS/1e6;
+  printf("%-24s %6d -> %6d bytes  ratio %5.2f  compress %7.1f MB/s  decompress %7.1f MB/s\n",
+	 in->name, in->len, clen, (double)in->len/clen, mb/(t1-t0), mb/(t2-t1));
+}
+
+// import copies of the input into a fresh file system until it's full,
+// writing each file in pieces of 'piece' bytes; report how many copies
+// fit and the import throughput
+static void bench_import(input_t* in, int compress, int piece)
+{
+  char path[32];
+  int files = 0;
+  remove(SCRATCH_DISK);
+  if(FS_Boot(SCRATCH_DISK) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", SCRATCH_DISK);
+    exit(1);
+  }
+  double t0 = now();
+  for(;; files++) {
+    sprintf(path, "/f%d", files);
+    if(File_Create(path) < 0) break;
+    if(compress && File_SetCompression(path, 1) < 0) break;
+    int fd = File_Open(path), done = 0;
+    if(fd < 0) break;
+    while(done < in->len) {
+      int n = in->len-done < piece ? in->len-done : piece;
+      if(File_Write(fd, in->data+done, n) != n) break;
+      done += n;
+    }
+    File_Close(fd);
+    if(done < in->len) break;
+  }
+  double t1 = now();
+  printf("%-24s %-10s %5d-byte writes  %4d files fit  %7.2f MB/s\n",
+	 in->name, compress ? "compressed" : "plain", piece, files,
+	 (double)in->len*files/1e6/(t1-t0));
+}
+
+int main(int argc, char *argv[])
+{
+  static input_t inputs[16];
+  int n = 0;
+
+  srand(1);
+  make_text(&inputs[n++]);
+  make_random(&inputs[n++]);
+  if(load_file(&inputs[n], "/proc/self/exe") == 0) {
+    strcpy(inputs[n].name, "binary (own executable)");
+    n++;
+  }
+  for(int i=1; i<argc && n<16; i++) {
+    if(load_file(&inputs[n], argv[i]) < 0) {
+      printf("ERROR: can't read '%s'\n", argv[i]);
+      return 1;
+    }
+    n++;
+  }
+
+  printf("== codec\n");
+  for(int i=0; i<n; i++) bench_codec(&inputs[i]);
+
+  printf("== import\n");
+  for(int i=0; i<n; i++) {
+    bench_import(&inputs[i], 0, CHUNK);
+    bench_import(&inputs[i], 1, CHUNK);
+    bench_import(&inputs[i], 1, 1024);
+  }
+  remove(SCRATCH_DISK);
+  return 0;
+}
@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "LibDisk.h"
+#include "LibFS.h"
+
+#define ROUNDS 50
+#define SCRATCH_DISK "crc-bench-disk"
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// write and then read every sector of the disk ROUNDS times; report the
+// time per sector access
+static void bench_disk(char* name, int mode)
+{
+  char buf[SECTOR_SIZE];
+  for(int i=0; i<SECTOR_SIZE; i++) buf[i] = rand();
+  Disk_SetChecksums(mode);
+  Disk_Init();
+
+  double t0 = now();
+  for(int r=0; r<ROUNDS; r++)
+    for(int s=0; s<TOTAL_SECTORS; s++) {
+      buf[0] = s;
+      Disk_Write(s, buf);
+    }
+  double t1 = now();
+  for(int r=0; r<ROUNDS; r++)
+    for(int s=0; s<TOTAL_SECTORS; s++)
+      if(Disk_Read(s, buf) < 0) {
+	printf("%-10s read of sector %d FAILED\n", name, s);
+	return;
+      }
+  double t2 = now();
+  double n = (double)ROUNDS*TOTAL_SECTORS;
+  printf("%-10s Disk_Write %7.1f ns  Disk_Read %7.1f ns\n", name, (t1-t0)/n*1e9, (t2-t1)/n*1e9);
+}
+
+// fill files and read them back through the file system
+static void bench_fs(char* name, int mode)
+{
+  static char data[MAX_FILE_SIZE];
+  char path[32];
+  Disk_SetChecksums(mode);
+  remove(SCRATCH_DISK);
+  if(FS_Boot(SCRATCH_DISK) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", SCRATCH_DISK);
+    return;
+  }
+  double t0 = now();
+  for(int i=0; i<200; i++) {
+    sprintf(path, "/f%d", i);
+    File_Create(path);
+    int fd = File_Open(path);
+    File_Write(fd, data, MAX_FILE_SIZE);
+    File_Seek(fd, 0);
+    File_Read(fd, data, MAX_FILE_SIZE);
+    File_Close(fd);
+  }
+  double t1 = now();
+  printf("%-10s 200 files written and read back %7.2f ms\n", name, (t1-t0)*1e3);
+}
+
+int main(int argc, char *argv[])
+{
+  static char* names[] = { "off", "hardware", "software" };
+  static int modes[] = { DISK_CRC_OFF, DISK_CRC_ON, DISK_CRC_SOFTWARE };
+
+  printf("== disk\n");
+  for(int i=0; i<3; i++) bench_disk(names[i], modes[i]);
+  printf("== file system\n");
+  for(int i=0; i<3; i++) bench_fs(names[i], modes[i]);
+  remove(SCRATCH_DISK);
+  remove(SCRATCH_DISK ".crc");
+  return 0;
+}
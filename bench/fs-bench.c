@@ -0,0 +1,368 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "LibDisk.h"
+#include "LibFS.h"
+
+#define SCRATCH_DISK "fs-bench-disk"
+
+// workload parameters (set from the command line)
+static int nops = 10000;  // operations measured per workload
+static int iosize = 512;  // bytes per read or write
+static int depth = 16;    // directory levels for 'lookup'
+static int width = 500;   // entries in the directory for 'wide', 'list' and 'churn'
+
+// the latency of every measured operation of the current workload
+// (including the time charged by the disk's latency model, if any) and
+// the disk accesses they made
+static double* lat;
+static int nlat;
+static Disk_Stats_t disk;
+static int accounted; // 1 if the latency model only accounts its time
+
+typedef struct {
+  const char* name;
+  const char* desc;
+  int (*run)();
+  double ops_per_sec, p50, p99, p999;
+  int ops;
+  Disk_Stats_t disk;
+} workload_t;
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// run an operation and record how long it took; a failed operation
+// aborts the workload
+#define TIMED(call) do {						\
+    Disk_Stats_t d0_, d1_;						\
+    Disk_GetStats(&d0_);						\
+    double t0_ = now();							\
+    int ret_ = (call);							\
+    double t1_ = now();							\
+    Disk_GetStats(&d1_);						\
+    lat[nlat++] = t1_-t0_+(d1_.modeled_us-d0_.modeled_us)*1e-6*accounted;	\
+    disk.reads += d1_.reads-d0_.reads;					\
+    disk.writes += d1_.writes-d0_.writes;				\
+    disk.seeks += d1_.seeks-d0_.seeks;					\
+    if(ret_ < 0) {							\
+      printf("ERROR: '%s' failed (osErrno=%d)\n", #call, osErrno);	\
+      return -1;							\
+    }									\
+  } while(0)
+
+static int fresh_fs()
+{
+  remove(SCRATCH_DISK);
+  if(FS_Boot(SCRATCH_DISK) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", SCRATCH_DISK);
+    return -1;
+  }
+  return 0;
+}
+
+// fill a file to its maximum size and return it opened
+static int full_file(char* path)
+{
+  static char buf[MAX_FILE_SIZE];
+  if(File_Create(path) < 0) return -1;
+  int fd = File_Open(path);
+  if(fd < 0 || File_Write(fd, buf, MAX_FILE_SIZE) != MAX_FILE_SIZE) return -1;
+  return fd;
+}
+
+// create files in the root directory, starting over with a fresh file
+// system whenever the directory is full
+static int run_create()
+{
+  char path[32];
+  int per_round = width;
+  for(int i=0; i<nops; i++) {
+    if(i%per_round == 0 && fresh_fs() < 0) return -1;
+    sprintf(path, "/f%d", i%per_round);
+    TIMED(File_Create(path));
+  }
+  return 0;
+}
+
+// sequential writes of 'iosize' bytes, going back to the start at the
+// maximum file size
+static int run_write()
+{
+  char buf[MAX_FILE_SIZE];
+  memset(buf, 'w', sizeof(buf));
+  if(fresh_fs() < 0 || File_Create("/f") < 0) return -1;
+  int fd = File_Open("/f");
+  if(fd < 0) return -1;
+  for(int i=0, pos=0; i<nops; i++, pos+=iosize) {
+    if(pos+iosize > MAX_FILE_SIZE) {
+      pos = 0;
+      if(File_Seek(fd, 0) < 0) return -1;
+    }
+    TIMED(File_Write(fd, buf, iosize));
+  }
+  return 0;
+}
+
+// appends of 'iosize' bytes, starting over with an empty file at the
+// maximum file size
+static int run_append()
+{
+  char buf[MAX_FILE_SIZE];
+  memset(buf, 'a', sizeof(buf));
+  if(fresh_fs() < 0 || File_Create("/f") < 0) return -1;
+  int fd = File_Open("/f");
+  if(fd < 0) return -1;
+  for(int i=0, size=0; i<nops; i++, size+=iosize) {
+    if(size+iosize > MAX_FILE_SIZE) {
+      size = 0;
+      if(File_Truncate(fd, 0) < 0) return -1;
+    }
+    TIMED(File_Append(fd, buf, iosize));
+  }
+  return 0;
+}
+
+// sequential reads of 'iosize' bytes from a full file
+static int run_read()
+{
+  char buf[MAX_FILE_SIZE];
+  int fd;
+  if(fresh_fs() < 0 || (fd = full_file("/f")) < 0 || File_Seek(fd, 0) < 0) return -1;
+  for(int i=0, pos=0; i<nops; i++, pos+=iosize) {
+    if(pos+iosize > MAX_FILE_SIZE) {
+      pos = 0;
+      if(File_Seek(fd, 0) < 0) return -1;
+    }
+    TIMED(File_Read(fd, buf, iosize));
+  }
+  return 0;
+}
+
+// a seek to a random position followed by a read of 'iosize' bytes
+static int run_seek()
+{
+  char buf[MAX_FILE_SIZE];
+  int fd;
+  if(fresh_fs() < 0 || (fd = full_file("/f")) < 0) return -1;
+  for(int i=0; i<nops; i++) {
+    int pos = rand()%(MAX_FILE_SIZE-iosize+1);
+    TIMED(File_Seek(fd, pos) < 0 ? -1 : File_Read(fd, buf, iosize));
+  }
+  return 0;
+}
+
+// resolve the path of a file 'depth' directories down
+static int run_lookup()
+{
+  char path[256] = "";
+  FS_Stat_t st;
+  if(fresh_fs() < 0) return -1;
+  for(int i=0; i<depth; i++) {
+    sprintf(path+strlen(path), "/d%d", i);
+    if(Dir_Create(path) < 0) return -1;
+  }
+  strcat(path, "/f");
+  if(File_Create(path) < 0) return -1;
+  for(int i=0; i<nops; i++) TIMED(File_Stat(path, &st));
+  return 0;
+}
+
+// open and close a file 'depth' directories down through a handle on
+// its directory
+static int run_openat()
+{
+  char path[256] = "";
+  if(fresh_fs() < 0) return -1;
+  for(int i=0; i<depth; i++) {
+    sprintf(path+strlen(path), "/d%d", i);
+    if(Dir_Create(path) < 0) return -1;
+  }
+  int dh = Dir_OpenHandle(path);
+  if(dh < 0 || File_CreateAt(dh, "f") < 0) return -1;
+  for(int i=0; i<nops; i++) {
+    int fd;
+    TIMED((fd = File_OpenAt(dh, "f")) < 0 ? -1 : File_Close(fd));
+  }
+  return Dir_CloseHandle(dh);
+}
+
+// resolve the path of one of 'width' files in the same directory
+static int run_wide()
+{
+  char path[32];
+  FS_Stat_t st;
+  if(fresh_fs() < 0 || Dir_Create("/d") < 0) return -1;
+  for(int i=0; i<width; i++) {
+    sprintf(path, "/d/f%d", i);
+    if(File_Create(path) < 0) return -1;
+  }
+  for(int i=0; i<nops; i++) {
+    sprintf(path, "/d/f%d", rand()%width);
+    TIMED(File_Stat(path, &st));
+  }
+  return 0;
+}
+
+// list a directory of 'width' entries
+static int run_list()
+{
+  char path[32];
+  if(fresh_fs() < 0 || Dir_Create("/d") < 0) return -1;
+  for(int i=0; i<width; i++) {
+    sprintf(path, "/d/f%d", i);
+    if(File_Create(path) < 0) return -1;
+  }
+  int size = Dir_Size("/d")*(16+sizeof(int)); // 16-byte name + inode per entry
+  char* buf = malloc(size);
+  for(int i=0; i<nops; i++) TIMED(Dir_Read("/d", buf, size));
+  free(buf);
+  return 0;
+}
+
+// create, write and unlink a file next to 'width' others, over and
+// over (each of the three calls is measured)
+static int run_churn()
+{
+  char path[32], buf[MAX_FILE_SIZE];
+  memset(buf, 'c', sizeof(buf));
+  if(fresh_fs() < 0) return -1;
+  for(int i=0; i<width; i++) {
+    sprintf(path, "/f%d", i);
+    if(File_Create(path) < 0) return -1;
+  }
+  for(int i=0; i<nops; i+=3) {
+    sprintf(path, "/churn%d", i%7);
+    TIMED(File_Create(path));
+    int fd = File_Open(path);
+    TIMED(File_Write(fd, buf, iosize));
+    File_Close(fd);
+    TIMED(File_Unlink(path));
+  }
+  return 0;
+}
+
+static workload_t workloads[] = {
+  { "create", "File_Create in a directory of up to 'width' files", run_create },
+  { "write", "sequential File_Write of 'size' bytes", run_write },
+  { "append", "File_Append of 'size' bytes", run_append },
+  { "read", "sequential File_Read of 'size' bytes", run_read },
+  { "seek", "File_Seek to a random position + File_Read of 'size' bytes", run_seek },
+  { "lookup", "File_Stat of a file 'depth' directories down", run_lookup },
+  { "openat", "File_OpenAt + File_Close of a file 'depth' directories down", run_openat },
+  { "wide", "File_Stat of one of 'width' files in a directory", run_wide },
+  { "list", "Dir_Read of a directory with 'width' entries", run_list },
+  { "churn", "File_Create + File_Write + File_Unlink next to 'width' files", run_churn },
+};
+#define NWORKLOADS ((int)(sizeof(workloads)/sizeof(workloads[0])))
+
+static int compare_double(const void* a, const void* b)
+{
+  double x = *(const double*)a, y = *(const double*)b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile(double p)
+{
+  int i = (int)(p*nlat);
+  if(i >= nlat) i = nlat-1;
+  return lat[i]*1e6;
+}
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [-n ops] [-s size] [-d depth] [-w width] [-j json_file] [workload...]\n", prog);
+  printf("workloads (all by default):\n");
+  for(int i=0; i<NWORKLOADS; i++) printf("  %-8s %s\n", workloads[i].name, workloads[i].desc);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  char* json = NULL;
+  int selected[NWORKLOADS], any = 0;
+  memset(selected, 0, sizeof(selected));
+
+  for(int i=1; i<argc; i++) {
+    if(argv[i][0] == '-') {
+      if(i+1 >= argc || argv[i][2]) usage(argv[0]);
+      char* val = argv[++i];
+      switch(argv[i-1][1]) {
+      case 'n': nops = atoi(val); break;
+      case 's': iosize = atoi(val); break;
+      case 'd': depth = atoi(val); break;
+      case 'w': width = atoi(val); break;
+      case 'j': json = val; break;
+      default: usage(argv[0]);
+      }
+      continue;
+    }
+    int k;
+    for(k=0; k<NWORKLOADS && strcmp(workloads[k].name, argv[i]); k++);
+    if(k == NWORKLOADS) usage(argv[0]);
+    selected[k] = any = 1;
+  }
+  if(nops <= 0 || iosize <= 0 || iosize > MAX_FILE_SIZE || depth <= 0 || depth > 60 ||
+     width <= 0 || width > 700) {
+    printf("ERROR: parameters out of range (size <= %d, depth <= 60, width <= 700)\n", MAX_FILE_SIZE);
+    return 1;
+  }
+
+  Disk_Model_t model;
+  if(Disk_GetModel(&model) == 0) accounted = !model.sleep;
+  lat = malloc((nops+3)*sizeof(double));
+  srand(1);
+  printf("%-8s %8s %12s %10s %10s %10s\n", "workload", "ops", "ops/sec", "p50(us)", "p99(us)", "p999(us)");
+  for(int i=0; i<NWORKLOADS; i++) {
+    workload_t* w = &workloads[i];
+    if(any && !selected[i]) continue;
+    nlat = 0;
+    memset(&disk, 0, sizeof(disk));
+    if(w->run() < 0) {
+      printf("ERROR: workload '%s' failed\n", w->name);
+      return 1;
+    }
+    double total = 0;
+    for(int k=0; k<nlat; k++) total += lat[k];
+    qsort(lat, nlat, sizeof(double), compare_double);
+    w->ops = nlat;
+    w->ops_per_sec = nlat/total;
+    w->p50 = percentile(0.5);
+    w->p99 = percentile(0.99);
+    w->p999 = percentile(0.999);
+    w->disk = disk;
+    printf("%-8s %8d %12.0f %10.2f %10.2f %10.2f\n", w->name, w->ops, w->ops_per_sec,
+	   w->p50, w->p99, w->p999);
+  }
+  remove(SCRATCH_DISK);
+
+  if(json) {
+    FILE* f = strcmp(json, "-") ? fopen(json, "w") : stdout;
+    if(!f) {
+      printf("ERROR: can't write '%s'\n", json);
+      return 1;
+    }
+    fprintf(f, "{\"params\": {\"ops\": %d, \"size\": %d, \"depth\": %d, \"width\": %d},\n",
+	    nops, iosize, depth, width);
+    fprintf(f, " \"results\": [");
+    for(int i=0, first=1; i<NWORKLOADS; i++) {
+      workload_t* w = &workloads[i];
+      if(any && !selected[i]) continue;
+      fprintf(f, "%s\n  {\"name\": \"%s\", \"ops\": %d, \"ops_per_sec\": %.1f, "
+	      "\"p50_us\": %.3f, \"p99_us\": %.3f, \"p999_us\": %.3f, "
+	      "\"disk_reads\": %llu, \"disk_writes\": %llu, \"disk_seeks\": %llu}",
+	      first ? "" : ",", w->name, w->ops, w->ops_per_sec, w->p50, w->p99, w->p999,
+	      w->disk.reads, w->disk.writes, w->disk.seeks);
+      first = 0;
+    }
+    fprintf(f, "\n]}\n");
+    if(f != stdout) fclose(f);
+  }
+  free(lat);
+  return 0;
+}
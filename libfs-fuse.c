@@ -0,0 +1,535 @@
+#define FUSE_USE_VERSION 34
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <fuse_lowlevel.h>
+#include "LibDisk.h"
+#include "LibFS.h"
+
+// as in LibFS.c: names are up to 15 characters, paths up to 255, and
+// a directory entry is a 16-byte name followed by the inode number
+#define MAX_NAME 16
+#define MAX_PATH 256
+#define DIRENT_SIZE (MAX_NAME+sizeof(int))
+
+// nothing changes the image behind our back, so the kernel may cache
+// names and attributes for long
+#define CACHE_TIMEOUT 60.0
+
+// FUSE numbers its inodes from 1 (the root), LibFS from 0
+#define TO_FUSE(ino) ((fuse_ino_t)(ino)+1)
+#define TO_LIBFS(ino) ((int)(ino)-1)
+
+// LibFS isn't thread-safe: the worker threads of the FUSE loop take
+// turns on it
+static pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// LibFS works with paths; the path of every inode the kernel has
+// looked up is kept here (NULL if unknown)
+static char* paths[MAX_FILES];
+
+// LibFS frees a file as soon as it's unlinked, even if it's open; so a
+// file the kernel still has open is only renamed to a hidden name in
+// the root when it's unlinked, and unlinked for good when the last
+// descriptor is released
+#define HIDDEN_PREFIX ".lfs-hidden"
+static int opens[MAX_FILES];
+static char hidden[MAX_FILES];
+
+// flags of rename(2), in case the headers don't have them
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+
+// translate osErrno into an errno value
+static int to_errno(int err)
+{
+  switch(err) {
+  case E_CREATE: return EEXIST;
+  case E_NO_SUCH_FILE:
+  case E_NO_SUCH_DIR: return ENOENT;
+  case E_TOO_MANY_OPEN_FILES: return EMFILE;
+  case E_BAD_FD: return EBADF;
+  case E_NO_SPACE: return ENOSPC;
+  case E_FILE_TOO_BIG: return EFBIG;
+  case E_SEEK_OUT_OF_BOUNDS: return EINVAL;
+  case E_FILE_IN_USE:
+  case E_ROOT_DIR: return EBUSY;
+  case E_DIR_NOT_EMPTY: return ENOTEMPTY;
+  case E_BUFFER_TOO_SMALL: return ERANGE;
+  case E_READ_ONLY: return EROFS;
+  default: return EIO;
+  }
+}
+
+// build the path of 'name' in the directory with the given (LibFS)
+// inode into 'path'; return 0 if successful, or an errno value
+static int child_path(int parent, const char* name, char* path)
+{
+  if(parent < 0 || parent >= MAX_FILES || !paths[parent]) return ENOENT;
+  if(strlen(name) >= MAX_NAME) return ENAMETOOLONG;
+  int n = snprintf(path, MAX_PATH, "%s/%s", strcmp(paths[parent], "/") ? paths[parent] : "", name);
+  return n < MAX_PATH ? 0 : ENAMETOOLONG;
+}
+
+static void remember_path(int ino, const char* path)
+{
+  if(paths[ino] && !strcmp(paths[ino], path)) return;
+  free(paths[ino]);
+  paths[ino] = strdup(path);
+}
+
+static void stat_to_attr(FS_Stat_t* fs, struct stat* st)
+{
+  memset(st, 0, sizeof(*st));
+  st->st_ino = TO_FUSE(fs->inode);
+  st->st_uid = getuid();
+  st->st_gid = getgid();
+  if(fs->type == 1) {
+    st->st_mode = S_IFDIR | 0755;
+    st->st_nlink = 2;
+    st->st_size = fs->size;
+  } else {
+    st->st_mode = S_IFREG | 0644;
+    st->st_nlink = 1;
+    st->st_size = fs->size;
+    st->st_blocks = (fs->size+511)/512;
+  }
+  st->st_blksize = 512;
+}
+
+// look up a path and fill in the entry to reply with (the lock must be
+// held); return 0 if successful, or an errno value
+static int make_entry(const char* path, struct fuse_entry_param* e)
+{
+  FS_Stat_t fs;
+  if(File_Stat((char*)path, &fs) < 0) return to_errno(osErrno);
+  remember_path(fs.inode, path);
+  memset(e, 0, sizeof(*e));
+  e->ino = TO_FUSE(fs.inode);
+  e->attr_timeout = CACHE_TIMEOUT;
+  e->entry_timeout = CACHE_TIMEOUT;
+  stat_to_attr(&fs, &e->attr);
+  return 0;
+}
+
+static void lfs_init(void* userdata, struct fuse_conn_info* conn)
+{
+  // answer every directory listing with attributes, so that 'ls -l'
+  // or a tree walk needs no lookup per entry
+  if(conn->capable & FUSE_CAP_READDIRPLUS) conn->want |= FUSE_CAP_READDIRPLUS;
+  conn->want &= ~FUSE_CAP_READDIRPLUS_AUTO;
+}
+
+static void lfs_destroy(void* userdata)
+{
+  pthread_mutex_lock(&fs_lock);
+  if(FS_Sync() < 0) fprintf(stderr, "ERROR: can't sync disk at unmount\n");
+  pthread_mutex_unlock(&fs_lock);
+}
+
+static void lfs_lookup(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+  char path[MAX_PATH];
+  struct fuse_entry_param e;
+  pthread_mutex_lock(&fs_lock);
+  int err = child_path(TO_LIBFS(parent), name, path);
+  if(!err) err = make_entry(path, &e);
+  pthread_mutex_unlock(&fs_lock);
+  if(err) fuse_reply_err(req, err);
+  else fuse_reply_entry(req, &e);
+}
+
+static void lfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+  FS_Stat_t fs;
+  struct stat st;
+  int err = 0;
+  pthread_mutex_lock(&fs_lock);
+  if(!paths[TO_LIBFS(ino)]) err = ENOENT;
+  else if(File_Stat(paths[TO_LIBFS(ino)], &fs) < 0) err = to_errno(osErrno);
+  pthread_mutex_unlock(&fs_lock);
+  if(err) {
+    fuse_reply_err(req, err);
+    return;
+  }
+  stat_to_attr(&fs, &st);
+  fuse_reply_attr(req, &st, CACHE_TIMEOUT);
+}
+
+// set the size of a file through 'fd', or through a descriptor of its
+// own if it's -1
+static int truncate_file(char* path, int fd, off_t size)
+{
+  if(size > MAX_FILE_SIZE) return EFBIG;
+  int own = fd < 0;
+  if(own && (fd = File_Open(path)) < 0) return to_errno(osErrno);
+  int err = File_Truncate(fd, size) < 0 ? to_errno(osErrno) : 0;
+  if(own) File_Close(fd);
+  return err;
+}
+
+// only the size of a file can change; other attribute changes make no
+// difference (like the times touched by 'cp -p' or 'tar') and are
+// accepted as they are
+static void lfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr,
+			int to_set, struct fuse_file_info* fi)
+{
+  FS_Stat_t fs;
+  struct stat st;
+  int err = 0;
+  pthread_mutex_lock(&fs_lock);
+  char* path = paths[TO_LIBFS(ino)];
+  if(!path) err = ENOENT;
+  else if(File_Stat(path, &fs) < 0) err = to_errno(osErrno);
+  else if((to_set & FUSE_SET_ATTR_SIZE) && attr->st_size != fs.size) {
+    if(fs.type != 0) err = EISDIR;
+    else if(!(err = truncate_file(path, fi ? (int)fi->fh : -1, attr->st_size)) &&
+	    File_Stat(path, &fs) < 0) err = to_errno(osErrno);
+  }
+  pthread_mutex_unlock(&fs_lock);
+  if(err) {
+    fuse_reply_err(req, err);
+    return;
+  }
+  stat_to_attr(&fs, &st);
+  fuse_reply_attr(req, &st, CACHE_TIMEOUT);
+}
+
+static void lfs_create(fuse_req_t req, fuse_ino_t parent, const char* name,
+		       mode_t mode, struct fuse_file_info* fi)
+{
+  char path[MAX_PATH];
+  struct fuse_entry_param e;
+  pthread_mutex_lock(&fs_lock);
+  int err = child_path(TO_LIBFS(parent), name, path);
+  if(!err && File_Create(path) < 0) err = to_errno(osErrno);
+  if(!err) err = make_entry(path, &e);
+  int fd = -1;
+  if(!err && (fd = File_Open(path)) < 0) err = to_errno(osErrno);
+  if(!err) opens[TO_LIBFS(e.ino)]++;
+  pthread_mutex_unlock(&fs_lock);
+  if(err) {
+    fuse_reply_err(req, err);
+    return;
+  }
+  fi->fh = fd;
+  fi->keep_cache = 1;
+  fuse_reply_create(req, &e, fi);
+}
+
+static void lfs_mkdir(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode)
+{
+  char path[MAX_PATH];
+  struct fuse_entry_param e;
+  pthread_mutex_lock(&fs_lock);
+  int err = child_path(TO_LIBFS(parent), name, path);
+  if(!err && Dir_Create(path) < 0) err = to_errno(osErrno);
+  if(!err) err = make_entry(path, &e);
+  pthread_mutex_unlock(&fs_lock);
+  if(err) fuse_reply_err(req, err);
+  else fuse_reply_entry(req, &e);
+}
+
+// remove a file or directory and forget its path; an open file is
+// hidden instead (see opens[])
+static void remove_child(fuse_req_t req, fuse_ino_t parent, const char* name, int dir)
+{
+  char path[MAX_PATH];
+  FS_Stat_t fs;
+  pthread_mutex_lock(&fs_lock);
+  int err = child_path(TO_LIBFS(parent), name, path);
+  if(!err && File_Stat(path, &fs) < 0) err = to_errno(osErrno);
+  if(!err && !dir && opens[fs.inode] > 0) {
+    char hidden_path[MAX_PATH];
+    snprintf(hidden_path, sizeof(hidden_path), "/" HIDDEN_PREFIX "%d", fs.inode);
+    if(File_Rename(path, hidden_path) < 0) err = to_errno(osErrno);
+    else {
+      remember_path(fs.inode, hidden_path);
+      hidden[fs.inode] = 1;
+    }
+  } else if(!err) {
+    if((dir ? Dir_Unlink(path) : File_Unlink(path)) < 0) err = to_errno(osErrno);
+    else {
+      free(paths[fs.inode]);
+      paths[fs.inode] = NULL;
+    }
+  }
+  pthread_mutex_unlock(&fs_lock);
+  fuse_reply_err(req, err);
+}
+
+static void lfs_unlink(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+  remove_child(req, parent, name, 0);
+}
+
+static void lfs_rmdir(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+  remove_child(req, parent, name, 1);
+}
+
+// LibFS can't replace an existing entry nor exchange two, so only a
+// rename to a new name is done; the paths of the entry and of all that
+// lies under it follow
+static void lfs_rename(fuse_req_t req, fuse_ino_t parent, const char* name,
+		       fuse_ino_t newparent, const char* newname, unsigned int flags)
+{
+  char from[MAX_PATH], to[MAX_PATH];
+  FS_Stat_t fs, target;
+  if(flags & ~RENAME_NOREPLACE) {
+    fuse_reply_err(req, EINVAL);
+    return;
+  }
+  pthread_mutex_lock(&fs_lock);
+  int err = child_path(TO_LIBFS(parent), name, from);
+  if(!err) err = child_path(TO_LIBFS(newparent), newname, to);
+  if(!err && File_Stat(from, &fs) < 0) err = to_errno(osErrno);
+  int same = 0;
+  if(!err && File_Stat(to, &target) == 0) {
+    if(target.inode == fs.inode) same = 1;
+    else err = (flags & RENAME_NOREPLACE) ? EEXIST : ENOTSUP;
+  }
+  // what's left is a directory moved under itself
+  if(!err && !same && File_Rename(from, to) < 0)
+    err = osErrno == E_CREATE ? EINVAL : to_errno(osErrno);
+  if(!err && !same && paths[fs.inode]) {
+    char* old = strdup(paths[fs.inode]);
+    size_t len = old ? strlen(old) : 0;
+    for(int i=0; old && i<MAX_FILES; i++) {
+      if(!paths[i] || strncmp(paths[i], old, len) || (paths[i][len] && paths[i][len] != '/'))
+	continue;
+      char moved[MAX_PATH];
+      if(snprintf(moved, sizeof(moved), "%s%s", to, paths[i]+len) < MAX_PATH)
+	remember_path(i, moved);
+      else {
+	free(paths[i]);
+	paths[i] = NULL;
+      }
+    }
+    free(old);
+  }
+  pthread_mutex_unlock(&fs_lock);
+  fuse_reply_err(req, err);
+}
+
+static void lfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+  FS_Stat_t fs;
+  int err = 0, fd = -1;
+  pthread_mutex_lock(&fs_lock);
+  char* path = paths[TO_LIBFS(ino)];
+  if(!path) err = ENOENT;
+  else if(File_Stat(path, &fs) < 0) err = to_errno(osErrno);
+  else if((fd = File_Open(path)) < 0) err = to_errno(osErrno);
+  else if((fi->flags & O_TRUNC) && fs.size > 0 && (err = truncate_file(path, fd, 0)))
+    File_Close(fd);
+  if(!err) opens[TO_LIBFS(ino)]++;
+  pthread_mutex_unlock(&fs_lock);
+  if(err) {
+    fuse_reply_err(req, err);
+    return;
+  }
+  // all writes come through here, so cached pages stay valid
+  fi->fh = fd;
+  fi->keep_cache = 1;
+  fuse_reply_open(req, fi);
+}
+
+static void lfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+  int i = TO_LIBFS(ino);
+  pthread_mutex_lock(&fs_lock);
+  File_Close(fi->fh);
+  if(--opens[i] == 0 && hidden[i]) {
+    if(File_Unlink(paths[i]) < 0)
+      fprintf(stderr, "ERROR: can't unlink hidden file '%s'\n", paths[i]);
+    free(paths[i]);
+    paths[i] = NULL;
+    hidden[i] = 0;
+  }
+  pthread_mutex_unlock(&fs_lock);
+  fuse_reply_err(req, 0);
+}
+
+static void lfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+		     struct fuse_file_info* fi)
+{
+  char buf[MAX_FILE_SIZE];
+  int n = 0, err = 0;
+  // the descriptor works even if the file has been renamed or unlinked,
+  // and reads nothing past the end of the file
+  pthread_mutex_lock(&fs_lock);
+  if(off < MAX_FILE_SIZE) {
+    if(size > sizeof(buf)) size = sizeof(buf);
+    if(File_Seek(fi->fh, off) < 0 || (n = File_Read(fi->fh, buf, size)) < 0)
+      err = to_errno(osErrno);
+  }
+  pthread_mutex_unlock(&fs_lock);
+  if(err) fuse_reply_err(req, err);
+  else fuse_reply_buf(req, buf, n);
+}
+
+static void lfs_write(fuse_req_t req, fuse_ino_t ino, const char* buf, size_t size,
+		      off_t off, struct fuse_file_info* fi)
+{
+  int n = 0, err = 0;
+  // a write crossing the largest file size is cut short there, and
+  // only one starting there fails
+  if(off >= MAX_FILE_SIZE) {
+    fuse_reply_err(req, EFBIG);
+    return;
+  }
+  if(off+size > MAX_FILE_SIZE) size = MAX_FILE_SIZE-off;
+  pthread_mutex_lock(&fs_lock);
+  if(File_Seek(fi->fh, off) < 0 || (n = File_Write(fi->fh, (void*)buf, size)) < 0)
+    err = to_errno(osErrno);
+  pthread_mutex_unlock(&fs_lock);
+  if(err) fuse_reply_err(req, err);
+  else fuse_reply_write(req, n);
+}
+
+static void lfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info* fi)
+{
+  pthread_mutex_lock(&fs_lock);
+  int err = FS_Sync() < 0 ? to_errno(osErrno) : 0;
+  pthread_mutex_unlock(&fs_lock);
+  fuse_reply_err(req, err);
+}
+
+// list a directory starting from the 'off'-th entry; with 'plus' set,
+// each entry comes with its attributes
+static void list_dir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, int plus)
+{
+  char* reply = malloc(size);
+  char* entries = NULL;
+  size_t used = 0;
+  int err = 0;
+  if(!reply) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+
+  pthread_mutex_lock(&fs_lock);
+  char* path = paths[TO_LIBFS(ino)];
+  int count = path ? Dir_Size(path) : -1, n = 0;
+  if(count < 0) err = path ? to_errno(osErrno) : ENOENT;
+  else if(!(entries = malloc(count*DIRENT_SIZE+1))) err = ENOMEM;
+  else if((n = Dir_Read(path, entries, count*DIRENT_SIZE)) < 0) err = to_errno(osErrno);
+
+  for(int i=off; !err && i<n; i++) {
+    char name[MAX_NAME+1], child[MAX_PATH];
+    memcpy(name, entries+i*DIRENT_SIZE, MAX_NAME);
+    name[MAX_NAME] = '\0';
+    int child_ino;
+    memcpy(&child_ino, entries+i*DIRENT_SIZE+MAX_NAME, sizeof(int));
+    if(!strncmp(name, HIDDEN_PREFIX, strlen(HIDDEN_PREFIX))) continue;
+
+    size_t len;
+    if(plus) {
+      struct fuse_entry_param e;
+      if(child_path(TO_LIBFS(ino), name, child) || make_entry(child, &e)) continue;
+      len = fuse_add_direntry_plus(req, reply+used, size-used, name, &e, i+1);
+    } else {
+      struct stat st;
+      memset(&st, 0, sizeof(st));
+      st.st_ino = TO_FUSE(child_ino);
+      len = fuse_add_direntry(req, reply+used, size-used, name, &st, i+1);
+    }
+    if(len > size-used) break;
+    used += len;
+  }
+  pthread_mutex_unlock(&fs_lock);
+
+  free(entries);
+  if(err) fuse_reply_err(req, err);
+  else fuse_reply_buf(req, reply, used);
+  free(reply);
+}
+
+static void lfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+			struct fuse_file_info* fi)
+{
+  list_dir(req, ino, size, off, 0);
+}
+
+static void lfs_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+			    struct fuse_file_info* fi)
+{
+  list_dir(req, ino, size, off, 1);
+}
+
+static const struct fuse_lowlevel_ops lfs_ops = {
+  .init = lfs_init,
+  .destroy = lfs_destroy,
+  .lookup = lfs_lookup,
+  .getattr = lfs_getattr,
+  .setattr = lfs_setattr,
+  .create = lfs_create,
+  .mkdir = lfs_mkdir,
+  .unlink = lfs_unlink,
+  .rmdir = lfs_rmdir,
+  .rename = lfs_rename,
+  .open = lfs_open,
+  .release = lfs_release,
+  .read = lfs_read,
+  .write = lfs_write,
+  .fsync = lfs_fsync,
+  .readdir = lfs_readdir,
+  .readdirplus = lfs_readdirplus,
+};
+
+void usage(char *prog)
+{
+  printf("USAGE: %s disk mountpoint [FUSE options]\n", prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc < 3 || argv[1][0] == '-') usage(argv[0]);
+  char* diskfile = argv[1];
+  if(FS_Boot(diskfile) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+  paths[0] = strdup("/");
+
+  // what's left of the command line is for FUSE
+  argv[1] = argv[0];
+  struct fuse_args args = FUSE_ARGS_INIT(argc-1, argv+1);
+  struct fuse_cmdline_opts opts;
+  if(fuse_parse_cmdline(&args, &opts) != 0) return 1;
+  if(opts.show_help || !opts.mountpoint) {
+    if(opts.show_help) fuse_lowlevel_help();
+    else usage(argv[0]);
+    return 0;
+  }
+
+  int ret = 1;
+  struct fuse_session* se = fuse_session_new(&args, &lfs_ops, sizeof(lfs_ops), NULL);
+  if(se && fuse_set_signal_handlers(se) == 0) {
+    if(fuse_session_mount(se, opts.mountpoint) == 0) {
+      fuse_daemonize(opts.foreground);
+      if(opts.singlethread) ret = fuse_session_loop(se);
+      else {
+	struct fuse_loop_config config;
+	config.clone_fd = opts.clone_fd;
+	config.max_idle_threads = opts.max_idle_threads;
+	ret = fuse_session_loop_mt(se, &config);
+      }
+      fuse_session_unmount(se);
+    }
+    fuse_remove_signal_handlers(se);
+  }
+  if(se) fuse_session_destroy(se);
+  free(opts.mountpoint);
+  fuse_opt_free_args(&args);
+  return ret ? 1 : 0;
+}
@@ -0,0 +1,36 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "LibFS.h"
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [disk] on|off\n", prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile, *mode;
+  if(argc != 2 && argc != 3) usage(argv[0]);
+  if(argc == 3) { diskfile = argv[1]; mode = argv[2]; }
+  else { diskfile = "default-disk"; mode = argv[1]; }
+  if(strcmp(mode, "on") && strcmp(mode, "off")) usage(argv[0]);
+
+  if(FS_Boot(diskfile) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+  
+  if(FS_SetDedup(!strcmp(mode, "on")) < 0) {
+    printf("ERROR: can't turn dedup %s\n", mode);
+    return -2;
+  }
+  printf("dedup turned %s successfully\n", mode);
+
+  if(FS_Sync() < 0) {
+    printf("ERROR: can't sync disk '%s'\n", diskfile);
+    return -3;
+  }
+  return 0;
+}
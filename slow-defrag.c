@@ -0,0 +1,46 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "LibFS.h"
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [disk]\n", prog);
+  exit(1);
+}
+
+static void show(char *when, FS_Frag_t *frag)
+{
+  printf("%-7s %6d %10d %8d %8d %10d %13d\n", when, frag->files, frag->fragmented,
+	 frag->extents, frag->blocks, frag->free_runs, frag->largest_free);
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile = "default-disk";
+  if(argc > 2) usage(argv[0]);
+  if(argc == 2) diskfile = argv[1];
+
+  if(FS_Boot(diskfile) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+
+  FS_Frag_t before, after;
+  int moved = FS_Defrag(&before, &after);
+  if(moved < 0) {
+    printf("ERROR: can't defragment file system on '%s'\n", diskfile);
+    return -2;
+  }
+  printf("%-7s %6s %10s %8s %8s %10s %13s\n", "", "files", "fragmented", "extents",
+	 "blocks", "free runs", "largest free");
+  show("before", &before);
+  show("after", &after);
+  printf("%d files moved\n", moved);
+
+  if(FS_Sync() < 0) {
+    printf("ERROR: can't sync disk '%s'\n", diskfile);
+    return -3;
+  }
+  return 0;
+}
@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "LibFS.h"
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [-r] [-j threads] [disk]\n", prog);
+  exit(1);
+}
+
+static void problem(const char *msg, void *arg)
+{
+  printf("%s\n", msg);
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile = "default-disk";
+  int repair = 0, threads = 0;
+  for(int i=1; i<argc; i++) {
+    if(!strcmp(argv[i], "-r")) repair = 1;
+    else if(!strcmp(argv[i], "-j") && i+1 < argc) threads = atoi(argv[++i]);
+    else if(argv[i][0] == '-') usage(argv[0]);
+    else diskfile = argv[i];
+  }
+
+  if(FS_Boot(diskfile) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+
+  FS_CheckReport_t report;
+  memset(&report, 0, sizeof(report));
+  report.problem = problem;
+  int problems = FS_Check(repair, threads, &report);
+  if(problems < 0) {
+    printf("ERROR: can't check file system on '%s'\n", diskfile);
+    return -2;
+  }
+  printf("%d inodes (%d directories), %d sectors in use\n",
+	 report.inodes, report.directories, report.sectors);
+  if(problems == 0) {
+    printf("file system is clean\n");
+    return 0;
+  }
+  printf("%d problems: %d bad dirents, %d bad inodes, %d orphans, %d bitmap errors, "
+	 "%d reference count errors, %d bad snapshots\n", problems,
+	 report.bad_dirents, report.bad_inodes, report.orphans, report.bitmap_errors,
+	 report.refcnt_errors, report.bad_snapshots);
+  if(!report.repaired) return 1;
+
+  if(FS_Sync() < 0) {
+    printf("ERROR: can't sync disk '%s'\n", diskfile);
+    return -3;
+  }
+  printf("file system repaired\n");
+  return 0;
+}
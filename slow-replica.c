@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "LibDisk.h"
+
+// keeps a replica of a disk mirrored to "unix:<socket>" (see
+// Disk_SetMirror()), saving it at every sync and when the connection
+// ends; it serves one connection at a time until it's killed
+
+void usage(char *prog)
+{
+  printf("USAGE: %s socket [disk]\n", prog);
+  exit(1);
+}
+
+// read exactly 'size' bytes; return 0 at the end of the connection
+static int read_full(int fd, void* buf, int size)
+{
+  for(int got=0; got<size; ) {
+    int n = read(fd, (char*)buf+got, size-got);
+    if(n <= 0) return 0;
+    got += n;
+  }
+  return 1;
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile = "default-disk";
+  if(argc < 2 || argc > 3) usage(argv[0]);
+  if(argc == 3) diskfile = argv[2];
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(strlen(argv[1]) >= sizeof(addr.sun_path)) usage(argv[0]);
+  strcpy(addr.sun_path, argv[1]);
+
+  // the replica isn't mirrored itself; it starts as the image saved
+  // last, if there's one
+  Disk_SetMirror(NULL, 0);
+  if(Disk_Init() < 0) {
+    printf("ERROR: can't initialize disk\n");
+    return -1;
+  }
+  if(Disk_Load(diskfile) < 0 && diskErrno != E_OPENING_FILE) {
+    printf("ERROR: can't load disk from file '%s'\n", diskfile);
+    return -2;
+  }
+
+  unlink(argv[1]);
+  int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(lfd < 0 || bind(lfd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(lfd, 1) < 0) {
+    printf("ERROR: can't listen on '%s'\n", argv[1]);
+    return -3;
+  }
+  printf("replicating to '%s' through '%s'\n", diskfile, argv[1]);
+  fflush(stdout);
+
+  for(;;) {
+    int fd = accept(lfd, NULL, NULL);
+    if(fd < 0) continue;
+    Disk_MirrorRecord_t r;
+    unsigned long long records = 0;
+    while(read_full(fd, &r, sizeof(r))) {
+      if(r.sector != DISK_MIRROR_SYNC) {
+	if(Disk_Write(r.sector, r.data) < 0) break;
+	records++;
+	continue;
+      }
+      char ack = 1;
+      if(Disk_Save(diskfile) < 0 || write(fd, &ack, 1) != 1) break;
+    }
+    close(fd);
+    if(Disk_Save(diskfile) < 0) printf("ERROR: can't save disk to file '%s'\n", diskfile);
+    printf("connection closed after %llu sectors\n", records);
+    fflush(stdout);
+  }
+  return 0;
+}
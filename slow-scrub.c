@@ -0,0 +1,37 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "LibDisk.h"
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [disk]\n", prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile = "default-disk";
+  if(argc > 2) usage(argv[0]);
+  if(argc == 2) diskfile = argv[1];
+
+  if(Disk_Init() < 0 || Disk_Load(diskfile) < 0) {
+    printf("ERROR: can't load disk from file '%s'%s\n", diskfile,
+	   diskErrno == E_READING_FILE ? " (or its checksums)" : "");
+    return -1;
+  }
+  if(Disk_GetChecksums() == DISK_CRC_OFF) {
+    printf("ERROR: disk '%s' has no checksums\n", diskfile);
+    return -2;
+  }
+
+  int bad[TOTAL_SECTORS];
+  int n = Disk_Scrub(bad, TOTAL_SECTORS);
+  if(n < 0) {
+    printf("ERROR: can't scrub disk '%s'\n", diskfile);
+    return -3;
+  }
+  for(int i=0; i<n; i++) printf("sector %d doesn't match its checksum\n", bad[i]);
+  printf("%d sectors scrubbed, %d bad\n", TOTAL_SECTORS, n);
+  return n > 0;
+}